@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "alloc.h"
+
+// One free extent, linked into both treaps
+struct FreeExtent {
+    int64_t start;
+    int64_t len;
+    int64_t max_len;               // largest len in this node's offset subtree
+    uint32_t prio;
+    struct FreeExtent *oleft, *oright;    // offset-ordered children
+    struct FreeExtent *sleft, *sright;    // size-ordered children
+};
+
+static struct FreeExtent *by_off = NULL;
+static struct FreeExtent *by_size = NULL;
+static enum AllocPolicy policy = ALLOC_FIRST_FIT;
+static int64_t next_cursor = 0;
+static int64_t free_total = 0;
+static int extent_count = 0;
+static uint32_t rng_state = 2463534242u;
+
+static uint32_t next_prio() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// ---- offset treap ----
+
+static void off_update(struct FreeExtent *n) {
+    n->max_len = n->len;
+    if (n->oleft && n->oleft->max_len > n->max_len) n->max_len = n->oleft->max_len;
+    if (n->oright && n->oright->max_len > n->max_len) n->max_len = n->oright->max_len;
+}
+
+// Split t into nodes with start < key (l) and start >= key (r)
+static void off_split(struct FreeExtent *t, int64_t key, struct FreeExtent **l, struct FreeExtent **r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    if (t->start < key) {
+        off_split(t->oright, key, &t->oright, r);
+        *l = t;
+    } else {
+        off_split(t->oleft, key, l, &t->oleft);
+        *r = t;
+    }
+    off_update(t);
+}
+
+static struct FreeExtent *off_merge(struct FreeExtent *l, struct FreeExtent *r) {
+    if (!l) return r;
+    if (!r) return l;
+    if (l->prio > r->prio) {
+        l->oright = off_merge(l->oright, r);
+        off_update(l);
+        return l;
+    }
+    r->oleft = off_merge(l, r->oleft);
+    off_update(r);
+    return r;
+}
+
+// ---- size treap, ordered by (len, start) ----
+
+static int size_less(int64_t alen, int64_t astart, int64_t blen, int64_t bstart) {
+    return alen < blen || (alen == blen && astart < bstart);
+}
+
+static void size_split(struct FreeExtent *t, int64_t len, int64_t start,
+                       struct FreeExtent **l, struct FreeExtent **r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    if (size_less(t->len, t->start, len, start)) {
+        size_split(t->sright, len, start, &t->sright, r);
+        *l = t;
+    } else {
+        size_split(t->sleft, len, start, l, &t->sleft);
+        *r = t;
+    }
+}
+
+static struct FreeExtent *size_merge(struct FreeExtent *l, struct FreeExtent *r) {
+    if (!l) return r;
+    if (!r) return l;
+    if (l->prio > r->prio) {
+        l->sright = size_merge(l->sright, r);
+        return l;
+    }
+    r->sleft = size_merge(l, r->sleft);
+    return r;
+}
+
+// ---- node insertion/removal in both trees ----
+
+static void extent_insert(struct FreeExtent *n) {
+    struct FreeExtent *l, *r;
+    n->oleft = n->oright = n->sleft = n->sright = NULL;
+    n->max_len = n->len;
+    off_split(by_off, n->start, &l, &r);
+    by_off = off_merge(off_merge(l, n), r);
+    size_split(by_size, n->len, n->start, &l, &r);
+    by_size = size_merge(size_merge(l, n), r);
+    free_total += n->len;
+    extent_count++;
+}
+
+static void extent_remove(struct FreeExtent *n) {
+    struct FreeExtent *l, *m, *r;
+    off_split(by_off, n->start, &l, &r);
+    off_split(r, n->start + 1, &m, &r);
+    by_off = off_merge(l, r);
+    size_split(by_size, n->len, n->start, &l, &r);
+    size_split(r, n->len, n->start + 1, &m, &r);
+    by_size = size_merge(l, r);
+    free_total -= n->len;
+    extent_count--;
+}
+
+static int add_extent(int64_t start, int64_t len) {
+    struct FreeExtent *n = malloc(sizeof(*n));
+    if (!n) return -1;
+    n->start = start;
+    n->len = len;
+    n->prio = next_prio();
+    extent_insert(n);
+    return 0;
+}
+
+static void free_tree(struct FreeExtent *n) {
+    if (!n) return;
+    free_tree(n->oleft);
+    free_tree(n->oright);
+    free(n);
+}
+
+// Extent with the greatest start <= key
+static struct FreeExtent *find_at_or_before(int64_t key) {
+    struct FreeExtent *n = by_off, *best = NULL;
+    while (n) {
+        if (n->start <= key) {
+            best = n;
+            n = n->oright;
+        } else {
+            n = n->oleft;
+        }
+    }
+    return best;
+}
+
+// Extent with the smallest start > key
+static struct FreeExtent *find_after(int64_t key) {
+    struct FreeExtent *n = by_off, *best = NULL;
+    while (n) {
+        if (n->start > key) {
+            best = n;
+            n = n->oleft;
+        } else {
+            n = n->oright;
+        }
+    }
+    return best;
+}
+
+// Lowest-addressed extent with start >= min_start and len >= need
+static struct FreeExtent *find_fit_from(struct FreeExtent *n, int64_t min_start, int64_t need) {
+    if (!n || n->max_len < need) return NULL;
+    if (n->start < min_start) return find_fit_from(n->oright, min_start, need);
+    struct FreeExtent *found = find_fit_from(n->oleft, min_start, need);
+    if (found) return found;
+    if (n->len >= need) return n;
+    return find_fit_from(n->oright, min_start, need);
+}
+
+// Smallest extent with len >= need
+static struct FreeExtent *find_best_fit(int64_t need) {
+    struct FreeExtent *n = by_size, *best = NULL;
+    while (n) {
+        if (n->len >= need) {
+            best = n;
+            n = n->sleft;
+        } else {
+            n = n->sright;
+        }
+    }
+    return best;
+}
+
+// ---- public interface ----
+
+void alloc_reset(int64_t start, int64_t len) {
+    free_tree(by_off);
+    by_off = by_size = NULL;
+    free_total = 0;
+    extent_count = 0;
+    next_cursor = start;
+    if (len > 0) add_extent(start, len);
+}
+
+int alloc_reserve(int64_t start, int64_t len) {
+    if (len <= 0) return 0;
+    struct FreeExtent *n = find_at_or_before(start);
+    if (!n || n->start + n->len < start + len) return -1;
+    int64_t head = start - n->start;
+    int64_t tail_start = start + len;
+    int64_t tail = n->start + n->len - tail_start;
+    extent_remove(n);
+    if (head > 0) {
+        n->len = head;
+        extent_insert(n);
+    } else {
+        free(n);
+    }
+    if (tail > 0) add_extent(tail_start, tail);
+    return 0;
+}
+
+int64_t alloc_take(int64_t len) {
+    if (len <= 0) return -1;
+    struct FreeExtent *n = NULL;
+    switch (policy) {
+        case ALLOC_BEST_FIT:
+            n = find_best_fit(len);
+            break;
+        case ALLOC_NEXT_FIT:
+            n = find_fit_from(by_off, next_cursor, len);
+            if (!n) n = find_fit_from(by_off, INT64_MIN, len);
+            break;
+        case ALLOC_FIRST_FIT:
+        default:
+            n = find_fit_from(by_off, INT64_MIN, len);
+            break;
+    }
+    if (!n) return -1;
+    int64_t start = n->start;
+    extent_remove(n);
+    if (n->len > len) {
+        n->start += len;
+        n->len -= len;
+        extent_insert(n);
+    } else {
+        free(n);
+    }
+    next_cursor = start + len;
+    return start;
+}
+
+int64_t alloc_take_upto(int64_t max, int64_t *got) {
+    *got = 0;
+    if (max <= 0 || !by_off) return -1;
+    int64_t len = by_off->max_len < max ? by_off->max_len : max;
+    int64_t start = alloc_take(len);
+    if (start >= 0) *got = len;
+    return start;
+}
+
+int64_t alloc_free_at(int64_t pos) {
+    struct FreeExtent *n = find_at_or_before(pos);
+    if (!n || n->start + n->len <= pos) return 0;
+    return n->start + n->len - pos;
+}
+
+int64_t alloc_lowest_fit(int64_t len) {
+    if (len <= 0) return -1;
+    struct FreeExtent *n = find_fit_from(by_off, INT64_MIN, len);
+    return n ? n->start : -1;
+}
+
+void alloc_release(int64_t start, int64_t len) {
+    if (len <= 0) return;
+    struct FreeExtent *prev = find_at_or_before(start - 1);
+    struct FreeExtent *next = find_after(start);
+    if (prev && prev->start + prev->len == start) {
+        extent_remove(prev);
+        start = prev->start;
+        len += prev->len;
+        free(prev);
+    }
+    if (next && next->start == start + len) {
+        extent_remove(next);
+        len += next->len;
+        free(next);
+    }
+    add_extent(start, len);
+}
+
+void alloc_set_policy(enum AllocPolicy p) {
+    policy = p;
+}
+
+enum AllocPolicy alloc_get_policy() {
+    return policy;
+}
+
+int64_t alloc_free_total() {
+    return free_total;
+}
+
+int64_t alloc_largest_free() {
+    return by_off ? by_off->max_len : 0;
+}
+
+int alloc_extent_count() {
+    return extent_count;
+}
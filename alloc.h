@@ -0,0 +1,30 @@
+#ifndef SIMPLEFS_ALLOC_H
+#define SIMPLEFS_ALLOC_H
+
+#include <stdint.h>
+
+// Placement policies for new allocations
+enum AllocPolicy {
+    ALLOC_FIRST_FIT = 0,  // lowest-addressed extent that fits
+    ALLOC_BEST_FIT,       // smallest extent that fits
+    ALLOC_NEXT_FIT        // first fit, starting after the previous allocation
+};
+
+// Free-extent allocator. Free space is kept as coalesced extents indexed
+// twice: by start offset (augmented with the largest extent in each subtree)
+// and by (length, start). Every operation is O(log n) in the number of extents.
+// Units are whatever the caller uses (the filesystem allocates data blocks).
+void alloc_reset(int64_t start, int64_t len);       // whole range free
+int alloc_reserve(int64_t start, int64_t len);      // mark range used, -1 if not free
+int64_t alloc_take(int64_t len);                    // allocate, -1 if no extent fits
+int64_t alloc_take_upto(int64_t max, int64_t *got); // max units if they fit, else the largest extent
+int64_t alloc_free_at(int64_t pos);                 // length of the free run starting at pos
+int64_t alloc_lowest_fit(int64_t len);              // lowest start with len free units, -1 if none (nothing taken)
+void alloc_release(int64_t start, int64_t len);     // return range to free space
+void alloc_set_policy(enum AllocPolicy policy);
+enum AllocPolicy alloc_get_policy();
+int64_t alloc_free_total();                         // total free space
+int64_t alloc_largest_free();                       // largest single extent
+int alloc_extent_count();                           // number of free extents
+
+#endif // SIMPLEFS_ALLOC_H
@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <string.h>
+#include "btree.h"
+
+#define T BTREE_MIN_DEGREE
+#define MAX_VALUES (2 * T - 1)
+#define SPARE_MAX 64  // freed nodes kept for reuse
+
+struct BNode {
+    int count;
+    int values[MAX_VALUES];
+    struct BNode *child[MAX_VALUES + 1];  // count + 1 of them; all NULL in a leaf
+};
+
+// Nodes set aside by btree_reserve, and freed ones kept for reuse, linked
+// through child[0]. Shared by every tree: callers change trees under one
+// exclusive lock (the file system's metadata lock).
+static struct BNode *spare = NULL;
+static int spare_count = 0;
+
+static struct BNode *node_new() {
+    struct BNode *n = spare;
+    if (n) {
+        spare = n->child[0];
+        spare_count--;
+    } else if (!(n = malloc(sizeof(*n)))) {
+        return NULL;
+    }
+    memset(n, 0, sizeof(*n));
+    return n;
+}
+
+static void node_free(struct BNode *n) {
+    if (spare_count >= SPARE_MAX) {
+        free(n);
+        return;
+    }
+    n->child[0] = spare;
+    spare = n;
+    spare_count++;
+}
+
+static void free_tree(struct BNode *n) {
+    if (n->child[0]) {
+        for (int i = 0; i <= n->count; ++i) {
+            free_tree(n->child[i]);
+        }
+    }
+    node_free(n);
+}
+
+void btree_init(struct BTree *t, btree_cmp cmp) {
+    t->root = NULL;
+    t->count = 0;
+    t->cmp = cmp;
+}
+
+void btree_clear(struct BTree *t) {
+    if (t->root) free_tree(t->root);
+    t->root = NULL;
+    t->count = 0;
+}
+
+// An insert splits at most one node per level and adds a root
+int btree_reserve(const struct BTree *t) {
+    int need = 1;
+    for (struct BNode *n = t->root; n; n = n->child[0]) {
+        need++;
+    }
+    while (spare_count < need) {
+        struct BNode *n = malloc(sizeof(*n));
+        if (!n) return -1;
+        n->child[0] = spare;
+        spare = n;
+        spare_count++;
+    }
+    return 0;
+}
+
+// First position in n whose value's key does not sort below key; *found
+// tells whether it is equal
+static int lower_bound(const struct BTree *t, const struct BNode *n, const void *key, bool *found) {
+    int lo = 0, hi = n->count;
+    *found = false;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = t->cmp(key, n->values[mid]);
+        if (c == 0) {
+            *found = true;
+            return mid;
+        }
+        if (c > 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int *btree_find(const struct BTree *t, const void *key) {
+    for (struct BNode *n = t->root; n; ) {
+        bool found;
+        int i = lower_bound(t, n, key, &found);
+        if (found) return &n->values[i];
+        n = n->child[i];
+    }
+    return NULL;
+}
+
+// Split the full child i of n around its middle value, which moves up
+// into n; its upper half goes to right, the new child i + 1
+static void split_child(struct BNode *n, int i, struct BNode *right) {
+    struct BNode *left = n->child[i];
+    memcpy(right->values, left->values + T, (T - 1) * sizeof(int));
+    if (left->child[0]) {
+        memcpy(right->child, left->child + T, T * sizeof(struct BNode *));
+        memset(left->child + T, 0, T * sizeof(struct BNode *));
+    }
+    right->count = T - 1;
+    left->count = T - 1;
+    memmove(n->values + i + 1, n->values + i, (n->count - i) * sizeof(int));
+    memmove(n->child + i + 2, n->child + i + 1, (n->count - i) * sizeof(struct BNode *));
+    n->values[i] = left->values[T - 1];
+    n->child[i + 1] = right;
+    n->count++;
+}
+
+// Full nodes on the way down are split first, so the leaf reached has room
+int btree_insert(struct BTree *t, const void *key, int value) {
+    if (btree_find(t, key)) return 1;
+    if (btree_reserve(t) < 0) return -1;
+    if (!t->root) {
+        t->root = node_new();
+    } else if (t->root->count == MAX_VALUES) {
+        struct BNode *top = node_new();
+        top->child[0] = t->root;
+        split_child(top, 0, node_new());
+        t->root = top;
+    }
+    struct BNode *n = t->root;
+    for (;;) {
+        bool found;
+        int i = lower_bound(t, n, key, &found);
+        if (!n->child[0]) {
+            memmove(n->values + i + 1, n->values + i, (n->count - i) * sizeof(int));
+            n->values[i] = value;
+            n->count++;
+            break;
+        }
+        if (n->child[i]->count == MAX_VALUES) {
+            split_child(n, i, node_new());
+            if (t->cmp(key, n->values[i]) > 0) i++;
+        }
+        n = n->child[i];
+    }
+    t->count++;
+    return 0;
+}
+
+// Fold child i + 1 of n, and the value between the two, into child i
+static void merge_children(struct BNode *n, int i) {
+    struct BNode *left = n->child[i], *right = n->child[i + 1];
+    left->values[left->count] = n->values[i];
+    memcpy(left->values + left->count + 1, right->values, right->count * sizeof(int));
+    if (left->child[0]) {
+        memcpy(left->child + left->count + 1, right->child, (right->count + 1) * sizeof(struct BNode *));
+    }
+    left->count += 1 + right->count;
+    memmove(n->values + i, n->values + i + 1, (n->count - i - 1) * sizeof(int));
+    memmove(n->child + i + 1, n->child + i + 2, (n->count - i - 1) * sizeof(struct BNode *));
+    n->child[n->count] = NULL;
+    n->count--;
+    node_free(right);
+}
+
+// Give child i of n at least T values before a removal descends into it,
+// taking one from a sibling through n or merging with a sibling; returns
+// the position of the child to descend into
+static int fill_child(struct BNode *n, int i) {
+    struct BNode *c = n->child[i];
+    if (c->count >= T) return i;
+    if (i > 0 && n->child[i - 1]->count >= T) {
+        struct BNode *left = n->child[i - 1];
+        memmove(c->values + 1, c->values, c->count * sizeof(int));
+        if (c->child[0]) {
+            memmove(c->child + 1, c->child, (c->count + 1) * sizeof(struct BNode *));
+            c->child[0] = left->child[left->count];
+            left->child[left->count] = NULL;
+        }
+        c->values[0] = n->values[i - 1];
+        n->values[i - 1] = left->values[left->count - 1];
+        left->count--;
+        c->count++;
+        return i;
+    }
+    if (i < n->count && n->child[i + 1]->count >= T) {
+        struct BNode *right = n->child[i + 1];
+        c->values[c->count] = n->values[i];
+        n->values[i] = right->values[0];
+        memmove(right->values, right->values + 1, (right->count - 1) * sizeof(int));
+        if (right->child[0]) {
+            c->child[c->count + 1] = right->child[0];
+            memmove(right->child, right->child + 1, right->count * sizeof(struct BNode *));
+            right->child[right->count] = NULL;
+        }
+        right->count--;
+        c->count++;
+        return i;
+    }
+    if (i < n->count) {
+        merge_children(n, i);
+        return i;
+    }
+    merge_children(n, i - 1);
+    return i - 1;
+}
+
+enum Take { TAKE_KEY, TAKE_FIRST, TAKE_LAST };
+
+// Remove a value from the subtree under n, which holds at least T values
+// unless it is the root: the one with key, or the subtree's first or last.
+// Returns whether there was one, storing it in *out.
+static bool take(const struct BTree *t, struct BNode *n, const void *key, enum Take how, int *out) {
+    for (;;) {
+        bool found = false;
+        int i = how == TAKE_FIRST ? 0 : how == TAKE_LAST ? n->count : lower_bound(t, n, key, &found);
+        if (!n->child[0]) {
+            if (how == TAKE_LAST) i--;
+            else if (how == TAKE_KEY && !found) return false;
+            *out = n->values[i];
+            memmove(n->values + i, n->values + i + 1, (n->count - i - 1) * sizeof(int));
+            n->count--;
+            return true;
+        }
+        if (found) {
+            // Replaced by its predecessor or successor, whichever child can
+            // spare one; otherwise it moves down into the two merged
+            *out = n->values[i];
+            if (n->child[i]->count >= T) return take(t, n->child[i], NULL, TAKE_LAST, &n->values[i]);
+            if (n->child[i + 1]->count >= T) return take(t, n->child[i + 1], NULL, TAKE_FIRST, &n->values[i]);
+            merge_children(n, i);
+            n = n->child[i];
+            continue;
+        }
+        n = n->child[fill_child(n, i)];
+    }
+}
+
+bool btree_remove(struct BTree *t, const void *key) {
+    if (!t->root) return false;
+    int value;
+    bool removed = take(t, t->root, key, TAKE_KEY, &value);
+    struct BNode *root = t->root;
+    if (root->count == 0) {
+        t->root = root->child[0];
+        node_free(root);
+    }
+    if (removed) t->count--;
+    return removed;
+}
+
+// In-order walk of the subtree under n; after bounds only its first
+// child visited, every later one sorting past it
+static void scan(const struct BTree *t, const struct BNode *n, const void *after, int *values, int max, int *got) {
+    int i = 0;
+    if (after) {
+        bool found;
+        i = lower_bound(t, n, after, &found);
+        if (found) {
+            i++;
+            after = NULL;
+        }
+    }
+    for (; i <= n->count && *got < max; ++i) {
+        if (n->child[0]) scan(t, n->child[i], after, values, max, got);
+        after = NULL;
+        if (i < n->count && *got < max) values[(*got)++] = n->values[i];
+    }
+}
+
+int btree_scan(const struct BTree *t, const void *after, int *values, int max) {
+    int got = 0;
+    if (t->root && max > 0) scan(t, t->root, after, values, max, &got);
+    return got;
+}
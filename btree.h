@@ -0,0 +1,31 @@
+#ifndef SIMPLEFS_BTREE_H
+#define SIMPLEFS_BTREE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// In-memory B-tree of int values, kept in the order of keys the caller
+// derives from them: the comparison gets a key and a stored value and
+// says how the key sorts against that value's key. Lookups, inserts and
+// removals are O(log n); no two values may have equal keys.
+#define BTREE_MIN_DEGREE 16  // nodes hold 15 .. 31 values (the root fewer)
+
+typedef int (*btree_cmp)(const void *key, int value);
+
+struct BNode;
+
+struct BTree {
+    struct BNode *root;  // NULL while empty
+    int64_t count;       // values held
+    btree_cmp cmp;
+};
+
+void btree_init(struct BTree *t, btree_cmp cmp);
+void btree_clear(struct BTree *t);  // drop every value
+int btree_reserve(const struct BTree *t);  // set nodes aside so the next insert cannot fail; -1 if out of memory
+int *btree_find(const struct BTree *t, const void *key);  // the value with this key, NULL if none
+int btree_insert(struct BTree *t, const void *key, int value);  // key is the value's; 1 if taken, -1 if out of memory
+bool btree_remove(struct BTree *t, const void *key);
+int btree_scan(const struct BTree *t, const void *after, int *values, int max);  // values past key after (NULL: from the first), in order; returns how many
+
+#endif // SIMPLEFS_BTREE_H
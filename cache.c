@@ -0,0 +1,360 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cache.h"
+
+#define MAX_SHARDS 16   // blocks are spread over shards by block number
+#define BYPASS_DIVISOR 8
+
+struct Frame {
+    int64_t block;   // cached block number, -1 when the frame is empty
+    int32_t next;    // next frame in the same hash bucket, -1 at the end
+    uint8_t ref;     // CLOCK reference bit
+    uint8_t dirty;
+};
+
+struct Shard {
+    pthread_mutex_t lock;
+    struct Frame *frames;
+    unsigned char *data;   // nframes * block_size bytes
+    int32_t *buckets;      // hash heads, mask + 1 of them
+    uint32_t nframes;
+    uint32_t mask;
+    uint32_t hand;         // CLOCK hand
+};
+
+static struct Shard shards[MAX_SHARDS];
+static int nshards = 0;   // 0 = cache off
+static int64_t data_off = 0;
+static uint32_t block_size = 0;
+static int64_t bypass_len = 0;
+static uint64_t hits = 0, misses = 0, evictions = 0, writebacks = 0;
+
+static void bump(uint64_t *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static struct Shard *shard_of(int64_t block) {
+    return &shards[block % nshards];
+}
+
+static unsigned char *frame_data(struct Shard *s, int32_t fi) {
+    return s->data + (size_t)fi * block_size;
+}
+
+static uint32_t bucket_of(const struct Shard *s, int64_t block) {
+    uint64_t h = (uint64_t)(block / nshards) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h >> 32) & s->mask;
+}
+
+static int32_t lookup(struct Shard *s, int64_t block) {
+    for (int32_t fi = s->buckets[bucket_of(s, block)]; fi != -1; fi = s->frames[fi].next) {
+        if (s->frames[fi].block == block) return fi;
+    }
+    return -1;
+}
+
+static void unlink_frame(struct Shard *s, int32_t fi) {
+    int32_t *link = &s->buckets[bucket_of(s, s->frames[fi].block)];
+    while (*link != fi) link = &s->frames[*link].next;
+    *link = s->frames[fi].next;
+    s->frames[fi].block = -1;
+}
+
+static int write_block(int fd, struct Shard *s, int32_t fi) {
+    off_t off = data_off + s->frames[fi].block * (int64_t)block_size;
+    if (pwrite(fd, frame_data(s, fi), block_size, off) != (ssize_t)block_size) return -1;
+    s->frames[fi].dirty = 0;
+    bump(&writebacks);
+    return 0;
+}
+
+// Free a frame with the CLOCK algorithm: frames referenced since the hand
+// last passed get a second chance; a dirty victim is written back first
+static int32_t take_frame(int fd, struct Shard *s) {
+    for (uint32_t steps = 0; steps <= 2 * s->nframes; ++steps) {
+        int32_t fi = s->hand;
+        s->hand = (s->hand + 1) % s->nframes;
+        struct Frame *f = &s->frames[fi];
+        if (f->block < 0) return fi;
+        if (f->ref) {
+            f->ref = 0;
+            continue;
+        }
+        if (f->dirty && write_block(fd, s, fi) < 0) return -1;
+        unlink_frame(s, fi);
+        bump(&evictions);
+        return fi;
+    }
+    return -1;
+}
+
+// Give block a frame, reading its current contents from disk if fill is set
+static int32_t load_block(int fd, struct Shard *s, int64_t block, int fill) {
+    int32_t fi = take_frame(fd, s);
+    if (fi < 0) return -1;
+    if (fill) {
+        off_t off = data_off + block * (int64_t)block_size;
+        ssize_t n = pread(fd, frame_data(s, fi), block_size, off);
+        if (n < 0) return -1;
+        memset(frame_data(s, fi) + n, 0, block_size - n);
+    }
+    struct Frame *f = &s->frames[fi];
+    uint32_t b = bucket_of(s, block);
+    f->block = block;
+    f->next = s->buckets[b];
+    f->ref = 1;
+    f->dirty = 0;
+    s->buckets[b] = fi;
+    return fi;
+}
+
+static void free_shards() {
+    for (int i = 0; i < nshards; ++i) {
+        pthread_mutex_destroy(&shards[i].lock);
+        free(shards[i].frames);
+        free(shards[i].data);
+        free(shards[i].buckets);
+    }
+    memset(shards, 0, sizeof(shards));
+    nshards = 0;
+}
+
+int cache_configure(int64_t off, uint32_t bsize, int64_t budget) {
+    free_shards();
+    data_off = off;
+    block_size = bsize;
+    hits = misses = evictions = writebacks = 0;
+    int64_t total = bsize ? budget / bsize : 0;
+    if (total <= 0) return 0;
+    int count = total < MAX_SHARDS ? (int)total : MAX_SHARDS;
+    for (int i = 0; i < count; ++i) {
+        struct Shard *s = &shards[i];
+        s->nframes = (uint32_t)(total / count);
+        uint32_t slots = 1;
+        while (slots < 2 * s->nframes) slots <<= 1;
+        s->mask = slots - 1;
+        s->frames = malloc(s->nframes * sizeof(struct Frame));
+        s->data = malloc((size_t)s->nframes * bsize);
+        s->buckets = malloc(slots * sizeof(int32_t));
+        pthread_mutex_init(&s->lock, NULL);
+        nshards = i + 1;
+        if (!s->frames || !s->data || !s->buckets) {
+            free_shards();
+            return -1;
+        }
+    }
+    bypass_len = total * bsize / BYPASS_DIVISOR;
+    cache_drop();
+    return 0;
+}
+
+void cache_drop() {
+    for (int i = 0; i < nshards; ++i) {
+        struct Shard *s = &shards[i];
+        for (uint32_t fi = 0; fi < s->nframes; ++fi) {
+            s->frames[fi].block = -1;
+            s->frames[fi].dirty = 0;
+            s->frames[fi].ref = 0;
+        }
+        memset(s->buckets, 0xFF, (s->mask + 1) * sizeof(int32_t));
+        s->hand = 0;
+    }
+}
+
+int cache_enabled() {
+    return nshards > 0;
+}
+
+// The block holding image offset off + done and the length of the piece of
+// [off + done, off + len) that lies in it
+static size_t block_piece(int64_t off, size_t done, size_t len, int64_t *block, size_t *boff) {
+    int64_t pos = off + (int64_t)done - data_off;
+    *block = pos / block_size;
+    *boff = pos % block_size;
+    size_t n = block_size - *boff;
+    return n < len - done ? n : len - done;
+}
+
+// Write back any dirty cached blocks in [off, off+len) so the disk copy is
+// current, dropping them from the cache if evict is set
+int cache_settle(int fd, int64_t off, size_t len, int evict) {
+    int rc = 0;
+    if (nshards == 0) return 0;
+    for (size_t done = 0, n; done < len; done += n) {
+        int64_t block;
+        size_t boff;
+        n = block_piece(off, done, len, &block, &boff);
+        struct Shard *s = shard_of(block);
+        pthread_mutex_lock(&s->lock);
+        int32_t fi = lookup(s, block);
+        if (fi >= 0) {
+            if (s->frames[fi].dirty && write_block(fd, s, fi) < 0) rc = -1;
+            if (evict) unlink_frame(s, fi);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return rc;
+}
+
+void cache_discard(int64_t off, size_t len) {
+    if (nshards == 0) return;
+    for (size_t done = 0, n; done < len; done += n) {
+        int64_t block;
+        size_t boff;
+        n = block_piece(off, done, len, &block, &boff);
+        struct Shard *s = shard_of(block);
+        pthread_mutex_lock(&s->lock);
+        int32_t fi = lookup(s, block);
+        if (fi >= 0) {
+            s->frames[fi].dirty = 0;
+            unlink_frame(s, fi);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+ssize_t cache_read(int fd, void *buf, size_t len, int64_t off) {
+    if ((int64_t)len > bypass_len) {
+        // Large read: straight from the disk once pending writes are out
+        if (cache_settle(fd, off, len, 0) < 0) return -1;
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = pread(fd, (char *)buf + got, len - got, off + got);
+            if (n < 0) return -1;
+            if (n == 0) break;
+            got += n;
+        }
+        return got;
+    }
+    for (size_t done = 0, n; done < len; done += n) {
+        int64_t block;
+        size_t boff;
+        n = block_piece(off, done, len, &block, &boff);
+        struct Shard *s = shard_of(block);
+        pthread_mutex_lock(&s->lock);
+        int32_t fi = lookup(s, block);
+        if (fi >= 0) {
+            bump(&hits);
+            s->frames[fi].ref = 1;
+        } else {
+            bump(&misses);
+            fi = load_block(fd, s, block, 1);
+        }
+        if (fi < 0) {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+        memcpy((char *)buf + done, frame_data(s, fi) + boff, n);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return len;
+}
+
+ssize_t cache_write(int fd, const void *buf, size_t len, int64_t off) {
+    if ((int64_t)len > bypass_len) {
+        // Large write: straight to the disk; cached copies are written back
+        // and dropped first so no stale frame can land on top of it later
+        if (cache_settle(fd, off, len, 1) < 0) return -1;
+        size_t put = 0;
+        while (put < len) {
+            ssize_t n = pwrite(fd, (const char *)buf + put, len - put, off + put);
+            if (n < 0) return -1;
+            put += n;
+        }
+        return len;
+    }
+    for (size_t done = 0, n; done < len; done += n) {
+        int64_t block;
+        size_t boff;
+        n = block_piece(off, done, len, &block, &boff);
+        struct Shard *s = shard_of(block);
+        pthread_mutex_lock(&s->lock);
+        int32_t fi = lookup(s, block);
+        if (fi < 0) {
+            // A partial block is read in first so the frame holds all of it
+            fi = load_block(fd, s, block, n < block_size);
+        }
+        if (fi < 0) {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+        memcpy(frame_data(s, fi) + boff, (const char *)buf + done, n);
+        s->frames[fi].ref = 1;
+        s->frames[fi].dirty = 1;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return len;
+}
+
+struct DirtyRef {
+    int64_t block;
+    struct Shard *shard;
+    int32_t frame;
+};
+
+static int dirty_cmp(const void *a, const void *b) {
+    int64_t x = ((const struct DirtyRef *)a)->block;
+    int64_t y = ((const struct DirtyRef *)b)->block;
+    return x < y ? -1 : x > y;
+}
+
+int cache_flush(int fd) {
+    if (nshards == 0) return 0;
+    size_t capacity = 0;
+    for (int i = 0; i < nshards; ++i) {
+        capacity += shards[i].nframes;
+    }
+    struct DirtyRef *list = malloc(capacity * sizeof(*list));
+    for (int i = 0; i < nshards; ++i) {
+        pthread_mutex_lock(&shards[i].lock);
+    }
+    int rc = 0;
+    size_t count = 0;
+    for (int i = 0; i < nshards; ++i) {
+        struct Shard *s = &shards[i];
+        for (uint32_t fi = 0; fi < s->nframes; ++fi) {
+            if (s->frames[fi].block < 0 || !s->frames[fi].dirty) continue;
+            if (list) {
+                list[count].block = s->frames[fi].block;
+                list[count].shard = s;
+                list[count].frame = fi;
+                count++;
+            } else if (write_block(fd, s, fi) < 0) {
+                rc = -1;
+            }
+        }
+    }
+    // Written in block order, so runs of a file go out sequentially
+    if (list) {
+        qsort(list, count, sizeof(*list), dirty_cmp);
+        for (size_t i = 0; i < count; ++i) {
+            if (write_block(fd, list[i].shard, list[i].frame) < 0) rc = -1;
+        }
+    }
+    for (int i = nshards; i-- > 0;) {
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    free(list);
+    return rc;
+}
+
+void cache_stats(struct CacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+    stats->writebacks = __atomic_load_n(&writebacks, __ATOMIC_RELAXED);
+    for (int i = 0; i < nshards; ++i) {
+        struct Shard *s = &shards[i];
+        stats->capacity += (int64_t)s->nframes * block_size;
+        pthread_mutex_lock(&s->lock);
+        for (uint32_t fi = 0; fi < s->nframes; ++fi) {
+            if (s->frames[fi].block >= 0 && s->frames[fi].dirty) stats->dirty += block_size;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef SIMPLEFS_CACHE_H
+#define SIMPLEFS_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Counters reported by cache_stats
+struct CacheStats {
+    uint64_t hits;        // block reads served from memory
+    uint64_t misses;      // block reads that went to the disk
+    uint64_t evictions;   // blocks dropped to make room
+    uint64_t writebacks;  // dirty blocks written to the disk
+    int64_t capacity;     // bytes of block frames
+    int64_t dirty;        // bytes waiting for write-back
+};
+
+// Block cache for the data area of the image. Blocks are kept in frames
+// split across independently locked shards and evicted with the CLOCK
+// algorithm; writes stay in memory (write-back) until cache_flush or until
+// their frame is evicted. Requests larger than an eighth of the cache go
+// straight to the disk (after writing back cached copies of their blocks),
+// so one big copy does not push the hot blocks out.
+// cache_configure and cache_drop must not run alongside other cache calls.
+int cache_configure(int64_t data_off, uint32_t block_size, int64_t budget);  // drops contents; 0 = off
+void cache_drop();                 // forget every block, dirty ones included
+int cache_enabled();
+ssize_t cache_read(int fd, void *buf, size_t len, int64_t off);         // off is an image offset
+ssize_t cache_write(int fd, const void *buf, size_t len, int64_t off);  // in the data area
+int cache_flush(int fd);           // write back dirty blocks in block order
+int cache_settle(int fd, int64_t off, size_t len, int evict);  // before I/O around the cache
+void cache_discard(int64_t off, size_t len);  // forget blocks whose contents no longer matter
+void cache_stats(struct CacheStats *stats);
+
+#endif // SIMPLEFS_CACHE_H
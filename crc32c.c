@@ -0,0 +1,187 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define POLY 0x82F63B78u  // Castagnoli, bit-reversed
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CRC_HW 1
+#endif
+
+// Stream lengths of the three-way hardware loop; the partial CRCs are
+// combined by shifting them over the zeros that follow
+#define LONG_STREAM 8192
+#define SHORT_STREAM 256
+
+static uint32_t table[8][256];  // slice-by-8
+static int have_hw = 0;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// ---- software ----
+
+static uint32_t crc_table(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^ table[5][(word >> 16) & 0xFF] ^
+              table[4][(word >> 24) & 0xFF] ^ table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^
+              table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAVE_CRC_HW
+
+// ---- shifting a CRC over runs of zeros (GF(2) matrices, 32x32) ----
+
+static uint32_t shift_long[4][256];   // append LONG_STREAM zero bytes
+static uint32_t shift_short[4][256];  // append SHORT_STREAM zero bytes
+
+static uint32_t matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+static void matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; ++n) {
+        square[n] = matrix_times(mat, mat[n]);
+    }
+}
+
+// Operator appending len zero bytes (len a power of two) to a raw CRC
+static void zeros_operator(uint32_t *op, size_t len) {
+    uint32_t odd[32], even[32];
+    odd[0] = POLY;  // one zero bit
+    for (int n = 1; n < 32; ++n) {
+        odd[n] = 1u << (n - 1);
+    }
+    matrix_square(even, odd);  // two zero bits
+    matrix_square(odd, even);  // four
+    // Each squaring doubles the count: eight bits (one byte), then len bytes
+    for (;;) {
+        matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0) {
+            memcpy(op, even, sizeof(even));
+            return;
+        }
+        matrix_square(odd, even);
+        len >>= 1;
+        if (len == 0) {
+            memcpy(op, odd, sizeof(odd));
+            return;
+        }
+    }
+}
+
+static void shift_table(uint32_t shift[4][256], size_t len) {
+    uint32_t op[32];
+    zeros_operator(op, len);
+    for (uint32_t n = 0; n < 256; ++n) {
+        shift[0][n] = matrix_times(op, n);
+        shift[1][n] = matrix_times(op, n << 8);
+        shift[2][n] = matrix_times(op, n << 16);
+        shift[3][n] = matrix_times(op, n << 24);
+    }
+}
+
+static uint32_t shift_crc(uint32_t shift[4][256], uint32_t crc) {
+    return shift[0][crc & 0xFF] ^ shift[1][(crc >> 8) & 0xFF] ^ shift[2][(crc >> 16) & 0xFF] ^ shift[3][crc >> 24];
+}
+
+// ---- hardware ----
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc0 = crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc0 = __builtin_ia32_crc32qi((uint32_t)crc0, *p++);
+        len--;
+    }
+    // Three independent streams keep the crc32 unit busy; the first one's
+    // result is then carried over the other two
+    static const size_t streams[2] = { LONG_STREAM, SHORT_STREAM };
+    for (int s = 0; s < 2; ++s) {
+        size_t n = streams[s];
+        while (len >= 3 * n) {
+            uint64_t crc1 = 0, crc2 = 0, w0, w1, w2;
+            for (const unsigned char *end = p + n; p < end; p += 8) {
+                memcpy(&w0, p, 8);
+                memcpy(&w1, p + n, 8);
+                memcpy(&w2, p + 2 * n, 8);
+                crc0 = __builtin_ia32_crc32di(crc0, w0);
+                crc1 = __builtin_ia32_crc32di(crc1, w1);
+                crc2 = __builtin_ia32_crc32di(crc2, w2);
+            }
+            uint32_t (*shift)[256] = s == 0 ? shift_long : shift_short;
+            crc0 = shift_crc(shift, (uint32_t)crc0) ^ (uint32_t)crc1;
+            crc0 = shift_crc(shift, (uint32_t)crc0) ^ (uint32_t)crc2;
+            p += 2 * n;
+            len -= 3 * n;
+        }
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        crc0 = __builtin_ia32_crc32di(crc0, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc0 = __builtin_ia32_crc32qi((uint32_t)crc0, *p++);
+    }
+    return (uint32_t)crc0;
+}
+#endif
+
+static void crc_init() {
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; ++k) {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t crc = table[0][n];
+        for (int k = 1; k < 8; ++k) {
+            crc = table[0][crc & 0xFF] ^ (crc >> 8);
+            table[k][n] = crc;
+        }
+    }
+#ifdef HAVE_CRC_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        shift_table(shift_long, LONG_STREAM);
+        shift_table(shift_short, SHORT_STREAM);
+        have_hw = 1;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&init_once, crc_init);
+    crc = ~crc;
+#ifdef HAVE_CRC_HW
+    if (have_hw) return ~crc_hw(crc, buf, len);
+#endif
+    return ~crc_table(crc, buf, len);
+}
+
+const char *crc32c_backend() {
+    pthread_once(&init_once, crc_init);
+    return have_hw ? "sse4.2" : "table";
+}
@@ -0,0 +1,14 @@
+#ifndef SIMPLEFS_CRC32C_H
+#define SIMPLEFS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli polynomial, as used by iSCSI, ext4 and btrfs). Uses the
+// SSE4.2 crc32 instruction when the processor has it, three streams at a
+// time so the instruction's latency is hidden, and a slice-by-8 table
+// otherwise. The implementation is chosen on first use.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);  // crc = 0 to start
+const char *crc32c_backend();  // "sse4.2" or "table"
+
+#endif // SIMPLEFS_CRC32C_H
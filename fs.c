@@ -1,940 +1,5933 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE  // preadv/pwritev, syscall
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "fs.h"
+#include "alloc.h"
+#include "oplog.h"
+#include "cache.h"
+#include "uring.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "btree.h"
 
 struct FileSystem fs;
 static int disk_fd = -1;
-static int log_fd = -1;
-static const char *log_filename = "fs.log";
+static enum LogFormat log_format = LOG_TEXT;
+static bool log_background = false;
 
-// Helper to log operations with timestamp
+// Geometry of the mounted image (from the superblock)
+#define DISK_SIZE ((int64_t)fs.sb.disk_size)
+#define META_SIZE ((int64_t)fs.sb.meta_size)
+#define MAX_FILES ((int)fs.sb.max_files)
+#define BLOCK_SIZE ((int64_t)fs.sb.block_size)
+#define BLOCK_COUNT ((int64_t)fs.sb.block_count)
+#define MAX_EXTENTS (fs.sb.max_extents)
+
+// Live files take the entry table from the start, fs.file_count of them;
+// snapshots take it from this entry to the end (see fs_snapshot)
+#define SNAPSHOT_BASE (MAX_FILES - (int)fs.sb.snapshot_entries)
+
+// Byte offset of the extent table inside the metadata region
+#define EXTENT_TABLE_OFF (SUPERBLOCK_SIZE + (uint64_t)fs.sb.max_files * sizeof(struct FileEntry))
+
+// Chunk size for streaming file data through memory
+#define COPY_CHUNK (64 * 1024)
+
+// Staging buffer for fs_import/fs_export where the kernel cannot copy
+// between the host file and the image directly, and for backups
+#define STREAM_CHUNK (1024 * 1024)
+
+// fs_delta match block size bounds; by default about the square root of
+// the old file's size, as rsync does
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK (64 * 1024)
+#define DELTA_MIN_MATCH 32  // shortest run taken where the last match would continue
+
+// Bytes of a compressed file compressed together (at least one block)
+#define COMPRESS_UNIT (64 * 1024)
+
+#define CBT_MAGIC 0x54424353u  // "SCBT", changed-block map file
+
+// lseek whences for sparse files (Linux values), hidden without _GNU_SOURCE
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+#define MANIFEST_MAGIC "simplefs-backup"
+
+// Oldest on-disk version with the current block and extent layout; version
+// 3 only adds that extents of different files may share blocks
+#define BLOCK_LAYOUT_VERSION 2
+#define CRC_VERSION 4  // first version with the block checksum table
+#define JOURNAL_VERSION 5  // first version with the metadata journal
+#define COMPRESS_VERSION 6  // first version with file flags (compression)
+#define SNAPSHOT_VERSION 7  // first version with snapshots
+#define DIRECTORY_VERSION 8  // first version with directories
+
+// Metadata journal: region size bounds (see DEFAULT_JOURNAL_SHARE) and the
+// tag of a record
+#define JOURNAL_MIN (16 * 1024)
+#define JOURNAL_MAX (16 * 1024 * 1024)
+#define JOURNAL_MAGIC 0x4C4E524Au  // "JRNL"
+
+// Submission queue entries of the io_uring backend
+#define URING_DEPTH 256
+
+// Layout of images written before block allocation: version 0 had no
+// superblock (fixed 1 MB disk, 4 KB metadata holding a count and 64 entries
+// with 32-bit fields), version 1 had a superblock and one byte range per file
+#define LEGACY_DISK_SIZE (1024*1024)
+#define LEGACY_META_SIZE 4096
+#define LEGACY_MAX_FILES 64
+struct LegacyFileEntry {
+    char name[MAX_FILENAME_LEN];
+    int size;
+    int start;
+    char created[20];
+};
+struct V1SuperBlock {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t disk_size;
+    uint64_t meta_size;
+    uint32_t max_files;
+    uint32_t file_count;
+    uint32_t entry_size;
+    uint32_t reserved;
+};
+struct V1FileEntry {
+    char name[MAX_FILENAME_LEN];
+    int64_t size;
+    int64_t start;
+    char created[20];
+};
+
+// A file found in an old-layout image, to be copied into the block layout
+struct OldFile {
+    char name[MAX_FILENAME_LEN];
+    int64_t size;
+    int64_t start;
+    char created[20];
+};
+
+// Metadata is flushed in sectors; only sectors holding changed fields are rewritten
+#define META_SECTOR 512
+static unsigned char *meta_dirty = NULL;  // one flag per metadata sector
+static size_t meta_sectors = 0;
+
+// Unused extent records, rebuilt at mount
+static uint32_t *free_records = NULL;
+static uint32_t free_record_count = 0;
+
+// Per data block, the number of extents mapping it: 0 = free, 1 = owned by
+// one file, more = shared between copies (see fs_copy). Rebuilt at mount.
+static uint32_t *block_refs = NULL;
+
+// Changed-block tracking for incremental backups: one bit per data block
+// written since the backup with id backup_base (0 = no backup to build on).
+// Bits are set by writers outside meta_lock, hence atomically. The map is
+// kept across mounts in CBT_NAME.
+static unsigned char *block_changed = NULL;
+static uint64_t backup_base = 0;
+
+// Per data block, the CRC32C of its whole contents, as stored in the table
+// at fs.sb.crc_offset (after the data area). Writers fill it in once their
+// data is on its way to disk; the table is flushed by dirty sector like the
+// metadata region. Free blocks keep whatever value they had.
+static uint32_t *block_crc = NULL;
+static unsigned char *crc_dirty = NULL;  // one flag per sector of the table
+static size_t crc_sectors = 0;
+static bool verify_reads = false;  // see fs_set_verify_reads
+
+// Deduplication (see fs_set_dedup): the data blocks in use, keyed by their
+// block_crc value, in an open-addressing table like the name index. A
+// block is listed only while its contents are settled: a write drops the
+// blocks it is about to overwrite in place (file_unshare), and they return
+// when their new checksums are stored. So a block found here can be mapped
+// by another file without a write in flight changing it underneath.
+static bool dedup_enabled = false;
+static int64_t *dedup_index = NULL;  // block numbers, -1 = empty slot; NULL while off
+static uint64_t dedup_mask = 0;
+static int64_t dedup_hits = 0;  // blocks mapped instead of written since mount
+
+// Disk access backend, chosen at fs_init_io (IO_URING drops back to IO_FD
+// when no ring can be set up)
+static enum IoMode io_mode = IO_FD;
+static unsigned char *disk_map = NULL;  // whole image, mapped in IO_MMAP mode
+
+// Durability policy (see fs_set_sync_policy). Also read by threads
+// committing the journal, so changed under journal.lock as well.
+static enum SyncPolicy sync_policy = SYNC_ALWAYS;
+static int sync_interval_ms = 0;
+static struct timespec last_sync;  // guarded by journal.lock
+
+// Write-ahead journal. Metadata changes do not go to their home sectors
+// directly: each save appends one record (the changed sectors, whole) to
+// the journal region, and the home sectors are brought up to date from
+// the records only at a checkpoint, when the region is full or at close.
+// The records of the current epoch are mirrored in memory, so writing
+// them out and checkpointing never read the region back. Records are
+// appended under meta_lock held exclusively; writing and syncing them
+// happens without it, one thread at a time, each round covering every
+// record appended so far (group commit).
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;     // a flush round has ended
+    unsigned char *mirror;   // fs.sb.journal_size bytes; NULL while closed
+    uint64_t used;           // bytes of records appended in this epoch
+    uint64_t flushed;        // bytes of them written to the region
+    uint64_t next_seq;       // sequence number of the next record
+    uint64_t durable_seq;    // records up to this one are on stable storage
+    bool flushing;           // a thread is writing or checkpointing
+} journal = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 1, 0, false };
+static __thread uint64_t commit_owed;  // last record appended by this thread, not yet committed
+
+// Runs of data blocks unmapped by changes whose journal record is not yet
+// durable. A crash would bring back the extents mapping them, so they are
+// neither punched nor reused until record seq (the first that can hold
+// the change) is on stable storage. Guarded by meta_lock held exclusively.
+static struct PendingFree {
+    uint64_t start;
+    int64_t count;
+    uint64_t seq;
+} *pending_free = NULL;
+static size_t pending_count = 0, pending_capacity = 0;
+
+// Memory budget of the block cache (fd backend; see fs_set_cache_size)
+static int64_t cache_budget = DEFAULT_CACHE_SIZE;
+
+// Set while fs_submit runs: metadata stays dirty in memory and is written
+// (and synced) once at the end of the batch
+static bool batch_active = false;
+
+// Directories, indexed by id. Each one, the root (id 0) included, keeps
+// the entries in it in a B-tree ordered by name, whose values are slots in
+// fs.files. The on-disk record of the trees is the entry table itself:
+// every entry names its directory (FILE_PARENT), so they are rebuilt at
+// mount like the allocator, and moving a subtree rewrites one entry.
+struct Directory {
+    int entry;  // its slot in fs.files; -1 for the root, -2 while the id is free
+    struct BTree tree;
+};
+static struct Directory *dirs = NULL;
+static uint32_t dir_count = 0;  // ids below this are in dirs
+static uint32_t dir_cap = 0;
+static uint32_t *dir_free = NULL;  // ids below dir_count not in use
+static uint32_t dir_free_count = 0;
+
+// Incremental defragmentation: one file at a time is copied into a reserved
+// run of free blocks, a bounded number of blocks per step, and switched over
+// to it once the copy is complete
+static struct {
+    int idx;          // file being moved, -1 when idle
+    int64_t target;   // first block of the reserved destination run
+    int64_t blocks;   // length of the run (the file's block count)
+    int64_t copied;   // blocks copied so far
+    int moved_files;  // totals since the last fs_defragment
+    int64_t moved_blocks;
+} defrag = { -1, 0, 0, 0, 0, 0 };
+static int64_t defrag_step_bytes = DEFAULT_DEFRAG_STEP;
+static int64_t defrag_memory = DEFAULT_DEFRAG_MEMORY;
+
+// Locking. meta_lock guards every in-memory table (entries, extents,
+// directories, allocator, dirty map); it is held shared by lookups and reads
+// and exclusively by anything that changes them. File data is guarded by a
+// rwlock per path stripe, always taken before meta_lock. A write holds its
+// file's stripe for the whole operation but meta_lock only while resizing
+// and committing, so the data copies of writes to different files overlap.
+// Moving a directory changes the path of everything under it, so it takes
+// every stripe.
+#define FILE_LOCK_STRIPES 64
+static pthread_rwlock_t meta_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t file_locks[FILE_LOCK_STRIPES];
+static pthread_once_t file_locks_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;  // one defragmentation step at a time
+
+// Record an operation in the log; formatting and writing happen in batches (oplog.c)
 static void log_operation(const char *operation, const char *detail, int result) {
-    if (log_fd < 0) return;
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char timebuf[20];
-    strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", tm_info);
-    char msg[256];
-    if (result == 0) {
-        if (detail)
-            snprintf(msg, sizeof(msg), "%s - %s: %s SUCCESS\n", timebuf, operation, detail);
-        else
-            snprintf(msg, sizeof(msg), "%s - %s SUCCESS\n", timebuf, operation);
+    oplog_record(operation, detail, result);
+}
+
+// Log a failed operation and hand its error code back
+static int fail(const char *operation, const char *detail, int err) {
+    log_operation(operation, detail, err);
+    return err;
+}
+
+// FNV-1a hash of a file name
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool is_dir(const struct FileEntry *f) {
+    return (f->flags & FILE_DIRECTORY) != 0;
+}
+
+// Id of the directory whose entry is f
+static uint32_t dir_id(const struct FileEntry *f) {
+    return (uint32_t)f->size;
+}
+
+// Order of a name against the name of entry idx, for the directory trees
+static int entry_cmp(const void *name, int idx) {
+    return strcmp(name, fs.files[idx].name);
+}
+
+// Directory id, or NULL if there is none
+static struct Directory *dir_get(uint32_t id) {
+    return id < dir_count && dirs[id].entry != -2 ? &dirs[id] : NULL;
+}
+
+// Room for ids below n
+static int dir_grow(uint32_t n) {
+    if (n <= dir_cap) return 0;
+    uint32_t cap = dir_cap ? dir_cap : 64;
+    while (cap < n) cap *= 2;
+    struct Directory *d = realloc(dirs, cap * sizeof(*d));
+    if (!d) return -1;
+    dirs = d;
+    uint32_t *f = realloc(dir_free, cap * sizeof(*f));
+    if (!f) return -1;
+    dir_free = f;
+    dir_cap = cap;
+    return 0;
+}
+
+// Hand out an unused id for a directory whose entry is slot entry
+static int dir_alloc(int entry, uint32_t *id) {
+    if (dir_free_count > 0) {
+        *id = dir_free[--dir_free_count];
+    } else {
+        if (dir_count >= MAX_DIRECTORIES) return FS_ERR_TABLE_FULL;
+        if (dir_grow(dir_count + 1) < 0) return FS_ERR_NO_MEMORY;
+        *id = dir_count++;
+        btree_init(&dirs[*id].tree, entry_cmp);
+    }
+    dirs[*id].entry = entry;
+    return FS_OK;
+}
+
+// Give back the id of an empty directory
+static void dir_release(uint32_t id) {
+    btree_clear(&dirs[id].tree);
+    dirs[id].entry = -2;
+    dir_free[dir_free_count++] = id;
+}
+
+// Add fs.files[idx] to its directory: 0, 1 if the directory is missing or
+// has an entry of that name, -1 if out of memory (never right after
+// btree_reserve on the directory's tree)
+static int index_insert(int idx) {
+    struct Directory *d = dir_get(FILE_PARENT(&fs.files[idx]));
+    return d ? btree_insert(&d->tree, fs.files[idx].name, idx) : 1;
+}
+
+// Take fs.files[idx] out of its directory
+static void index_remove(int idx) {
+    struct Directory *d = dir_get(FILE_PARENT(&fs.files[idx]));
+    int *slot = d ? btree_find(&d->tree, fs.files[idx].name) : NULL;
+    if (slot && *slot == idx) btree_remove(&d->tree, fs.files[idx].name);
+}
+
+// Point the directories at new_idx for fs.files[old_idx] (entry moved in the array)
+static void index_relocate(int old_idx, int new_idx) {
+    struct FileEntry *f = &fs.files[old_idx];
+    struct Directory *d = dir_get(FILE_PARENT(f));
+    int *slot = d ? btree_find(&d->tree, f->name) : NULL;
+    if (slot && *slot == old_idx) *slot = new_idx;
+    if (is_dir(f) && (d = dir_get(dir_id(f))) && d->entry == old_idx) d->entry = new_idx;
+}
+
+// Rebuild the directories from fs.files (after load, format, reorder).
+// An entry whose directory is missing, or whose name an earlier entry in
+// the same directory has, is left out (fs_check_integrity reports it).
+// -1 if out of memory.
+static int index_rebuild() {
+    for (uint32_t id = 0; id < dir_count; ++id) {
+        btree_clear(&dirs[id].tree);
+    }
+    dir_count = 0;
+    dir_free_count = 0;
+    int count = fs.file_count < 0 || fs.file_count > MAX_FILES ? 0 : fs.file_count;
+    uint32_t top = 0;
+    for (int i = 0; i < count; ++i) {
+        struct FileEntry *f = &fs.files[i];
+        if (is_dir(f) && f->size > 0 && f->size < MAX_DIRECTORIES && dir_id(f) > top) top = dir_id(f);
+    }
+    if (dir_grow(top + 1) < 0) return -1;
+    dir_count = top + 1;
+    for (uint32_t id = 0; id < dir_count; ++id) {
+        dirs[id].entry = id == 0 ? -1 : -2;
+        btree_init(&dirs[id].tree, entry_cmp);
+    }
+    for (int i = 0; i < count; ++i) {
+        struct FileEntry *f = &fs.files[i];
+        if (is_dir(f) && f->size > 0 && f->size < MAX_DIRECTORIES && dirs[dir_id(f)].entry == -2) {
+            dirs[dir_id(f)].entry = i;
+        }
+    }
+    for (uint32_t id = dir_count; id-- > 1;) {
+        if (dirs[id].entry == -2) dir_free[dir_free_count++] = id;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (index_insert(i) < 0) return -1;
+    }
+    return 0;
+}
+
+// Entry name in directory dir, or -1
+static int find_child(uint32_t dir, const char *name) {
+    struct Directory *d = dir_get(dir);
+    int *slot = d ? btree_find(&d->tree, name) : NULL;
+    return slot ? *slot : -1;
+}
+
+// Follow path down from the root. On success *dir is the directory its
+// last component belongs in, leaf (MAX_FILENAME_LEN bytes) that component
+// and *idx its entry, -1 if there is none. Fails on a malformed path, or
+// one that runs through a missing directory or a file.
+static int path_walk(const char *path, uint32_t *dir, char *leaf, int *idx) {
+    if (!path || strlen(path) >= MAX_PATH_LEN) return FS_ERR_INVALID;
+    while (*path == '/') path++;
+    uint32_t d = 0;
+    for (;;) {
+        const char *end = strchr(path, '/');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if (len == 0 || len >= MAX_FILENAME_LEN) return FS_ERR_INVALID;
+        memcpy(leaf, path, len);
+        leaf[len] = '\0';
+        if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) return FS_ERR_INVALID;
+        int i = find_child(d, leaf);
+        if (!end) {
+            *dir = d;
+            *idx = i;
+            return FS_OK;
+        }
+        if (i == -1) return FS_ERR_NOT_FOUND;
+        if (!is_dir(&fs.files[i])) return FS_ERR_NOT_DIR;
+        d = dir_id(&fs.files[i]);
+        path = end + 1;
+    }
+}
+
+// Entry of a file or directory by path, or -1
+static int find_entry(const char *path) {
+    uint32_t dir;
+    char leaf[MAX_FILENAME_LEN];
+    int idx;
+    return path_walk(path, &dir, leaf, &idx) == FS_OK ? idx : -1;
+}
+
+// Find index of a file in metadata by path (directories are not files)
+static int find_file_index(const char *filename) {
+    int idx = find_entry(filename);
+    return idx != -1 && !is_dir(&fs.files[idx]) ? idx : -1;
+}
+
+// Directory named by path ("" or "/" for the root) into *id
+static int find_dir(const char *path, uint32_t *id) {
+    if (!path) return FS_ERR_INVALID;
+    if (path[strspn(path, "/")] == '\0') {
+        *id = 0;
+        return FS_OK;
+    }
+    uint32_t dir;
+    char leaf[MAX_FILENAME_LEN];
+    int idx;
+    int rc = path_walk(path, &dir, leaf, &idx);
+    if (rc < 0) return rc;
+    if (idx == -1) return FS_ERR_NOT_FOUND;
+    if (!is_dir(&fs.files[idx])) return FS_ERR_NOT_DIR;
+    *id = dir_id(&fs.files[idx]);
+    return FS_OK;
+}
+
+// Path of live entry idx, from the root, into path (MAX_PATH_LEN bytes);
+// -1 if it does not fit (moving a directory can push paths past the limit)
+static int entry_path(int idx, char *path) {
+    char buf[MAX_PATH_LEN];
+    size_t pos = MAX_PATH_LEN - 1;
+    buf[pos] = '\0';
+    for (int steps = 0; steps <= fs.file_count; ++steps) {
+        const char *name = fs.files[idx].name;
+        size_t len = strlen(name);
+        if (len >= pos) return -1;
+        pos -= len;
+        memcpy(buf + pos, name, len);
+        struct Directory *d = dir_get(FILE_PARENT(&fs.files[idx]));
+        if (!d) return -1;
+        if (d->entry < 0) {
+            memcpy(path, buf + pos, MAX_PATH_LEN - pos);
+            return 0;
+        }
+        buf[--pos] = '/';
+        idx = d->entry;
+    }
+    return -1;
+}
+
+static void init_file_locks() {
+    for (int i = 0; i < FILE_LOCK_STRIPES; ++i) {
+        pthread_rwlock_init(&file_locks[i], NULL);
+    }
+}
+
+// Paths with and without the leading '/' name the same file
+static unsigned file_stripe(const char *name) {
+    return name ? name_hash(name + strspn(name, "/")) & (FILE_LOCK_STRIPES - 1) : 0;
+}
+
+static void lock_stripe(unsigned stripe, bool exclusive) {
+    pthread_once(&file_locks_once, init_file_locks);
+    if (exclusive) pthread_rwlock_wrlock(&file_locks[stripe]);
+    else pthread_rwlock_rdlock(&file_locks[stripe]);
+}
+
+// Lock the stripes of one or two file names (b may be NULL), lowest stripe
+// first so that concurrent callers cannot deadlock
+static void lock_names(const char *a, bool exclusive_a, const char *b, bool exclusive_b) {
+    unsigned sa = file_stripe(a);
+    unsigned sb = b ? file_stripe(b) : sa;
+    if (sa == sb) {
+        lock_stripe(sa, exclusive_a || (b && exclusive_b));
+    } else if (sa < sb) {
+        lock_stripe(sa, exclusive_a);
+        lock_stripe(sb, exclusive_b);
     } else {
-        if (detail)
-            snprintf(msg, sizeof(msg), "%s - %s: %s FAIL\n", timebuf, operation, detail);
-        else
-            snprintf(msg, sizeof(msg), "%s - %s FAIL\n", timebuf, operation);
+        lock_stripe(sb, exclusive_b);
+        lock_stripe(sa, exclusive_a);
+    }
+}
+
+static void journal_commit();
+
+// An operation ends by releasing its file locks, which is where it waits
+// for its journal record: meta_lock is free by then, so others can add
+// theirs to the same flush
+static void unlock_names(const char *a, const char *b) {
+    unsigned sa = file_stripe(a);
+    unsigned sb = b ? file_stripe(b) : sa;
+    pthread_rwlock_unlock(&file_locks[sa]);
+    if (sb != sa) pthread_rwlock_unlock(&file_locks[sb]);
+    journal_commit();
+}
+
+// Lock every stripe, for operations that touch all file data (backup,
+// restore, format)
+static void lock_all_files(bool exclusive) {
+    for (unsigned i = 0; i < FILE_LOCK_STRIPES; ++i) {
+        lock_stripe(i, exclusive);
+    }
+}
+
+static void unlock_all_files() {
+    for (unsigned i = 0; i < FILE_LOCK_STRIPES; ++i) {
+        pthread_rwlock_unlock(&file_locks[i]);
+    }
+    journal_commit();
+}
+
+// Size of the metadata region (superblock, entry and extent tables) for a
+// given capacity; the data area starts block-aligned after it
+static uint64_t meta_size_for(uint32_t max_files, uint32_t max_extents, uint32_t block_size) {
+    uint64_t size = SUPERBLOCK_SIZE + (uint64_t)max_files * sizeof(struct FileEntry) +
+                    (uint64_t)max_extents * sizeof(struct Extent);
+    uint64_t align = block_size > META_ALIGN ? block_size : META_ALIGN;
+    return (size + align - 1) / align * align;
+}
+
+// Allocate the in-memory tables for the geometry in fs.sb
+static int setup_tables() {
+    struct FileEntry *files = calloc(fs.sb.max_files, sizeof(struct FileEntry));
+    struct Extent *extents = calloc(fs.sb.max_extents, sizeof(struct Extent));
+    uint32_t *records = malloc(fs.sb.max_extents * sizeof(uint32_t));
+    size_t sectors = fs.sb.meta_size / META_SECTOR;
+    unsigned char *dirty = calloc(sectors, 1);
+    uint32_t *refs = calloc(fs.sb.block_count + 1, sizeof(uint32_t));
+    unsigned char *changed = calloc(fs.sb.block_count / 8 + 1, 1);
+    uint32_t *crcs = calloc(fs.sb.block_count + 1, sizeof(uint32_t));
+    size_t crc_secs = (fs.sb.block_count * sizeof(uint32_t) + META_SECTOR - 1) / META_SECTOR;
+    unsigned char *crc_dirt = calloc(crc_secs + 1, 1);
+    if (!files || !extents || !records || !dirty || !refs || !changed || !crcs || !crc_dirt) {
+        free(files);
+        free(extents);
+        free(records);
+        free(dirty);
+        free(refs);
+        free(changed);
+        free(crcs);
+        free(crc_dirt);
+        return -1;
+    }
+    free(fs.files);
+    free(fs.extents);
+    free(free_records);
+    free(meta_dirty);
+    free(block_refs);
+    free(block_changed);
+    free(block_crc);
+    free(crc_dirty);
+    fs.files = files;
+    fs.extents = extents;
+    free_records = records;
+    free_record_count = 0;
+    block_refs = refs;
+    block_changed = changed;
+    block_crc = crcs;
+    crc_dirty = crc_dirt;
+    crc_sectors = crc_secs;
+    meta_dirty = dirty;
+    meta_sectors = sectors;
+    // Cached blocks belong to the previous geometry; a failed allocation
+    // just leaves the cache off
+    cache_configure(fs.sb.meta_size, fs.sb.block_size, io_mode == IO_FD ? cache_budget : 0);
+    return 0;
+}
+
+// Record that the data blocks overlapping [off, off+len) of the image were
+// written, for the next incremental backup
+static void mark_changed(int64_t off, int64_t len) {
+    if (!block_changed || off + len <= META_SIZE || len <= 0) return;
+    if (off < META_SIZE) {
+        len -= META_SIZE - off;
+        off = META_SIZE;
+    }
+    int64_t last = (off + len - 1 - META_SIZE) / BLOCK_SIZE;
+    if (last >= BLOCK_COUNT) last = BLOCK_COUNT - 1;
+    for (int64_t b = (off - META_SIZE) / BLOCK_SIZE; b <= last; ++b) {
+        unsigned char bit = 1u << (b % 8);
+        if (!(__atomic_load_n(&block_changed[b / 8], __ATOMIC_RELAXED) & bit)) {
+            __atomic_fetch_or(&block_changed[b / 8], bit, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Header of the changed-block map file
+struct CbtHeader {
+    uint32_t magic;
+    uint32_t clean;         // 1 = saved by fs_close, 0 = image in use
+    uint64_t base;          // backup id the map is relative to
+    uint64_t block_count;   // followed by block_count / 8 + 1 bytes of map
+};
+
+// Record the current backup base with the map marked in use: after a
+// crash the saved map is incomplete, so every block counts as changed
+static void cbt_mark_open() {
+    int fd = open(CBT_NAME, O_WRONLY | O_CREAT, 0666);
+    struct CbtHeader h = { CBT_MAGIC, 0, backup_base, BLOCK_COUNT };
+    if (fd < 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || fdatasync(fd) < 0) backup_base = 0;
+    if (fd >= 0) close(fd);
+}
+
+// Load the changed-block map saved at the last close
+static void cbt_load() {
+    backup_base = 0;
+    int fd = open(CBT_NAME, O_RDONLY);
+    if (fd >= 0) {
+        size_t bytes = BLOCK_COUNT / 8 + 1;
+        struct CbtHeader h;
+        if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == CBT_MAGIC &&
+            h.block_count == (uint64_t)BLOCK_COUNT) {
+            backup_base = h.base;
+            if (!h.clean || pread(fd, block_changed, bytes, sizeof(h)) != (ssize_t)bytes) {
+                memset(block_changed, 0xFF, bytes);
+            }
+        }
+        close(fd);
+    }
+    cbt_mark_open();
+}
+
+// Save the changed-block map; the header goes last so a torn save reads
+// as unclean
+static int cbt_save() {
+    int fd = open(CBT_NAME, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) return -1;
+    size_t bytes = BLOCK_COUNT / 8 + 1;
+    struct CbtHeader h = { CBT_MAGIC, 1, backup_base, BLOCK_COUNT };
+    int rc = pwrite(fd, block_changed, bytes, sizeof(h)) == (ssize_t)bytes && fdatasync(fd) == 0 &&
+             pwrite(fd, &h, sizeof(h), 0) == sizeof(h) && fdatasync(fd) == 0 ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+// Read up to len bytes of the image at off; returns bytes read or -1
+static ssize_t disk_read_at(void *buf, size_t len, off_t off) {
+    if (off < 0) return -1;
+    if (disk_map) {
+        if (off >= DISK_SIZE) return 0;
+        if (len > (size_t)(DISK_SIZE - off)) len = DISK_SIZE - off;
+        memcpy(buf, disk_map + off, len);
+        return len;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = io_mode == IO_URING ? uring_pread(disk_fd, (char *)buf + done, len - done, off + done)
+                                        : pread(disk_fd, (char *)buf + done, len - done, off + done);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// Write len bytes to the image at off; returns bytes written or -1
+static ssize_t disk_write_at(const void *buf, size_t len, off_t off) {
+    if (off < 0) return -1;
+    mark_changed(off, len);
+    if (disk_map) {
+        if (off + (int64_t)len > DISK_SIZE) return -1;
+        memcpy(disk_map + off, buf, len);
+        return len;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = io_mode == IO_URING ? uring_pwrite(disk_fd, (const char *)buf + done, len - done, off + done)
+                                        : pwrite(disk_fd, (const char *)buf + done, len - done, off + done);
+        if (n < 0) return -1;
+        done += n;
+    }
+    return done;
+}
+
+// Read or write file data at image offset off (inside the data area); on
+// the fd backend this goes through the block cache
+static ssize_t data_read_at(void *buf, size_t len, off_t off) {
+    if (disk_map || !cache_enabled()) return disk_read_at(buf, len, off);
+    return cache_read(disk_fd, buf, len, off);
+}
+
+static ssize_t data_write_at(const void *buf, size_t len, off_t off) {
+    if (disk_map || !cache_enabled()) return disk_write_at(buf, len, off);
+    mark_changed(off, len);
+    return cache_write(disk_fd, buf, len, off);
+}
+
+// Direct pointer to the image bytes at off, or NULL on the fd backend
+static const unsigned char *disk_view(off_t off) {
+    return disk_map ? disk_map + off : NULL;
+}
+
+// Give the disk space behind [off, off+len) of the image back to the host
+// file system: the range reads as zeros and the image file becomes sparse
+// there. Contents of free blocks do not matter, so where punching is not
+// supported the data simply stays.
+static void punch_hole(int64_t off, int64_t len) {
+    if (len <= 0) return;
+    cache_discard(off, len);
+    syscall(SYS_fallocate, disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len);
+}
+
+// Start of the next data (non-hole) range of fd in [off, end), with its end
+// in *data_end; end when only holes remain. Without SEEK_DATA support the
+// rest counts as data.
+static int64_t next_data(int fd, int64_t off, int64_t end, int64_t *data_end) {
+    off_t d = lseek(fd, off, SEEK_DATA);
+    *data_end = end;
+    if (d < 0) return errno == ENXIO ? end : off;
+    if (d >= end) return end;
+    off_t h = lseek(fd, d, SEEK_HOLE);
+    if (h >= 0 && h < end) *data_end = h;
+    return d;
+}
+
+// Write all of buf to a host file descriptor
+static int write_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n < 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Map the image in IO_MMAP mode (no-op on the fd backend)
+static int map_disk() {
+    if (io_mode != IO_MMAP || disk_map) return 0;
+    void *map = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (map == MAP_FAILED) return -1;
+    disk_map = map;
+    return 0;
+}
+
+static void unmap_disk() {
+    if (disk_map) {
+        munmap(disk_map, DISK_SIZE);
+        disk_map = NULL;
+    }
+}
+
+// Mark the metadata bytes [off, off+len) as needing a flush
+static void mark_meta_dirty(size_t off, size_t len) {
+    if (len == 0) return;
+    size_t first = off / META_SECTOR;
+    size_t last = (off + len - 1) / META_SECTOR;
+    for (size_t i = first; i <= last && i < meta_sectors; ++i) {
+        meta_dirty[i] = 1;
+    }
+}
+
+static void mark_count_dirty() {
+    mark_meta_dirty(offsetof(struct SuperBlock, file_count), sizeof(fs.sb.file_count));
+}
+
+static void mark_snapshots_dirty() {
+    mark_meta_dirty(offsetof(struct SuperBlock, snapshot_entries), sizeof(fs.sb.snapshot_entries));
+}
+
+static void mark_entry_dirty(int idx) {
+    mark_meta_dirty(SUPERBLOCK_SIZE + (size_t)idx * sizeof(struct FileEntry),
+                    sizeof(struct FileEntry));
+}
+
+static void mark_extent_dirty(uint32_t rec) {
+    mark_meta_dirty(EXTENT_TABLE_OFF + (size_t)rec * sizeof(struct Extent), sizeof(struct Extent));
+}
+
+// List data block b in the deduplication index under its checksum
+static void dedup_insert(int64_t b) {
+    uint64_t pos = block_crc[b] & dedup_mask;
+    while (dedup_index[pos] != -1) {
+        pos = (pos + 1) & dedup_mask;
+    }
+    dedup_index[pos] = b;
+}
+
+// Drop data block b from the deduplication index, if listed. The table is
+// probed linearly from a block's checksum, so the entries after the hole
+// that probed past it shift back into it, and no lookup stops early.
+static void dedup_remove(int64_t b) {
+    if (!dedup_index) return;
+    uint64_t pos = block_crc[b] & dedup_mask;
+    while (dedup_index[pos] != b) {
+        if (dedup_index[pos] == -1) return;
+        pos = (pos + 1) & dedup_mask;
+    }
+    uint64_t hole = pos;
+    for (;;) {
+        pos = (pos + 1) & dedup_mask;
+        if (dedup_index[pos] == -1) break;
+        uint64_t home = block_crc[dedup_index[pos]] & dedup_mask;
+        if (((pos - home) & dedup_mask) >= ((pos - hole) & dedup_mask)) {
+            dedup_index[hole] = dedup_index[pos];
+            hole = pos;
+        }
+    }
+    dedup_index[hole] = -1;
+}
+
+// Record the checksum of data block b
+static void set_block_crc(uint64_t b, uint32_t crc) {
+    dedup_remove(b);  // listed under its old value
+    block_crc[b] = crc;
+    crc_dirty[b * sizeof(uint32_t) / META_SECTOR] = 1;
+    if (dedup_index) dedup_insert(b);
+}
+
+static void mark_all_dirty() {
+    memset(meta_dirty, 1, meta_sectors);
+    memset(crc_dirty, 1, crc_sectors);
+}
+
+static long ms_since(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000L + (now.tv_nsec - t->tv_nsec) / 1000000L;
+}
+
+// Flush written data and metadata to stable storage
+static int sync_disk() {
+    if (disk_fd < 0) return -1;
+    if (disk_map) {
+        if (msync(disk_map, DISK_SIZE, MS_SYNC) < 0) return -1;
+    } else if (io_mode == IO_URING) {
+        if (uring_fsync(disk_fd) < 0) return -1;
+    } else if (cache_flush(disk_fd) < 0 || fsync(disk_fd) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&journal.lock);
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    pthread_mutex_unlock(&journal.lock);
+    return 0;
+}
+
+// Whether the durability policy calls for a sync at the end of an operation
+static bool sync_due() {
+    pthread_mutex_lock(&journal.lock);
+    bool due = sync_policy == SYNC_ALWAYS ||
+               (sync_policy == SYNC_INTERVAL && ms_since(&last_sync) >= sync_interval_ms);
+    pthread_mutex_unlock(&journal.lock);
+    return due;
+}
+
+// Copy the part of src (which lives at src_off in the metadata region) that
+// overlaps [off, off+len) into buf
+static void copy_overlap(unsigned char *buf, uint64_t off, size_t len,
+                         const void *src, uint64_t src_off, uint64_t src_len) {
+    uint64_t lo = off > src_off ? off : src_off;
+    uint64_t hi = off + len < src_off + src_len ? off + len : src_off + src_len;
+    if (lo < hi) {
+        memcpy(buf + (lo - off), (const unsigned char *)src + (lo - src_off), hi - lo);
+    }
+}
+
+// Serialize the metadata bytes [off, off+len) into buf
+static void meta_fill(unsigned char *buf, uint64_t off, size_t len) {
+    memset(buf, 0, len);
+    struct SuperBlock sb = fs.sb;
+    sb.file_count = fs.file_count;
+    copy_overlap(buf, off, len, &sb, 0, sizeof(sb));
+    copy_overlap(buf, off, len, fs.files, SUPERBLOCK_SIZE,
+                 (uint64_t)fs.sb.max_files * sizeof(struct FileEntry));
+    copy_overlap(buf, off, len, fs.extents, EXTENT_TABLE_OFF,
+                 (uint64_t)fs.sb.max_extents * sizeof(struct Extent));
+}
+
+// Write dirty metadata sectors to their home locations, coalescing
+// adjacent ones into one write
+static int write_home() {
+    enum { MAX_RUN = 64 };  // sectors per write
+    unsigned char buf[MAX_RUN * META_SECTOR];
+    size_t i = 0;
+    while (i < meta_sectors) {
+        if (!meta_dirty[i]) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < meta_sectors && j - i < MAX_RUN && meta_dirty[j]) j++;
+        uint64_t off = (uint64_t)i * META_SECTOR;
+        size_t len = (j - i) * META_SECTOR;
+        meta_fill(buf, off, len);
+        if (disk_write_at(buf, len, off) != (ssize_t)len) return -1;
+        memset(meta_dirty + i, 0, j - i);
+        i = j;
+    }
+    // The checksum table is written straight from memory
+    size_t table = BLOCK_COUNT * sizeof(uint32_t);
+    for (i = 0; fs.sb.crc_offset && i < crc_sectors; ) {
+        if (!crc_dirty[i]) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < crc_sectors && crc_dirty[j]) j++;
+        size_t off = i * META_SECTOR;
+        size_t len = (j * META_SECTOR < table ? j * META_SECTOR : table) - off;
+        if (disk_write_at((char *)block_crc + off, len, fs.sb.crc_offset + off) != (ssize_t)len) return -1;
+        memset(crc_dirty + i, 0, j - i);
+        i = j;
+    }
+    return 0;
+}
+
+// ---- journal ----
+
+// A journal record: this header, count spans naming the home location of
+// each sector, padding to the next sector boundary, then the sectors.
+// Records follow each other from the start of the region; those of the
+// current epoch carry consecutive sequence numbers from fs.sb.journal_seq,
+// so anything left over from an earlier epoch, or torn, ends the scan.
+struct JournalRecord {
+    uint32_t magic;
+    uint32_t crc;      // CRC32C of the whole record with this field zero
+    uint64_t seq;
+    uint64_t size;     // bytes, header included; a multiple of META_SECTOR
+    uint32_t count;    // sectors
+    uint32_t reserved;
+};
+
+struct JournalSpan {
+    uint64_t off;  // image offset of the sector
+    uint64_t len;  // bytes of it that belong there (the checksum table may end mid-sector)
+};
+
+// Default journal size for an image of disk_size bytes
+static uint64_t journal_default_size(uint64_t disk_size) {
+    uint64_t size = disk_size / DEFAULT_JOURNAL_SHARE / META_SECTOR * META_SECTOR;
+    if (size < JOURNAL_MIN) size = JOURNAL_MIN;
+    if (size > JOURNAL_MAX) size = JOURNAL_MAX;
+    return size;
+}
+
+static uint64_t journal_record_size(uint64_t count) {
+    uint64_t head = sizeof(struct JournalRecord) + count * sizeof(struct JournalSpan);
+    return (head + META_SECTOR - 1) / META_SECTOR * META_SECTOR + count * META_SECTOR;
+}
+
+static uint32_t journal_record_crc(const unsigned char *rec, uint64_t size) {
+    static const uint32_t zero = 0;
+    uint32_t crc = crc32c(0, rec, offsetof(struct JournalRecord, crc));
+    crc = crc32c(crc, &zero, sizeof(zero));
+    size_t rest = offsetof(struct JournalRecord, crc) + sizeof(zero);
+    return crc32c(crc, rec + rest, size - rest);
+}
+
+// Length of the run of valid records of epoch seq at the start of buf (a
+// copy of the region); their number goes to *records
+static uint64_t journal_scan(const unsigned char *buf, uint64_t size, uint64_t seq, uint64_t *records) {
+    uint64_t off = 0, table_end = fs.sb.crc_offset + BLOCK_COUNT * sizeof(uint32_t);
+    *records = 0;
+    while (off + sizeof(struct JournalRecord) <= size) {
+        struct JournalRecord h;
+        memcpy(&h, buf + off, sizeof(h));
+        if (h.magic != JOURNAL_MAGIC || h.seq != seq || h.count == 0 || h.count > size / META_SECTOR ||
+            h.size != journal_record_size(h.count) || h.size > size - off ||
+            h.crc != journal_record_crc(buf + off, h.size)) {
+            break;
+        }
+        const struct JournalSpan *spans = (const struct JournalSpan *)(buf + off + sizeof(h));
+        for (uint32_t k = 0; k < h.count; ++k) {
+            uint64_t lo = spans[k].off, hi = spans[k].off + spans[k].len;
+            // Only the metadata region and the checksum table are journaled
+            if (spans[k].len == 0 || spans[k].len > META_SECTOR ||
+                !(hi <= fs.sb.meta_size || (lo >= fs.sb.crc_offset && hi <= table_end))) {
+                return off;
+            }
+        }
+        off += h.size;
+        seq++;
+        (*records)++;
+    }
+    return off;
+}
+
+// Write the sectors of the records in buf[0, end) to their home locations
+static int journal_apply(const unsigned char *buf, uint64_t end) {
+    for (uint64_t off = 0; off < end; ) {
+        const struct JournalRecord *h = (const struct JournalRecord *)(buf + off);
+        const struct JournalSpan *spans = (const struct JournalSpan *)(h + 1);
+        const unsigned char *data = buf + off + h->size - (uint64_t)h->count * META_SECTOR;
+        for (uint32_t k = 0; k < h->count; ++k) {
+            if (disk_write_at(data + (uint64_t)k * META_SECTOR, spans[k].len, spans[k].off) != (ssize_t)spans[k].len) {
+                return -1;
+            }
+        }
+        off += h->size;
+    }
+    return 0;
+}
+
+// Start a new epoch at sequence number seq: the superblock on disk, which
+// is current once a checkpoint or replay has synced, gets the new number
+static int journal_restart(uint64_t seq) {
+    unsigned char sector[META_SECTOR];
+    fs.sb.journal_seq = seq;
+    if (disk_read_at(sector, sizeof(sector), 0) != (ssize_t)sizeof(sector)) return -1;
+    memcpy(sector + offsetof(struct SuperBlock, journal_seq), &seq, sizeof(seq));
+    return disk_write_at(sector, sizeof(sector), 0) == (ssize_t)sizeof(sector) ? 0 : -1;
+}
+
+// Write mirror bytes [from, to) to the region and sync
+static int journal_write(uint64_t from, uint64_t to) {
+    if (to > from && disk_write_at(journal.mirror + from, to - from, fs.sb.journal_offset + from) !=
+                         (ssize_t)(to - from)) {
+        return -1;
+    }
+    return sync_disk();
+}
+
+// Make the records up to seq durable. One thread at a time writes out and
+// syncs everything appended so far; the others wait for it, and find their
+// records covered by that round or the next.
+static int journal_flush(uint64_t seq) {
+    int rc = 0;
+    pthread_mutex_lock(&journal.lock);
+    while (rc == 0 && journal.durable_seq < seq) {
+        if (journal.flushing) {
+            pthread_cond_wait(&journal.idle, &journal.lock);
+            continue;
+        }
+        uint64_t from = journal.flushed, to = journal.used, last = journal.next_seq - 1;
+        journal.flushing = true;
+        pthread_mutex_unlock(&journal.lock);
+        rc = journal_write(from, to);
+        pthread_mutex_lock(&journal.lock);
+        journal.flushing = false;
+        if (rc == 0) {
+            journal.flushed = to;
+            journal.durable_seq = last;
+        }
+        pthread_cond_broadcast(&journal.idle);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return rc;
+}
+
+// Commit the calling thread's last record as the sync policy asks
+static void journal_commit() {
+    uint64_t seq = commit_owed;
+    if (seq == 0) return;
+    commit_owed = 0;
+    if (sync_due()) journal_flush(seq);
+}
+
+// Bring the home sectors up to date with every record and empty the
+// region. The caller holds meta_lock (shared at least), so no record is
+// appended meanwhile. The records are made durable first, and the home
+// sectors before the superblock moves on to the next epoch.
+static int journal_checkpoint() {
+    pthread_mutex_lock(&journal.lock);
+    while (journal.flushing) pthread_cond_wait(&journal.idle, &journal.lock);
+    if (!journal.mirror) {
+        pthread_mutex_unlock(&journal.lock);
+        return 0;
+    }
+    uint64_t from = journal.flushed, to = journal.used, last = journal.next_seq - 1;
+    journal.flushing = true;
+    pthread_mutex_unlock(&journal.lock);
+    int rc = journal_write(from, to);
+    if (rc == 0 && to > 0) {
+        rc = journal_apply(journal.mirror, to) < 0 || sync_disk() < 0 ? -1 : journal_restart(last + 1);
+    }
+    pthread_mutex_lock(&journal.lock);
+    journal.flushing = false;
+    if (rc == 0) {
+        journal.used = journal.flushed = 0;
+        journal.durable_seq = last;
+    }
+    pthread_cond_broadcast(&journal.idle);
+    pthread_mutex_unlock(&journal.lock);
+    return rc;
+}
+
+// Append the dirty sectors as one record of size bytes (count sectors)
+static void journal_append(uint64_t count, uint64_t size) {
+    unsigned char *rec = journal.mirror + journal.used;
+    memset(rec, 0, size - count * META_SECTOR);
+    struct JournalSpan *spans = (struct JournalSpan *)(rec + sizeof(struct JournalRecord));
+    unsigned char *data = rec + size - count * META_SECTOR;
+    uint64_t n = 0;
+    for (size_t i = 0; i < meta_sectors; ++i) {
+        if (!meta_dirty[i]) continue;
+        spans[n].off = (uint64_t)i * META_SECTOR;
+        spans[n].len = META_SECTOR;
+        meta_fill(data + n * META_SECTOR, spans[n].off, META_SECTOR);
+        meta_dirty[i] = 0;
+        n++;
+    }
+    uint64_t table = BLOCK_COUNT * sizeof(uint32_t);
+    for (size_t i = 0; i < crc_sectors; ++i) {
+        if (!crc_dirty[i]) continue;
+        uint64_t off = (uint64_t)i * META_SECTOR;
+        spans[n].off = fs.sb.crc_offset + off;
+        spans[n].len = table - off < META_SECTOR ? table - off : META_SECTOR;
+        memset(data + n * META_SECTOR, 0, META_SECTOR);
+        memcpy(data + n * META_SECTOR, (char *)block_crc + off, spans[n].len);
+        crc_dirty[i] = 0;
+        n++;
+    }
+    struct JournalRecord h = { JOURNAL_MAGIC, 0, journal.next_seq, size, (uint32_t)count, 0 };
+    memcpy(rec, &h, sizeof(h));
+    h.crc = journal_record_crc(rec, size);
+    memcpy(rec, &h, sizeof(h));
+    pthread_mutex_lock(&journal.lock);
+    journal.used += size;
+    commit_owed = journal.next_seq++;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Start journaling into the region of the mounted image, numbering records
+// from seq (or on from the last one this process wrote, if higher)
+static int journal_open(uint64_t seq) {
+    unsigned char *mirror = malloc(fs.sb.journal_size);
+    if (!mirror) return -1;
+    pthread_mutex_lock(&journal.lock);
+    if (seq < journal.next_seq) seq = journal.next_seq;
+    journal.mirror = mirror;
+    journal.used = journal.flushed = 0;
+    journal.next_seq = seq;
+    journal.durable_seq = seq - 1;
+    pthread_mutex_unlock(&journal.lock);
+    return seq != fs.sb.journal_seq ? journal_restart(seq) : 0;
+}
+
+// Stop journaling: wait out a flush in progress and drop records not yet
+// written (the image is about to be replaced, or was checkpointed).
+// Metadata is then saved in place until journal_open.
+static void journal_close() {
+    pthread_mutex_lock(&journal.lock);
+    while (journal.flushing) pthread_cond_wait(&journal.idle, &journal.lock);
+    free(journal.mirror);
+    journal.mirror = NULL;
+    journal.used = journal.flushed = 0;
+    journal.durable_seq = journal.next_seq - 1;
+    pthread_cond_broadcast(&journal.idle);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Replay the records of the current epoch into their home locations, at
+// mount; the sequence number to go on from goes to *next
+static int journal_recover(uint64_t *next) {
+    unsigned char *buf = malloc(fs.sb.journal_size);
+    if (!buf) return -1;
+    uint64_t records = 0;
+    int rc = disk_read_at(buf, fs.sb.journal_size, fs.sb.journal_offset) == (ssize_t)fs.sb.journal_size ? 0 : -1;
+    uint64_t end = rc == 0 ? journal_scan(buf, fs.sb.journal_size, fs.sb.journal_seq, &records) : 0;
+    if (records > 0 && (journal_apply(buf, end) < 0 || sync_disk() < 0)) rc = -1;
+    *next = fs.sb.journal_seq + records;
+    free(buf);
+    return rc;
+}
+
+static void pending_settle(bool all);
+
+// Save the changed metadata: append it to the journal as one record, or,
+// while no journal is open, write it in place. The commit itself waits for
+// the end of the operation (journal_commit).
+static int save_metadata() {
+    if (disk_fd < 0 || !meta_dirty) return -1;
+    if (batch_active) return 0;
+    if (!journal.mirror) return write_home();
+    pending_settle(false);
+    uint64_t count = 0;
+    for (size_t i = 0; i < meta_sectors; ++i) count += meta_dirty[i];
+    for (size_t i = 0; i < crc_sectors; ++i) count += crc_dirty[i];
+    if (count == 0) return 0;
+    uint64_t size = journal_record_size(count);
+    if (size > fs.sb.journal_size) {
+        // More than the journal holds (a whole table): written in place,
+        // without the atomicity of a record
+        if (journal_checkpoint() < 0 || write_home() < 0 || sync_disk() < 0) return -1;
+        pending_settle(true);
+        return 0;
+    }
+    if (journal.used + size > fs.sb.journal_size && journal_checkpoint() < 0) return -1;
+    journal_append(count, size);
+    return 0;
+}
+
+// ---- extent chains ----
+
+// Byte offset in the image of physical data block pblock
+static int64_t block_offset(uint64_t pblock) {
+    return META_SIZE + (int64_t)pblock * BLOCK_SIZE;
+}
+
+// Number of blocks needed to hold bytes
+static int64_t blocks_for(int64_t bytes) {
+    return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Take an unused extent record, or EXTENT_NONE when the table is full
+static uint32_t record_alloc() {
+    if (free_record_count == 0) return EXTENT_NONE;
+    return free_records[--free_record_count];
+}
+
+static void record_free(uint32_t rec) {
+    memset(&fs.extents[rec], 0, sizeof(struct Extent));
+    fs.extents[rec].next = EXTENT_NONE;
+    mark_extent_dirty(rec);
+    free_records[free_record_count++] = rec;
+}
+
+// Add a reference to each block of a run (a new or newly shared mapping)
+static void block_ref(uint64_t start, int64_t count) {
+    for (int64_t i = 0; i < count; ++i) {
+        block_refs[start + i]++;
+    }
+}
+
+// Return a run of blocks to free space, punching it out of the image
+static void release_blocks(uint64_t start, int64_t count) {
+    if (dedup_index) {
+        for (int64_t i = 0; i < count; ++i) {
+            dedup_remove(start + i);
+        }
+    }
+    alloc_release(start, count);
+    punch_hole(block_offset(start), count * BLOCK_SIZE);
+}
+
+// Release the pending runs whose records are durable; all of them once
+// the metadata has been written in place instead
+static void pending_settle(bool all) {
+    pthread_mutex_lock(&journal.lock);
+    uint64_t durable = journal.durable_seq;
+    pthread_mutex_unlock(&journal.lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < pending_count; ++i) {
+        if (all || pending_free[i].seq <= durable) {
+            // Out of the deduplication index already (blocks_free)
+            alloc_release(pending_free[i].start, pending_free[i].count);
+            punch_hole(block_offset(pending_free[i].start), pending_free[i].count * BLOCK_SIZE);
+        } else {
+            pending_free[kept++] = pending_free[i];
+        }
+    }
+    pending_count = kept;
+}
+
+// Free space is short: make the records of the pending runs durable now so
+// the runs can be reused. Runs freed by the operation under way are in no
+// record yet and stay pending.
+static void pending_reclaim() {
+    if (pending_count == 0) return;
+    journal_flush(journal.next_seq - 1);
+    pending_settle(false);
+}
+
+// Blocks waiting on the journal
+static int64_t pending_blocks() {
+    int64_t blocks = 0;
+    for (size_t i = 0; i < pending_count; ++i) blocks += pending_free[i].count;
+    return blocks;
+}
+
+// Free a run nothing maps any more: at once without a journal, otherwise
+// once the record of the change is durable (pending_settle)
+static void blocks_free(uint64_t start, int64_t count) {
+    if (journal.mirror && pending_count == pending_capacity) {
+        size_t grown = pending_capacity ? pending_capacity * 2 : 64;
+        struct PendingFree *bigger = realloc(pending_free, grown * sizeof(*pending_free));
+        if (bigger) {
+            pending_free = bigger;
+            pending_capacity = grown;
+        }
+    }
+    if (!journal.mirror || pending_count == pending_capacity) {
+        release_blocks(start, count);
+        return;
+    }
+    // Nothing may map the run again meanwhile
+    if (dedup_index) {
+        for (int64_t i = 0; i < count; ++i) {
+            dedup_remove(start + i);
+        }
+    }
+    pending_free[pending_count].start = start;
+    pending_free[pending_count].count = count;
+    pending_free[pending_count].seq = journal.next_seq;
+    pending_count++;
+}
+
+// Drop a reference to each block of a run; blocks nothing maps any more go
+// back to free space
+static void block_unref(uint64_t start, int64_t count) {
+    int64_t run = -1;  // first block of the current run of freed blocks
+    for (int64_t i = 0; i < count; ++i) {
+        if (--block_refs[start + i] == 0) {
+            if (run < 0) run = i;
+        } else if (run >= 0) {
+            blocks_free(start + run, i - run);
+            run = -1;
+        }
+    }
+    if (run >= 0) blocks_free(start + run, count - run);
+}
+
+// Whether any block of file idx is shared with another file
+static bool file_shared(int idx) {
+    for (uint32_t r = fs.files[idx].first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        for (uint32_t i = 0; i < fs.extents[r].count; ++i) {
+            if (block_refs[fs.extents[r].pblock + i] > 1) return true;
+        }
+    }
+    return false;
+}
+
+// Abandon the move of file idx, if one is in progress (its blocks or
+// contents are about to change, so the partial copy is stale)
+static void defrag_cancel(int idx) {
+    if (defrag.idx < 0 || defrag.idx != idx) return;
+    release_blocks(defrag.target, defrag.blocks);  // may hold part of a copy
+    defrag.idx = -1;
+}
+
+// Number of blocks mapped by a file's extent chain
+static int64_t file_blocks(const struct FileEntry *f) {
+    int64_t blocks = 0;
+    for (uint32_t r = f->first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        blocks += fs.extents[r].count;
+    }
+    return blocks;
+}
+
+// Unmap every block of file idx from logical block keep onwards
+static void file_shrink(int idx, int64_t keep) {
+    defrag_cancel(idx);
+    struct FileEntry *f = &fs.files[idx];
+    uint32_t prev = EXTENT_NONE;
+    uint32_t r = f->first_extent;
+    while (r != EXTENT_NONE) {
+        struct Extent *e = &fs.extents[r];
+        uint32_t next = e->next;
+        if ((int64_t)e->lblock >= keep) {
+            // Whole extent goes
+            block_unref(e->pblock, e->count);
+            if (prev == EXTENT_NONE) {
+                f->first_extent = next;
+            } else {
+                fs.extents[prev].next = next;
+                mark_extent_dirty(prev);
+            }
+            record_free(r);
+            f->extent_count--;
+        } else {
+            if ((int64_t)(e->lblock + e->count) > keep) {
+                // Extent straddles the cut: drop its tail
+                uint32_t keep_count = (uint32_t)(keep - e->lblock);
+                block_unref(e->pblock + keep_count, e->count - keep_count);
+                e->count = keep_count;
+                mark_extent_dirty(r);
+            }
+            prev = r;
+        }
+        r = next;
+    }
+    mark_entry_dirty(idx);
+}
+
+// Map nblocks more blocks at the end of file idx. The last extent is
+// extended in place when the blocks after it are free; otherwise new
+// extents are taken from the allocator, so no contiguous run is required.
+// On failure nothing is left allocated.
+static int file_grow(int idx, int64_t nblocks) {
+    if (nblocks <= 0) return 0;
+    defrag_cancel(idx);
+    if (alloc_free_total() < nblocks) pending_reclaim();
+    if (alloc_free_total() < nblocks) return -1;
+    struct FileEntry *f = &fs.files[idx];
+    int64_t old_blocks = 0;
+    uint32_t last = EXTENT_NONE;
+    for (uint32_t r = f->first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        old_blocks += fs.extents[r].count;
+        last = r;
+    }
+    int64_t remaining = nblocks;
+    if (last != EXTENT_NONE) {
+        struct Extent *e = &fs.extents[last];
+        int64_t take = alloc_free_at(e->pblock + e->count);
+        if (take > remaining) take = remaining;
+        if (take > (int64_t)(UINT32_MAX - e->count)) take = UINT32_MAX - e->count;
+        if (take > 0 && alloc_reserve(e->pblock + e->count, take) == 0) {
+            block_ref(e->pblock + e->count, take);
+            e->count += (uint32_t)take;
+            mark_extent_dirty(last);
+            remaining -= take;
+        }
+    }
+    while (remaining > 0) {
+        int64_t want = remaining < UINT32_MAX ? remaining : UINT32_MAX;
+        int64_t got;
+        int64_t start = alloc_take_upto(want, &got);
+        if (start < 0) {
+            file_shrink(idx, old_blocks);
+            return -1;
+        }
+        uint32_t rec = record_alloc();
+        if (rec == EXTENT_NONE) {
+            alloc_release(start, got);
+            file_shrink(idx, old_blocks);
+            return -1;
+        }
+        block_ref(start, got);
+        struct Extent *e = &fs.extents[rec];
+        e->lblock = old_blocks + (nblocks - remaining);
+        e->pblock = start;
+        e->count = (uint32_t)got;
+        e->next = EXTENT_NONE;
+        if (last == EXTENT_NONE) {
+            f->first_extent = rec;
+        } else {
+            fs.extents[last].next = rec;
+            mark_extent_dirty(last);
+        }
+        mark_extent_dirty(rec);
+        f->extent_count++;
+        last = rec;
+        remaining -= got;
+    }
+    mark_entry_dirty(idx);
+    return 0;
+}
+
+// Make file idx map exactly enough blocks for bytes
+static int file_reserve(int idx, int64_t bytes) {
+    int64_t have = file_blocks(&fs.files[idx]);
+    int64_t need = blocks_for(bytes);
+    if (need > have) return file_grow(idx, need - have);
+    if (need < have) file_shrink(idx, need);
+    return 0;
+}
+
+// Point blocks [k, k+n) of extent record r (of file idx) at the physical
+// run starting at pblock, splitting the record as needed; the old blocks
+// lose a reference. The caller ensures two free records for the split.
+// Returns the record now holding the run.
+static uint32_t extent_remap(int idx, uint32_t r, int64_t k, int64_t n, uint64_t pblock) {
+    struct Extent old = fs.extents[r];
+    block_unref(old.pblock + k, n);
+    uint32_t next = old.next;
+    if (k + n < old.count) {
+        uint32_t tail = record_alloc();
+        fs.extents[tail].lblock = old.lblock + k + n;
+        fs.extents[tail].pblock = old.pblock + k + n;
+        fs.extents[tail].count = (uint32_t)(old.count - k - n);
+        fs.extents[tail].next = next;
+        mark_extent_dirty(tail);
+        fs.files[idx].extent_count++;
+        next = tail;
+    }
+    uint32_t mid = r;
+    if (k > 0) {
+        mid = record_alloc();
+        fs.extents[r].count = (uint32_t)k;
+        fs.extents[r].next = mid;
+        mark_extent_dirty(r);
+        fs.files[idx].extent_count++;
+    }
+    fs.extents[mid].lblock = old.lblock + k;
+    fs.extents[mid].pblock = pblock;
+    fs.extents[mid].count = (uint32_t)n;
+    fs.extents[mid].next = next;
+    mark_extent_dirty(mid);
+    mark_entry_dirty(idx);
+    return mid;
+}
+
+// Drop blocks [first, end) of file idx from the deduplication index: a
+// write is about to change them in place
+static void dedup_forget(int idx, int64_t first, int64_t end) {
+    for (uint32_t r = fs.files[idx].first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        struct Extent *e = &fs.extents[r];
+        int64_t lo = first > (int64_t)e->lblock ? first - (int64_t)e->lblock : 0;
+        int64_t hi = end < (int64_t)(e->lblock + e->count) ? end - (int64_t)e->lblock : (int64_t)e->count;
+        for (int64_t k = lo; k < hi; ++k) {
+            dedup_remove(e->pblock + k);
+        }
+    }
+}
+
+// A private run planned by file_unshare: count blocks from logical block
+// lblock move to the new physical run at pblock
+struct Unshare {
+    uint64_t lblock;
+    uint64_t pblock;
+    int64_t count;
+};
+
+// Copy on write: before file idx writes from byte off to the end of the
+// block holding off + len - 1, give it private copies of the shared blocks
+// in that range. Only the bytes of the first block that lie before off are
+// carried over; the caller overwrites the rest. Blocks and extent records
+// are all secured before anything is remapped, so on failure the file is
+// unchanged. On success the range's blocks leave the deduplication index
+// until their new checksums are stored.
+static int file_unshare(int idx, int64_t off, int64_t len) {
+    if (len <= 0) return 0;
+    int64_t first = off / BLOCK_SIZE;
+    int64_t end = blocks_for(off + len);
+    struct Unshare *plan = NULL;
+    size_t count = 0, capacity = 0;
+    char *buf = NULL;
+    int rc = 0;
+    for (uint32_t r = fs.files[idx].first_extent; r != EXTENT_NONE && rc == 0; r = fs.extents[r].next) {
+        struct Extent *e = &fs.extents[r];
+        int64_t lo = first > (int64_t)e->lblock ? first - (int64_t)e->lblock : 0;
+        int64_t hi = end < (int64_t)(e->lblock + e->count) ? end - (int64_t)e->lblock : (int64_t)e->count;
+        for (int64_t k = lo; k < hi && rc == 0;) {
+            if (block_refs[e->pblock + k] <= 1) {
+                k++;
+                continue;
+            }
+            int64_t n = 1;
+            while (k + n < hi && block_refs[e->pblock + k + n] > 1) n++;
+            if (count == capacity) {
+                size_t grown = capacity ? capacity * 2 : 8;
+                struct Unshare *bigger = realloc(plan, grown * sizeof(*plan));
+                if (!bigger) {
+                    rc = -1;
+                    break;
+                }
+                plan = bigger;
+                capacity = grown;
+            }
+            int64_t got;
+            int64_t start = alloc_take_upto(n, &got);
+            if (start < 0) {
+                pending_reclaim();
+                start = alloc_take_upto(n, &got);
+            }
+            if (start < 0) {
+                rc = -1;
+                break;
+            }
+            plan[count].lblock = e->lblock + k;
+            plan[count].pblock = start;
+            plan[count].count = got;
+            count++;
+            if ((int64_t)e->lblock + k == first && off % BLOCK_SIZE != 0) {
+                // The first block keeps its bytes before off
+                size_t keep = off % BLOCK_SIZE;
+                if ((!buf && !(buf = malloc(BLOCK_SIZE))) ||
+                    data_read_at(buf, keep, block_offset(e->pblock + k)) != (ssize_t)keep ||
+                    data_write_at(buf, keep, block_offset(start)) != (ssize_t)keep) {
+                    rc = -1;
+                }
+            }
+            k += got;
+        }
+    }
+    free(buf);
+    // Each remap splits off at most a head and a tail record
+    if (rc < 0 || free_record_count < 2 * count) {
+        for (size_t i = 0; i < count; ++i) {
+            alloc_release(plan[i].pblock, plan[i].count);
+        }
+        free(plan);
+        return -1;
+    }
+    uint32_t r = fs.files[idx].first_extent;
+    for (size_t i = 0; i < count; ++i) {
+        while (plan[i].lblock >= fs.extents[r].lblock + fs.extents[r].count) r = fs.extents[r].next;
+        block_ref(plan[i].pblock, plan[i].count);
+        r = extent_remap(idx, r, plan[i].lblock - fs.extents[r].lblock, plan[i].count, plan[i].pblock);
+    }
+    free(plan);
+    if (dedup_index) dedup_forget(idx, first, end);
+    return 0;
+}
+
+// Give file dest (empty) its own chain of extent records mapping the same
+// blocks as file src; every block gains a reference
+static int file_share(int src, int dest) {
+    if (free_record_count < fs.files[src].extent_count) return -1;
+    uint32_t last = EXTENT_NONE;
+    for (uint32_t r = fs.files[src].first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        uint32_t rec = record_alloc();
+        fs.extents[rec] = fs.extents[r];
+        fs.extents[rec].next = EXTENT_NONE;
+        block_ref(fs.extents[rec].pblock, fs.extents[rec].count);
+        if (last == EXTENT_NONE) {
+            fs.files[dest].first_extent = rec;
+        } else {
+            fs.extents[last].next = rec;
+        }
+        mark_extent_dirty(rec);
+        fs.files[dest].extent_count++;
+        last = rec;
+    }
+    mark_entry_dirty(dest);
+    return 0;
+}
+
+// Callback for one contiguous piece of a file: the piece starts at image
+// offset disk_off, at file offset file_off, and is len bytes long
+typedef int (*span_fn)(int64_t disk_off, int64_t file_off, int64_t len, void *ctx);
+
+// Walk the byte range [off, off+len) of the extent chain starting at record
+// first of table, one contiguous piece at a time
+static int chain_for_each_span(const struct Extent *table, uint32_t first, int64_t off, int64_t len,
+                               span_fn fn, void *ctx) {
+    int64_t end = off + len;
+    for (uint32_t r = first; r != EXTENT_NONE && off < end; r = table[r].next) {
+        const struct Extent *e = &table[r];
+        int64_t ext_start = (int64_t)e->lblock * BLOCK_SIZE;
+        int64_t ext_end = ext_start + (int64_t)e->count * BLOCK_SIZE;
+        if (ext_end <= off) continue;
+        if (ext_start > off) return -1;  // hole in the mapping
+        int64_t piece = (ext_end < end ? ext_end : end) - off;
+        if (fn(block_offset(e->pblock) + (off - ext_start), off, piece, ctx) < 0) return -1;
+        off += piece;
+    }
+    return off == end ? 0 : -1;
+}
+
+// Same, for the live chain of file idx
+static int file_for_each_span(int idx, int64_t off, int64_t len, span_fn fn, void *ctx) {
+    return chain_for_each_span(fs.extents, fs.files[idx].first_extent, off, len, fn, ctx);
+}
+
+struct IoCtx {
+    char *buf;
+    int64_t base;  // file offset that buf[0] corresponds to
+};
+
+static int span_read(int64_t disk_off, int64_t file_off, int64_t len, void *ctx) {
+    struct IoCtx *io = ctx;
+    return data_read_at(io->buf + (file_off - io->base), len, disk_off) == len ? 0 : -1;
+}
+
+static int span_write(int64_t disk_off, int64_t file_off, int64_t len, void *ctx) {
+    struct IoCtx *io = ctx;
+    return data_write_at(io->buf + (file_off - io->base), len, disk_off) == len ? 0 : -1;
+}
+
+// Read or write len bytes at file offset off through the file's extents
+static int file_read_at(int idx, int64_t off, void *buf, int64_t len) {
+    struct IoCtx io = { buf, off };
+    return file_for_each_span(idx, off, len, span_read, &io);
+}
+
+static int file_write_at(int idx, int64_t off, const void *buf, int64_t len) {
+    defrag_cancel(idx);
+    struct IoCtx io = { (char *)buf, off };
+    return file_for_each_span(idx, off, len, span_write, &io);
+}
+
+// Private copy of a file's extent chain, so its data can be transferred
+// without meta_lock: the blocks themselves cannot change while the file's
+// stripe lock is held
+struct FileMap {
+    struct Extent *extents;  // chain in logical order; next is the array index
+    uint32_t count;
+};
+
+static int map_snapshot(int idx, struct FileMap *map) {
+    uint32_t n = fs.files[idx].extent_count;
+    map->extents = malloc((n ? n : 1) * sizeof(struct Extent));
+    if (!map->extents) return -1;
+    uint32_t i = 0;
+    for (uint32_t r = fs.files[idx].first_extent; r != EXTENT_NONE && i < n; r = fs.extents[r].next, ++i) {
+        map->extents[i] = fs.extents[r];
+        map->extents[i].next = i + 1 < n ? i + 1 : EXTENT_NONE;
+    }
+    map->count = i;
+    return 0;
+}
+
+static int map_write_at(const struct FileMap *map, int64_t off, const void *buf, int64_t len) {
+    struct IoCtx io = { (char *)buf, off };
+    return chain_for_each_span(map->extents, map->count ? 0 : EXTENT_NONE, off, len, span_write, &io);
+}
+
+// ---- block checksums ----
+
+// Checksumming of file bytes [off, off+len) just written from buf: blocks
+// the range fills completely are summed straight from buf, the rest (its
+// partial ends, or every block when buf is NULL) are read back whole
+struct CrcCtx {
+    const char *buf;
+    int64_t off, len;  // the written range
+    uint32_t *crcs;    // per block, from the one holding off
+    int64_t first;     // file block crcs[0] belongs to
+    char *scratch;
+    int64_t scratch_blocks;
+    bool check;        // compare with block_crc instead of filling crcs
+    int64_t bad;       // check: mismatching blocks
+};
+
+static int span_crc(int64_t disk_off, int64_t file_off, int64_t len, void *ctx) {
+    struct CrcCtx *c = ctx;
+    // Spans start and end on block boundaries (see chain_crcs)
+    for (int64_t done = 0; done < len; ) {
+        int64_t lo = file_off + done;
+        int64_t n = 1;
+        uint32_t crc;
+        if (c->buf && lo >= c->off && lo + BLOCK_SIZE <= c->off + c->len) {
+            crc = crc32c(0, c->buf + (lo - c->off), BLOCK_SIZE);
+            c->crcs[lo / BLOCK_SIZE - c->first] = crc;
+        } else {
+            // Read back as many such blocks as fit in the scratch buffer
+            while (done + n * BLOCK_SIZE < len && n < c->scratch_blocks &&
+                   !(c->buf && lo + n * BLOCK_SIZE >= c->off && lo + (n + 1) * BLOCK_SIZE <= c->off + c->len)) {
+                n++;
+            }
+            if (data_read_at(c->scratch, n * BLOCK_SIZE, disk_off + done) != n * BLOCK_SIZE) return -1;
+            for (int64_t k = 0; k < n; ++k) {
+                c->crcs[lo / BLOCK_SIZE + k - c->first] = crc32c(0, c->scratch + k * BLOCK_SIZE, BLOCK_SIZE);
+            }
+        }
+        done += n * BLOCK_SIZE;
+    }
+    return 0;
+}
+
+// CRC32C of each block of a chain holding file bytes [off, off+len), which
+// were just written from buf (NULL: they are only on disk); crcs gets one
+// value per block from the one holding off
+static int chain_crcs(const struct Extent *table, uint32_t first, int64_t off, int64_t len, const char *buf,
+                      uint32_t *crcs) {
+    if (len <= 0) return 0;
+    struct CrcCtx c = { buf, off, len, crcs, off / BLOCK_SIZE, NULL, 0, false, 0 };
+    c.scratch_blocks = buf ? 1 : STREAM_CHUNK / BLOCK_SIZE;
+    if (!(c.scratch = malloc(c.scratch_blocks * BLOCK_SIZE))) return -1;
+    int64_t lo = c.first * BLOCK_SIZE;
+    int rc = chain_for_each_span(table, first, lo, blocks_for(off + len) * BLOCK_SIZE - lo, span_crc, &c);
+    free(c.scratch);
+    return rc;
+}
+
+// Number of blocks holding file bytes [off, off+len)
+static int64_t range_blocks(int64_t off, int64_t len) {
+    return len > 0 ? blocks_for(off + len) - off / BLOCK_SIZE : 0;
+}
+
+// Same, for data just written through a map snapshot; returns the values
+// (to be stored with file_store_crcs), or NULL
+static uint32_t *map_crcs(const struct FileMap *map, int64_t off, int64_t len, const char *buf) {
+    uint32_t *crcs = malloc((range_blocks(off, len) + 1) * sizeof(uint32_t));
+    if (crcs && chain_crcs(map->extents, map->count ? 0 : EXTENT_NONE, off, len, buf, crcs) < 0) {
+        free(crcs);
+        return NULL;
+    }
+    return crcs;
+}
+
+// Store (or, check set, compare) the checksums of the blocks of file idx
+// holding bytes [off, off+len)
+static int span_store(int64_t disk_off, int64_t file_off, int64_t len, void *ctx) {
+    struct CrcCtx *c = ctx;
+    uint64_t b = (disk_off - META_SIZE) / BLOCK_SIZE;
+    for (int64_t k = 0; k < len / BLOCK_SIZE; ++k) {
+        uint32_t crc = c->crcs[file_off / BLOCK_SIZE + k - c->first];
+        if (!c->check) {
+            set_block_crc(b + k, crc);
+        } else if (block_crc[b + k] != crc) {
+            c->bad++;
+        }
+    }
+    return 0;
+}
+
+static int64_t file_store_crcs(int idx, int64_t off, int64_t len, const uint32_t *crcs, bool check) {
+    if (len <= 0) return 0;
+    struct CrcCtx c = { NULL, off, len, (uint32_t *)crcs, off / BLOCK_SIZE, NULL, 0, check, 0 };
+    int64_t lo = c.first * BLOCK_SIZE;
+    if (file_for_each_span(idx, lo, blocks_for(off + len) * BLOCK_SIZE - lo, span_store, &c) < 0) return -1;
+    return c.bad;
+}
+
+// Checksum the blocks of file idx holding bytes [off, off+len), just
+// written from buf, and store the values (meta_lock held exclusively)
+static int file_update_crcs(int idx, int64_t off, int64_t len, const char *buf) {
+    uint32_t *crcs = malloc((range_blocks(off, len) + 1) * sizeof(uint32_t));
+    int rc = !crcs || chain_crcs(fs.extents, fs.files[idx].first_extent, off, len, buf, crcs) < 0 ||
+             file_store_crcs(idx, off, len, crcs, false) < 0 ? -1 : 0;
+    free(crcs);
+    return rc;
+}
+
+// Check bytes [off, off+len) of file idx, just read into buf, against the
+// stored checksums; returns the number of blocks that do not match
+static int64_t file_verify(int idx, int64_t off, int64_t len, const char *buf) {
+    uint32_t *crcs = malloc((range_blocks(off, len) + 1) * sizeof(uint32_t));
+    int64_t bad = !crcs || chain_crcs(fs.extents, fs.files[idx].first_extent, off, len, buf, crcs) < 0
+                      ? -1 : file_store_crcs(idx, off, len, crcs, true);
+    free(crcs);
+    return bad;
+}
+
+// A pass over every block in use, split between threads a chunk at a time:
+// each block's contents are checked against block_crc or (rebuild) summed
+// into it. Reads bypass the block cache, so it must have been flushed.
+struct Scrub {
+    bool rebuild;
+    int64_t chunk_blocks;
+    int64_t next_chunk;  // next chunk to take, atomically
+    pthread_mutex_t lock;
+    int64_t blocks, bad, first_bad;  // totals of the finished threads
+    bool failed;
+};
+
+static void *scrub_worker(void *arg) {
+    struct Scrub *sc = arg;
+    // On the mapping the blocks are summed in place
+    char *buf = disk_map ? NULL : malloc(sc->chunk_blocks * BLOCK_SIZE);
+    int64_t blocks = 0, bad = 0, first_bad = -1;
+    bool failed = !disk_map && !buf;
+    while (!failed) {
+        int64_t lo = __atomic_fetch_add(&sc->next_chunk, 1, __ATOMIC_RELAXED) * sc->chunk_blocks;
+        if (lo >= BLOCK_COUNT) break;
+        int64_t hi = lo + sc->chunk_blocks < BLOCK_COUNT ? lo + sc->chunk_blocks : BLOCK_COUNT;
+        for (int64_t b = lo, e; b < hi && !failed; b = e) {
+            for (e = b; e < hi && (block_refs[e] > 0) == (block_refs[b] > 0); ++e) {}
+            if (block_refs[b] == 0) continue;
+            const unsigned char *data = disk_view(block_offset(b));
+            if (!data) {
+                if (disk_read_at(buf, (e - b) * BLOCK_SIZE, block_offset(b)) != (e - b) * BLOCK_SIZE) {
+                    failed = true;
+                    break;
+                }
+                data = (const unsigned char *)buf;
+            }
+            for (int64_t k = b; k < e; ++k) {
+                uint32_t crc = crc32c(0, data + (k - b) * BLOCK_SIZE, BLOCK_SIZE);
+                if (sc->rebuild) {
+                    block_crc[k] = crc;
+                } else if (crc != block_crc[k]) {
+                    if (bad++ == 0) first_bad = k;
+                }
+            }
+            blocks += e - b;
+        }
+    }
+    free(buf);
+    pthread_mutex_lock(&sc->lock);
+    sc->blocks += blocks;
+    sc->bad += bad;
+    if (first_bad >= 0 && (sc->first_bad < 0 || first_bad < sc->first_bad)) sc->first_bad = first_bad;
+    if (failed) sc->failed = true;
+    pthread_mutex_unlock(&sc->lock);
+    return NULL;
+}
+
+// Run a pass on threads threads (0 = one per processor), the caller's own
+// among them; returns the number of threads used, or -1 if a read failed
+static int scrub_run(struct Scrub *sc, int threads) {
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > 64) threads = 64;
+    sc->chunk_blocks = STREAM_CHUNK / BLOCK_SIZE;
+    sc->next_chunk = 0;
+    sc->blocks = sc->bad = 0;
+    sc->first_bad = -1;
+    sc->failed = false;
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_t ids[64];
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&ids[started], NULL, scrub_worker, sc) == 0) started++;
+    scrub_worker(sc);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+    pthread_mutex_destroy(&sc->lock);
+    return sc->failed ? -1 : started + 1;
+}
+
+// Append a checksum table to an image that has none (one from before
+// CRC_VERSION) and fill it in from the blocks in use
+static int crc_attach() {
+    uint64_t old_size = fs.sb.disk_size;
+    uint64_t table = (old_size + META_SECTOR - 1) / META_SECTOR * META_SECTOR;
+    struct Scrub sc;
+    memset(&sc, 0, sizeof(sc));
+    sc.rebuild = true;
+    unmap_disk();
+    if (ftruncate(disk_fd, table + fs.sb.block_count * sizeof(uint32_t)) < 0) return -1;
+    fs.sb.crc_offset = table;
+    fs.sb.disk_size = table + fs.sb.block_count * sizeof(uint32_t);
+    if (map_disk() < 0 || scrub_run(&sc, 0) < 0) {
+        unmap_disk();
+        fs.sb.crc_offset = 0;
+        fs.sb.disk_size = old_size;
+        ftruncate(disk_fd, old_size);
+        return -1;
+    }
+    memset(crc_dirty, 1, crc_sectors);
+    return 0;
+}
+
+// Append a journal region to an image that has none (one from before
+// JOURNAL_VERSION)
+static int journal_attach() {
+    uint64_t old_size = fs.sb.disk_size;
+    uint64_t offset = (old_size + META_SECTOR - 1) / META_SECTOR * META_SECTOR;
+    uint64_t size = journal_default_size(old_size);
+    unmap_disk();
+    if (ftruncate(disk_fd, offset + size) < 0) return -1;
+    fs.sb.disk_size = offset + size;
+    if (map_disk() < 0) {
+        fs.sb.disk_size = old_size;
+        ftruncate(disk_fd, old_size);
+        return -1;
+    }
+    fs.sb.journal_offset = offset;
+    fs.sb.journal_size = size;
+    fs.sb.journal_seq = 1;
+    return 0;
+}
+
+// ---- deduplication ----
+
+// (Re)build the deduplication index from the blocks in use, or drop it
+// while deduplication is off; -1 if out of memory
+static int dedup_rebuild() {
+    free(dedup_index);
+    dedup_index = NULL;
+    if (!dedup_enabled) return 0;
+    uint64_t slots = 1;
+    while (slots < 2 * (uint64_t)BLOCK_COUNT) slots <<= 1;
+    dedup_index = malloc(slots * sizeof(int64_t));
+    if (!dedup_index) return -1;
+    dedup_mask = slots - 1;
+    for (uint64_t i = 0; i < slots; ++i) {
+        dedup_index[i] = -1;
+    }
+    for (int64_t b = 0; b < BLOCK_COUNT; ++b) {
+        if (block_refs[b] > 0) dedup_insert(b);
+    }
+    return 0;
+}
+
+// Whether data block b holds the same bytes as the block at data; buf is a
+// block of scratch space where the image is not mapped
+static bool block_equal(int64_t b, const char *data, char *buf) {
+    const unsigned char *view = disk_view(block_offset(b));
+    if (!view) {
+        if (data_read_at(buf, BLOCK_SIZE, block_offset(b)) != BLOCK_SIZE) return false;
+        view = (const unsigned char *)buf;
+    }
+    return memcmp(view, data, BLOCK_SIZE) == 0;
+}
+
+// A block in use holding the same bytes as the block at data (checksum
+// crc), or -1. Block prefer is taken if it is one, so that runs of
+// matches stay runs.
+static int64_t dedup_find(uint32_t crc, const char *data, int64_t prefer, char *buf) {
+    int64_t found = -1;
+    for (uint64_t pos = crc & dedup_mask; dedup_index[pos] != -1; pos = (pos + 1) & dedup_mask) {
+        int64_t b = dedup_index[pos];
+        if (block_crc[b] != crc || (found >= 0 && b != prefer)) continue;
+        // Equal checksums only make a candidate: the bytes decide
+        if (block_equal(b, data, buf)) {
+            found = b;
+            if (b == prefer) break;
+        }
+    }
+    return found;
+}
+
+// Blocks of the data being deduplicated that had no match and keep their
+// own physical block: later blocks of the same write with the same bytes
+// map to those. They are compared in memory; the blocks are not in the
+// index until the write is done, so no one else can map them meanwhile.
+struct DedupWrite {
+    const char *data;
+    int64_t off;
+    char *buf;  // scratch block for block_equal
+    struct { uint32_t crc; int64_t lblock; int64_t pblock; } *own;  // open addressing, lblock -1 = empty
+    uint64_t mask;
+};
+
+// Block holding the same bytes as file block k of the data, or -1; as
+// dedup_find, prefer wins if it is one. A block without a match is
+// remembered as its own physical block pblock.
+static int64_t dedup_lookup(struct DedupWrite *w, int64_t k, int64_t pblock, int64_t prefer) {
+    const char *p = w->data + (k * BLOCK_SIZE - w->off);
+    uint32_t crc = crc32c(0, p, BLOCK_SIZE);
+    int64_t found = dedup_find(crc, p, prefer, w->buf);
+    if (found >= 0 && found == prefer) return found;
+    uint64_t pos = crc & w->mask;
+    for (; w->own[pos].lblock != -1; pos = (pos + 1) & w->mask) {
+        if (w->own[pos].crc != crc || (found >= 0 && w->own[pos].pblock != prefer)) continue;
+        if (memcmp(w->data + (w->own[pos].lblock * BLOCK_SIZE - w->off), p, BLOCK_SIZE) == 0) {
+            found = w->own[pos].pblock;
+            if (found == prefer) return found;
+        }
+    }
+    if (found < 0) {
+        w->own[pos].crc = crc;
+        w->own[pos].lblock = k;
+        w->own[pos].pblock = pblock;
+    }
+    return found;
+}
+
+// Before bytes [off, off+len) of file idx are written from data, point
+// each block they fill completely at a block holding the same bytes, if
+// there is one: a block in use, or an earlier block of the same data; the
+// file's own block is freed. skip gets a flag per block of the range (see
+// range_blocks) for the blocks so mapped, which need no writing. Called
+// after file_unshare, with meta_lock held exclusively; returns the number
+// of blocks mapped.
+static int64_t file_dedup(int idx, int64_t off, int64_t len, const char *data, unsigned char *skip) {
+    int64_t first = blocks_for(off);
+    int64_t end = (off + len) / BLOCK_SIZE;
+    if (!dedup_index || first >= end) return 0;
+    struct DedupWrite w = { data, off, NULL, NULL, 0 };
+    uint64_t slots = 1;
+    while (slots < 2 * (uint64_t)(end - first)) slots <<= 1;
+    w.mask = slots - 1;
+    w.own = malloc(slots * sizeof(*w.own));
+    if ((!disk_map && !(w.buf = malloc(BLOCK_SIZE))) || !w.own) {
+        free(w.buf);
+        free(w.own);
+        return 0;
+    }
+    for (uint64_t i = 0; i < slots; ++i) {
+        w.own[i].lblock = -1;
+    }
+    int64_t mapped = 0;
+    int64_t match = -2;  // block found for block k, -1 = none, -2 = not looked up yet
+    uint32_t r = fs.files[idx].first_extent;
+    for (int64_t k = first; k < end && free_record_count >= 2;) {
+        while (k >= (int64_t)(fs.extents[r].lblock + fs.extents[r].count)) r = fs.extents[r].next;
+        struct Extent *e = &fs.extents[r];
+        int64_t limit = (int64_t)(e->lblock + e->count) < end ? (int64_t)(e->lblock + e->count) : end;
+        if (match == -2) match = dedup_lookup(&w, k, e->pblock + (k - e->lblock), -1);
+        if (match < 0) {
+            k++;
+            match = -2;
+            continue;
+        }
+        // Extend the run while the following blocks match the following
+        // blocks of the copy, within this extent
+        int64_t n = 1, next = -2;
+        while (k + n < limit) {
+            next = dedup_lookup(&w, k + n, e->pblock + (k + n - e->lblock), match + n);
+            if (next != match + n) break;
+            n++;
+            next = -2;
+        }
+        block_ref(match, n);
+        r = extent_remap(idx, r, k - (int64_t)e->lblock, n, match);
+        memset(skip + (k - off / BLOCK_SIZE), 1, n);
+        mapped += n;
+        k += n;
+        match = next;
+    }
+    free(w.buf);
+    free(w.own);
+    dedup_hits += mapped;
+    return mapped;
+}
+
+// Next piece of file bytes [off, off+len) outside the blocks flagged in
+// skip (NULL = none), from block *k of the range on; false when none is left
+static bool next_unskipped(int64_t off, int64_t len, const unsigned char *skip, int64_t *k,
+                           int64_t *lo, int64_t *hi) {
+    int64_t blocks = range_blocks(off, len);
+    while (*k < blocks && skip && skip[*k]) ++*k;
+    if (*k >= blocks) return false;
+    int64_t j = *k + 1;
+    while (j < blocks && !(skip && skip[j])) j++;
+    int64_t base = off / BLOCK_SIZE;
+    *lo = (base + *k) * BLOCK_SIZE > off ? (base + *k) * BLOCK_SIZE : off;
+    *hi = (base + j) * BLOCK_SIZE < off + len ? (base + j) * BLOCK_SIZE : off + len;
+    *k = j;
+    return true;
+}
+
+// ---- compression ----
+//
+// A compressed file (FILE_COMPRESSED) is cut into units of COMPRESS_UNIT
+// bytes, each stored from the unit's first logical block on: as is (as
+// many blocks as its bytes need), compressed (a length word and the
+// codec's output, in fewer blocks), or, if it is all zeros, not at all.
+// The number of blocks mapped tells these apart, so the extent chain needs
+// no extra fields; the logical blocks a unit saves are a hole in it. Reads
+// decompress only the units they touch; a change packs the units from the
+// one it starts in onwards again.
+
+// Blocks per compression unit
+static int64_t unit_blocks() {
+    return BLOCK_SIZE < COMPRESS_UNIT ? COMPRESS_UNIT / BLOCK_SIZE : 1;
+}
+
+// Number of logical blocks in [lo, hi) that file idx maps
+static int64_t chain_mapped(int idx, int64_t lo, int64_t hi) {
+    int64_t n = 0;
+    for (uint32_t r = fs.files[idx].first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        int64_t a = (int64_t)fs.extents[r].lblock, b = a + fs.extents[r].count;
+        if (a >= hi) break;
+        if (a < lo) a = lo;
+        if (b > hi) b = hi;
+        if (b > a) n += b - a;
+    }
+    return n;
+}
+
+// Whether len bytes are all zero
+static bool all_zero(const char *p, int64_t len) {
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+// Read bytes [off, off+len) of compressed file idx into buf, checking the
+// blocks read against their checksums when verify is set; returns an
+// FsError code
+static int packed_read(int idx, int64_t off, int64_t len, char *buf, bool verify) {
+    int64_t ub = unit_blocks(), unit = ub * BLOCK_SIZE;
+    int64_t size = fs.files[idx].size;
+    char *stored = NULL, *plain = NULL;
+    int rc = FS_OK;
+    for (int64_t pos = off; pos < off + len && rc == FS_OK; ) {
+        int64_t u = pos / unit;
+        int64_t start = u * unit;
+        int64_t ulen = size - start < unit ? size - start : unit;
+        int64_t piece = (off + len < start + ulen ? off + len : start + ulen) - pos;
+        char *to = buf + (pos - off);
+        int64_t n = chain_mapped(idx, u * ub, (u + 1) * ub);
+        int64_t bad = 0;
+        if (n == 0) {
+            memset(to, 0, piece);
+        } else if (n == blocks_for(ulen)) {
+            if (file_read_at(idx, pos, to, piece) < 0 || (verify && (bad = file_verify(idx, pos, piece, to)) < 0)) {
+                rc = FS_ERR_IO;
+            } else if (bad > 0) {
+                rc = FS_ERR_CORRUPT;
+            }
+        } else if (n > blocks_for(ulen)) {
+            rc = FS_ERR_CORRUPT;
+        } else if ((!stored && !(stored = malloc(unit))) || (!plain && !(plain = malloc(unit)))) {
+            rc = FS_ERR_NO_MEMORY;
+        } else if (file_read_at(idx, start, stored, n * BLOCK_SIZE) < 0 ||
+                   (verify && (bad = file_verify(idx, start, n * BLOCK_SIZE, stored)) < 0)) {
+            rc = FS_ERR_IO;
+        } else {
+            // A whole unit is decompressed straight into buf
+            uint32_t clen;
+            memcpy(&clen, stored, sizeof(clen));
+            char *out = piece == ulen ? to : plain;
+            if (bad > 0 || clen > n * BLOCK_SIZE - sizeof(clen) ||
+                lz_decompress(stored + sizeof(clen), clen, out, ulen) != ulen) {
+                rc = FS_ERR_CORRUPT;
+            } else if (out == plain) {
+                memcpy(to, plain + (pos - start), piece);
+            }
+        }
+        pos += piece;
+    }
+    free(stored);
+    free(plain);
+    return rc;
+}
+
+// Read bytes [off, off+len) of what file idx holds, decompressing as needed
+static int file_read_data(int idx, int64_t off, void *buf, int64_t len) {
+    if (fs.files[idx].flags & FILE_COMPRESSED) return packed_read(idx, off, len, buf, false) < 0 ? -1 : 0;
+    return file_read_at(idx, off, buf, len);
+}
+
+// Units about to replace those of a file from unit from on, packed in
+// memory with their checksums
+struct Packed {
+    int64_t from;
+    int64_t units;
+    int64_t *blocks;  // blocks each unit takes: 0 for a unit of zeros
+    char *data;       // those blocks, back to back
+    uint32_t *crcs;   // one per block of data
+    int64_t total;    // blocks in data
+};
+
+static void packed_free(struct Packed *p) {
+    free(p->blocks);
+    free(p->data);
+    free(p->crcs);
+}
+
+// Pack head[0..head_len) followed by data[0..len) as the units from unit
+// from on: compressed where that saves a block (compress set), or each
+// one as is, which is the layout of a plain file. -1 if out of memory.
+static int pack_units(struct Packed *p, int64_t from, const char *head, int64_t head_len, const char *data,
+                      int64_t len, bool compress) {
+    int64_t unit = unit_blocks() * BLOCK_SIZE;
+    int64_t bytes = head_len + len;
+    memset(p, 0, sizeof(*p));
+    p->from = from;
+    p->units = (bytes + unit - 1) / unit;
+    p->blocks = calloc(p->units + 1, sizeof(int64_t));
+    p->data = malloc(blocks_for(bytes) * BLOCK_SIZE + 1);
+    p->crcs = malloc((blocks_for(bytes) + 1) * sizeof(uint32_t));
+    char *stage = head_len > 0 ? malloc(unit) : NULL;  // the first unit, when it starts with head
+    if (!p->blocks || !p->data || !p->crcs || (head_len > 0 && !stage)) {
+        free(stage);
+        packed_free(p);
+        return -1;
+    }
+    char *out = p->data;
+    for (int64_t u = 0; u < p->units; ++u) {
+        int64_t ulen = bytes - u * unit < unit ? bytes - u * unit : unit;
+        const char *src = stage;
+        if (u > 0 || head_len == 0) {
+            src = data + (u * unit - head_len);
+        } else {
+            memcpy(stage, head, head_len);
+            if (ulen > head_len) memcpy(stage + head_len, data, ulen - head_len);
+        }
+        int64_t n = blocks_for(ulen);
+        uint32_t clen = 0;
+        if (compress && all_zero(src, ulen)) {
+            n = 0;
+        } else if (compress && n > 1 &&
+                   (clen = lz_compress(src, ulen, out + sizeof(clen), (n - 1) * BLOCK_SIZE - sizeof(clen))) > 0) {
+            memcpy(out, &clen, sizeof(clen));
+            n = blocks_for(sizeof(clen) + clen);
+            memset(out + sizeof(clen) + clen, 0, n * BLOCK_SIZE - sizeof(clen) - clen);
+        } else {
+            memcpy(out, src, ulen);
+            memset(out + ulen, 0, n * BLOCK_SIZE - ulen);
+        }
+        p->blocks[u] = n;
+        out += n * BLOCK_SIZE;
+        p->total += n;
+    }
+    free(stage);
+    for (int64_t k = 0; k < p->total; ++k) {
+        p->crcs[k] = crc32c(0, p->data + k * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    return 0;
+}
+
+// Make file idx map the units of p in place of everything from unit
+// p->from on. Blocks and extent records are all secured before the old
+// units are dropped, so on failure the file is unchanged.
+static int packed_place(int idx, const struct Packed *p) {
+    int64_t ub = unit_blocks();
+    if (alloc_free_total() < p->total) pending_reclaim();
+    if (alloc_free_total() < p->total) return -1;
+    struct Extent *plan = malloc((p->total + 1) * sizeof(*plan));
+    if (!plan) return -1;
+    uint32_t runs = 0;
+    int rc = 0;
+    for (int64_t u = 0; u < p->units && rc == 0; ++u) {
+        for (int64_t done = 0; done < p->blocks[u]; ) {
+            int64_t got;
+            int64_t start = alloc_take_upto(p->blocks[u] - done, &got);
+            if (start < 0) {
+                rc = -1;
+                break;
+            }
+            plan[runs].lblock = (p->from + u) * ub + done;
+            plan[runs].pblock = start;
+            plan[runs].count = (uint32_t)got;
+            plan[runs].next = EXTENT_NONE;
+            runs++;
+            done += got;
+        }
+    }
+    if (rc < 0 || free_record_count < runs) {
+        for (uint32_t i = 0; i < runs; ++i) {
+            alloc_release(plan[i].pblock, plan[i].count);
+        }
+        free(plan);
+        return -1;
+    }
+    file_shrink(idx, p->from * ub);
+    struct FileEntry *f = &fs.files[idx];
+    uint32_t last = EXTENT_NONE;
+    for (uint32_t r = f->first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        last = r;
+    }
+    for (uint32_t i = 0; i < runs; ++i) {
+        block_ref(plan[i].pblock, plan[i].count);
+        struct Extent *e = last == EXTENT_NONE ? NULL : &fs.extents[last];
+        if (e && e->lblock + e->count == plan[i].lblock && e->pblock + e->count == plan[i].pblock &&
+            e->count <= UINT32_MAX - plan[i].count) {
+            // Continues the last run (units stored as is, back to back)
+            e->count += plan[i].count;
+            mark_extent_dirty(last);
+            continue;
+        }
+        uint32_t rec = record_alloc();
+        fs.extents[rec] = plan[i];
+        if (e) {
+            e->next = rec;
+            mark_extent_dirty(last);
+        } else {
+            f->first_extent = rec;
+        }
+        mark_extent_dirty(rec);
+        f->extent_count++;
+        last = rec;
+    }
+    mark_entry_dirty(idx);
+    free(plan);
+    return 0;
+}
+
+// Write the units of p through map, a snapshot taken after packed_place
+static int packed_write(const struct FileMap *map, const struct Packed *p) {
+    const char *at = p->data;
+    for (int64_t u = 0; u < p->units; ++u) {
+        int64_t len = p->blocks[u] * BLOCK_SIZE;
+        if (len > 0 && map_write_at(map, (p->from + u) * unit_blocks() * BLOCK_SIZE, at, len) < 0) return -1;
+        at += len;
+    }
+    return 0;
+}
+
+static int packed_store_crcs(int idx, const struct Packed *p) {
+    int64_t k = 0;
+    for (int64_t u = 0; u < p->units; ++u) {
+        int64_t len = p->blocks[u] * BLOCK_SIZE;
+        if (len > 0 && file_store_crcs(idx, (p->from + u) * unit_blocks() * BLOCK_SIZE, len, p->crcs + k, false) < 0) {
+            return -1;
+        }
+        k += p->blocks[u];
+    }
+    return 0;
+}
+
+// Make file filename hold data[0..len) from byte off on (at most its size)
+// and end there, stored compressed (compress set) or plain: the units from
+// the one holding off are packed again, placed, written and checksummed.
+// The file's stripe lock is held exclusively. With held set the caller
+// also holds meta_lock exclusively (a batch); otherwise it is taken only
+// to read the unit's head, to place the units and to store the checksums,
+// so packing and writing run alongside other files' operations. Returns
+// an FsError code; after a failed write the file ends before the units.
+static int packed_update(const char *filename, int64_t off, const char *data, int64_t len, bool compress,
+                         bool held) {
+    int64_t unit = unit_blocks() * BLOCK_SIZE;
+    int64_t from = off / unit;
+    int64_t head_len = off - from * unit;
+    char *head = head_len > 0 ? malloc(head_len) : NULL;
+    if (head_len > 0 && !head) return FS_ERR_NO_MEMORY;
+    int rc = FS_OK;
+    if (head_len > 0) {
+        if (!held) pthread_rwlock_rdlock(&meta_lock);
+        rc = packed_read(find_file_index(filename), from * unit, head_len, head, false);
+        if (!held) pthread_rwlock_unlock(&meta_lock);
+    }
+    struct Packed p;
+    if (rc == FS_OK && pack_units(&p, from, head, head_len, data, len, compress) < 0) rc = FS_ERR_NO_MEMORY;
+    free(head);
+    if (rc != FS_OK) return rc;
+    if (!held) pthread_rwlock_wrlock(&meta_lock);
+    int idx = find_file_index(filename);
+    struct FileEntry *file = &fs.files[idx];
+    if (packed_place(idx, &p) < 0) {
+        if (!held) pthread_rwlock_unlock(&meta_lock);
+        packed_free(&p);
+        return FS_ERR_NO_SPACE;
+    }
+    file->flags = compress ? file->flags | FILE_COMPRESSED : file->flags & ~FILE_COMPRESSED;
+    if (file->size > off + len) file->size = off + len;  // units past the new end are already gone
+    mark_entry_dirty(idx);
+    struct FileMap map;
+    rc = map_snapshot(idx, &map) < 0 ? FS_ERR_NO_MEMORY : FS_OK;
+    if (!held) pthread_rwlock_unlock(&meta_lock);
+    if (rc == FS_OK) {
+        rc = packed_write(&map, &p) < 0 ? FS_ERR_IO : FS_OK;
+        free(map.extents);
+    }
+    if (!held) {
+        pthread_rwlock_wrlock(&meta_lock);
+        idx = find_file_index(filename);  // the entry may have moved to another slot
+        file = &fs.files[idx];
+    }
+    defrag_cancel(idx);
+    if (rc == FS_OK && packed_store_crcs(idx, &p) < 0) rc = FS_ERR_IO;
+    if (rc == FS_OK) {
+        file->size = off + len;
+    } else {
+        file_shrink(idx, from * unit_blocks());
+        if (file->size > from * unit) file->size = from * unit;
+    }
+    mark_entry_dirty(idx);
+    if (save_metadata() < 0 && rc == FS_OK) rc = FS_ERR_IO;
+    if (!held) pthread_rwlock_unlock(&meta_lock);
+    packed_free(&p);
+    return rc;
+}
+
+// Whether the chain of compressed file idx, mapping blocks blocks in all,
+// fits its size: each unit mapped from its first block on, with no more
+// blocks than its bytes need, and nothing past the last unit
+static bool packed_valid(int idx, int64_t blocks) {
+    int64_t ub = unit_blocks(), unit = ub * BLOCK_SIZE;
+    int64_t size = fs.files[idx].size, seen = 0;
+    for (int64_t u = 0; u * unit < size; ++u) {
+        int64_t ulen = size - u * unit < unit ? size - u * unit : unit;
+        int64_t n = chain_mapped(idx, u * ub, (u + 1) * ub);
+        if (n > blocks_for(ulen) || chain_mapped(idx, u * ub, u * ub + n) != n) return false;
+        seen += n;
+    }
+    return seen == blocks;
+}
+
+// Image offset of file offset off and the contiguous bytes from there, or -1
+static int64_t file_locate(int idx, int64_t off, int64_t *run) {
+    for (uint32_t r = fs.files[idx].first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        struct Extent *e = &fs.extents[r];
+        int64_t ext_start = (int64_t)e->lblock * BLOCK_SIZE;
+        int64_t ext_end = ext_start + (int64_t)e->count * BLOCK_SIZE;
+        if (off >= ext_start && off < ext_end) {
+            *run = ext_end - off;
+            return block_offset(e->pblock) + (off - ext_start);
+        }
+    }
+    return -1;
+}
+
+// Whether entry i is taken: a live file, or a snapshot's header or files
+static bool entry_used(int i) {
+    return i < fs.file_count || i >= SNAPSHOT_BASE;
+}
+
+// Rebuild the free-extent allocator and the unused-record list from the
+// extent chains (at mount and whenever the layout is replaced wholesale)
+static void rebuild_free_space() {
+    alloc_reset(0, BLOCK_COUNT);
+    pending_count = 0;
+    defrag.idx = -1;  // any reserved destination run is forgotten
+    unsigned char *used = calloc(MAX_EXTENTS ? MAX_EXTENTS : 1, 1);
+    // Reference counts: +1 at the start of every extent, -1 past its end,
+    // then a running sum
+    memset(block_refs, 0, (BLOCK_COUNT + 1) * sizeof(uint32_t));
+    if (fs.file_count >= 0 && fs.file_count <= SNAPSHOT_BASE) {
+        for (int i = 0; i < MAX_FILES; ++i) {
+            if (!entry_used(i)) continue;
+            uint32_t steps = 0;
+            for (uint32_t r = fs.files[i].first_extent; r != EXTENT_NONE && r < MAX_EXTENTS && steps < MAX_EXTENTS;
+                 r = fs.extents[r].next, ++steps) {
+                struct Extent *e = &fs.extents[r];
+                if (used) used[r] = 1;
+                if (e->pblock + e->count > (uint64_t)BLOCK_COUNT) continue;
+                block_refs[e->pblock]++;
+                block_refs[e->pblock + e->count]--;
+            }
+        }
+    }
+    uint32_t refs = 0;
+    int64_t run = -1;  // first block of the current run of mapped blocks
+    for (int64_t b = 0; b <= BLOCK_COUNT; ++b) {
+        refs += block_refs[b];
+        block_refs[b] = b < BLOCK_COUNT ? refs : 0;
+        if (b < BLOCK_COUNT && refs > 0) {
+            if (run < 0) run = b;
+        } else if (run >= 0) {
+            alloc_reserve(run, b - run);
+            run = -1;
+        }
+    }
+    free_record_count = 0;
+    for (uint32_t r = MAX_EXTENTS; r-- > 0;) {
+        if (!used || !used[r]) free_records[free_record_count++] = r;
+    }
+    free(used);
+}
+
+// ---- mounting and formatting ----
+
+// Check that a superblock describes an image this code can mount
+static bool superblock_valid(const struct SuperBlock *sb) {
+    return sb->magic == FS_MAGIC && sb->version >= BLOCK_LAYOUT_VERSION && sb->version <= FS_VERSION &&
+           sb->entry_size == sizeof(struct FileEntry) && sb->extent_size == sizeof(struct Extent) &&
+           sb->max_files > 0 && sb->block_size >= 512 && (sb->block_size & (sb->block_size - 1)) == 0 &&
+           sb->meta_size == meta_size_for(sb->max_files, sb->max_extents, sb->block_size) &&
+           sb->disk_size >= sb->meta_size + sb->block_count * sb->block_size &&
+           sb->file_count <= sb->max_files &&
+           (sb->version < SNAPSHOT_VERSION ? sb->snapshot_entries == 0
+                                           : sb->snapshot_entries <= sb->max_files - sb->file_count) &&
+           (sb->version < CRC_VERSION ? sb->crc_offset == 0
+                                      : sb->crc_offset % META_SECTOR == 0 &&
+                                        sb->crc_offset >= sb->meta_size + sb->block_count * sb->block_size &&
+                                        sb->crc_offset + sb->block_count * sizeof(uint32_t) <= sb->disk_size) &&
+           (sb->version < JOURNAL_VERSION ? sb->journal_size == 0
+                                          : sb->journal_size >= JOURNAL_MIN && sb->journal_size % META_SECTOR == 0 &&
+                                            sb->journal_offset % META_SECTOR == 0 &&
+                                            sb->journal_offset >= sb->crc_offset + sb->block_count * sizeof(uint32_t) &&
+                                            sb->journal_offset + sb->journal_size <= sb->disk_size);
+}
+
+// Load metadata from disk into fs struct
+static int load_metadata() {
+    if (disk_fd < 0) return -1;
+    struct SuperBlock sb;
+    if (disk_read_at(&sb, sizeof(sb), 0) != sizeof(sb) || !superblock_valid(&sb)) return -1;
+    fs.sb = sb;
+    if (setup_tables() < 0) return -1;
+    size_t table = (size_t)sb.max_files * sizeof(struct FileEntry);
+    if (disk_read_at(fs.files, table, SUPERBLOCK_SIZE) != (ssize_t)table) return -1;
+    size_t extents = (size_t)sb.max_extents * sizeof(struct Extent);
+    if (disk_read_at(fs.extents, extents, EXTENT_TABLE_OFF) != (ssize_t)extents) return -1;
+    size_t crcs = sb.crc_offset ? (size_t)sb.block_count * sizeof(uint32_t) : 0;
+    if (disk_read_at(block_crc, crcs, sb.crc_offset) != (ssize_t)crcs) return -1;
+    fs.file_count = sb.file_count;
+    memset(meta_dirty, 0, meta_sectors);
+    memset(crc_dirty, 0, crc_sectors);
+    if (index_rebuild() < 0) return -1;
+    rebuild_free_space();
+    return 0;
+}
+
+// Reset the in-memory tables to an empty filesystem and mark them for flushing
+static void reset_metadata() {
+    fs.file_count = 0;
+    fs.sb.snapshot_entries = 0;
+    memset(fs.files, 0, (size_t)MAX_FILES * sizeof(struct FileEntry));
+    for (uint32_t r = 0; r < MAX_EXTENTS; ++r) {
+        memset(&fs.extents[r], 0, sizeof(struct Extent));
+        fs.extents[r].next = EXTENT_NONE;
+    }
+    index_rebuild();
+    rebuild_free_space();
+    mark_all_dirty();
+}
+
+// Fill in zero fields of a geometry with defaults; -1 if it cannot be laid out
+static int resolve_geometry(struct FsGeometry *g) {
+    if (g->disk_size == 0) g->disk_size = DEFAULT_DISK_SIZE;
+    if (g->max_files == 0) g->max_files = DEFAULT_MAX_FILES;
+    if (g->block_size == 0) g->block_size = DEFAULT_BLOCK_SIZE;
+    if (g->max_extents == 0) g->max_extents = g->max_files * DEFAULT_EXTENTS_PER_FILE;
+    if (g->journal_size == 0) g->journal_size = journal_default_size(g->disk_size);
+    if (g->block_size < 512 || g->block_size > (1u << 20) || (g->block_size & (g->block_size - 1))) return -1;
+    if (g->journal_size < JOURNAL_MIN || g->journal_size % META_SECTOR) return -1;
+    uint64_t meta_size = meta_size_for(g->max_files, g->max_extents, g->block_size);
+    // One block, its checksum and the journal, which starts on a sector boundary
+    if (g->disk_size < meta_size + g->block_size + sizeof(uint32_t) + g->journal_size + META_SECTOR) return -1;
+    return 0;
+}
+
+// Lay out an empty filesystem with the given geometry: size the image and
+// write a fresh superblock and tables. The journal takes the end of the
+// image; each data block takes its size plus four bytes of checksum table
+// before it. The tables are written in place, with the journal closed.
+static int format_image(const struct FsGeometry *geometry) {
+    struct FsGeometry g = *geometry;
+    if (resolve_geometry(&g) < 0) return -1;
+    uint64_t meta_size = meta_size_for(g.max_files, g.max_extents, g.block_size);
+    uint64_t journal_offset = (g.disk_size - g.journal_size) / META_SECTOR * META_SECTOR;
+    journal_close();
+    unmap_disk();
+    // Cutting the image to nothing and back leaves it one big hole: the
+    // data area reads as zeros without being written
+    if (ftruncate(disk_fd, 0) < 0 || ftruncate(disk_fd, g.disk_size) < 0) return -1;
+    memset(&fs.sb, 0, sizeof(fs.sb));
+    fs.sb.magic = FS_MAGIC;
+    fs.sb.version = FS_VERSION;
+    fs.sb.disk_size = g.disk_size;
+    fs.sb.meta_size = meta_size;
+    fs.sb.block_size = g.block_size;
+    fs.sb.block_count = (journal_offset - meta_size) / (g.block_size + sizeof(uint32_t));
+    fs.sb.crc_offset = meta_size + fs.sb.block_count * g.block_size;
+    fs.sb.journal_offset = journal_offset;
+    fs.sb.journal_size = g.journal_size;
+    fs.sb.journal_seq = 1;
+    fs.sb.max_files = g.max_files;
+    fs.sb.entry_size = sizeof(struct FileEntry);
+    fs.sb.max_extents = g.max_extents;
+    fs.sb.extent_size = sizeof(struct Extent);
+    if (setup_tables() < 0 || map_disk() < 0) return -1;
+    reset_metadata();
+    dedup_rebuild();
+    return save_metadata() < 0 || sync_disk() < 0 ? -1 : 0;
+}
+
+// Whether another entry than i has its name: in the live root, or for a
+// snapshot's entry among entries [first, end) of that snapshot
+static bool name_clash(int i, int first, int end) {
+    if (i < fs.file_count) return find_child(0, fs.files[i].name) != -1;
+    for (int j = first; j < end; ++j) {
+        if (j != i && strcmp(fs.files[j].name, fs.files[i].name) == 0) return true;
+    }
+    return false;
+}
+
+// Fix up name of entry i (see upgrade_names); whether it changed
+static bool upgrade_name(int i, int first, int end) {
+    char *name = fs.files[i].name;
+    bool dots = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+    if (!dots && !strchr(name, '/')) return false;
+    bool live = i < fs.file_count;
+    if (live) index_remove(i);
+    for (char *p = name; *p; ++p) {
+        if (*p == '/' || dots) *p = '_';
+    }
+    char base[MAX_FILENAME_LEN];
+    memcpy(base, name, MAX_FILENAME_LEN);
+    for (int n = 1; name_clash(i, first, end); ++n) {
+        snprintf(name, MAX_FILENAME_LEN, "%.*s~%d", MAX_FILENAME_LEN - 9, base, n % 1000000);
+    }
+    if (live) index_insert(i);
+    mark_entry_dirty(i);
+    return true;
+}
+
+// Names from before directories may hold a '/', or be "." or "..", which
+// no path reaches: those characters become '_', and a name that is then
+// taken, live or within its snapshot, gets a "~N" suffix. Returns how many
+// names changed.
+static int upgrade_names() {
+    int changed = 0;
+    for (int i = 0; i < fs.file_count; ++i) {
+        changed += upgrade_name(i, 0, 0);
+    }
+    for (int h = SNAPSHOT_BASE; h < MAX_FILES; ) {
+        int64_t n = fs.files[h].size;
+        int end = n >= 0 && n < MAX_FILES - h ? h + 1 + (int)n : MAX_FILES;
+        for (int i = h + 1; i < end; ++i) {
+            changed += upgrade_name(i, h + 1, end);
+        }
+        h = end;
+    }
+    return changed;
+}
+
+// Rebuild an old-layout image in the block layout. The new image is written
+// to a temporary file, each file's bytes streamed across from old_fd, and
+// the result renamed over the disk image.
+static int migrate_image(const struct OldFile *old, int count, uint32_t max_files) {
+    char tmp_name[] = DISK_NAME ".migrate";
+    int old_fd = disk_fd;
+    int64_t data = 0;
+    for (int i = 0; i < count; ++i) {
+        if (old[i].size > 0) data += old[i].size;
+    }
+    // Room for the old data plus one partial block per file
+    struct FsGeometry g = { 0, max_files, DEFAULT_BLOCK_SIZE, 0, 0 };
+    g.max_extents = max_files * DEFAULT_EXTENTS_PER_FILE;
+    uint64_t meta_size = meta_size_for(g.max_files, g.max_extents, g.block_size);
+    g.disk_size = meta_size + ((uint64_t)data / g.block_size + count + 1) * (g.block_size + sizeof(uint32_t));
+    g.journal_size = journal_default_size(g.disk_size);
+    g.disk_size += g.journal_size + META_SECTOR;
+    if (g.disk_size < DEFAULT_DISK_SIZE) g.disk_size = DEFAULT_DISK_SIZE;
+    disk_fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (disk_fd < 0) {
+        disk_fd = old_fd;
+        return -1;
+    }
+    char *buf = malloc(COPY_CHUNK);
+    if (!buf || format_image(&g) < 0) goto fail;
+    for (int i = 0; i < count; ++i) {
+        struct FileEntry *f = &fs.files[i];
+        memcpy(f->name, old[i].name, MAX_FILENAME_LEN);
+        f->name[MAX_FILENAME_LEN - 1] = '\0';
+        memcpy(f->created, old[i].created, sizeof(f->created));
+        f->first_extent = EXTENT_NONE;
+        fs.file_count = i + 1;
+        if (old[i].size <= 0) continue;
+        if (file_reserve(i, old[i].size) < 0) goto fail;
+        for (int64_t done = 0; done < old[i].size; ) {
+            int64_t n = old[i].size - done < COPY_CHUNK ? old[i].size - done : COPY_CHUNK;
+            if (pread(old_fd, buf, n, old[i].start + done) != n) goto fail;
+            if (file_write_at(i, done, buf, n) < 0 || file_update_crcs(i, done, n, buf) < 0) goto fail;
+            done += n;
+        }
+        f->size = old[i].size;
+    }
+    if (index_rebuild() < 0) goto fail;
+    upgrade_names();
+    mark_all_dirty();
+    if (save_metadata() < 0 || sync_disk() < 0) goto fail;
+    unmap_disk();
+    if (rename(tmp_name, DISK_NAME) < 0) goto fail;
+    free(buf);
+    close(old_fd);
+    return 0;
+fail:
+    free(buf);
+    unmap_disk();
+    close(disk_fd);
+    unlink(tmp_name);
+    disk_fd = old_fd;
+    return -1;
+}
+
+// Read the file table of a version 0 (no superblock) image
+static int read_legacy_table(struct OldFile **out, int *count) {
+    unsigned char meta_buf[LEGACY_META_SIZE];
+    if (disk_read_at(meta_buf, sizeof(meta_buf), 0) != (ssize_t)sizeof(meta_buf)) return -1;
+    memcpy(count, meta_buf, sizeof(int));
+    if (*count < 0 || *count > LEGACY_MAX_FILES) return -1;
+    struct LegacyFileEntry entries[LEGACY_MAX_FILES];
+    memcpy(entries, meta_buf + sizeof(int), sizeof(entries));
+    *out = calloc(LEGACY_MAX_FILES, sizeof(struct OldFile));
+    if (!*out) return -1;
+    for (int i = 0; i < *count; ++i) {
+        memcpy((*out)[i].name, entries[i].name, MAX_FILENAME_LEN);
+        (*out)[i].size = entries[i].size;
+        (*out)[i].start = entries[i].start;
+        memcpy((*out)[i].created, entries[i].created, sizeof((*out)[i].created));
+    }
+    return 0;
+}
+
+// Read the file table of a version 1 (byte-range) image
+static int read_v1_table(const struct V1SuperBlock *sb, struct OldFile **out, int *count) {
+    if (sb->entry_size != sizeof(struct V1FileEntry) || sb->file_count > sb->max_files) return -1;
+    *count = sb->file_count;
+    *out = calloc(sb->file_count ? sb->file_count : 1, sizeof(struct OldFile));
+    if (!*out) return -1;
+    for (int i = 0; i < *count; ++i) {
+        struct V1FileEntry e;
+        if (disk_read_at(&e, sizeof(e), SUPERBLOCK_SIZE + (off_t)i * sizeof(e)) != (ssize_t)sizeof(e)) return -1;
+        memcpy((*out)[i].name, e.name, MAX_FILENAME_LEN);
+        (*out)[i].size = e.size;
+        (*out)[i].start = e.start;
+        memcpy((*out)[i].created, e.created, sizeof(e.created));
+    }
+    return 0;
+}
+
+// Mount whatever image disk_fd holds: format an empty file, convert an
+// old-layout image, or validate and load the superblock and tables.
+// Returns an FsError code.
+static int mount_image() {
+    journal_close();
+    unmap_disk();
+    struct stat st;
+    if (fstat(disk_fd, &st) < 0) return FS_ERR_IO;
+    if (st.st_size == 0) {
+        struct FsGeometry g = { 0, 0, 0, 0, 0 };
+        if (format_image(&g) < 0) return FS_ERR_IO;
+        return journal_open(fs.sb.journal_seq) < 0 ? FS_ERR_NO_MEMORY : FS_OK;
+    }
+    struct SuperBlock sb;
+    memset(&sb, 0, sizeof(sb));
+    disk_read_at(&sb, sizeof(sb), 0);
+    if (sb.magic != FS_MAGIC || sb.version < BLOCK_LAYOUT_VERSION) {
+        // Older layouts: collect the file table, then rebuild the image
+        struct OldFile *old = NULL;
+        int count = 0;
+        int rc;
+        uint32_t max_files = LEGACY_MAX_FILES;
+        if (sb.magic == FS_MAGIC && sb.version == 1) {
+            struct V1SuperBlock v1;
+            memcpy(&v1, &sb, sizeof(v1));
+            rc = read_v1_table(&v1, &old, &count);
+            max_files = v1.max_files;
+        } else if (st.st_size == LEGACY_DISK_SIZE) {
+            rc = read_legacy_table(&old, &count);
+        } else {
+            return FS_ERR_CORRUPT;  // no superblock and not a version 0 image
+        }
+        if (rc < 0) {
+            free(old);
+            return FS_ERR_CORRUPT;
+        }
+        if (migrate_image(old, count, max_files) < 0) {
+            free(old);
+            return FS_ERR_IO;
+        }
+        free(old);
+        disk_read_at(&sb, sizeof(sb), 0);
+        fstat(disk_fd, &st);
+    }
+    // Unsupported or damaged superblock, or an image cut short
+    if (!superblock_valid(&sb) || (uint64_t)st.st_size != sb.disk_size) return FS_ERR_CORRUPT;
+    fs.sb = sb;
+    if (map_disk() < 0) return FS_ERR_IO;
+    // Operations whose records made it to the journal are redone
+    uint64_t seq = sb.journal_seq;
+    if (sb.journal_size && journal_recover(&seq) < 0) return FS_ERR_IO;
+    if (load_metadata() < 0) return FS_ERR_CORRUPT;
+    if (fs.sb.version < FS_VERSION) {
+        // Same layout; older versions gain the checksum table, then the
+        // journal, at the end, and start with every file plain
+        if (fs.sb.crc_offset == 0 && crc_attach() < 0) return FS_ERR_IO;
+        if (fs.sb.journal_size == 0 && journal_attach() < 0) return FS_ERR_IO;
+        if (fs.sb.version < COMPRESS_VERSION) {
+            // The flags word was padding
+            for (int i = 0; i < MAX_FILES; ++i) {
+                fs.files[i].flags = 0;
+                mark_entry_dirty(i);
+            }
+            if (index_rebuild() < 0) return FS_ERR_NO_MEMORY;
+        }
+        if (fs.sb.version < DIRECTORY_VERSION) upgrade_names();
+        fs.sb.version = FS_VERSION;
+        mark_meta_dirty(0, sizeof(struct SuperBlock));
+        if (save_metadata() < 0 || sync_disk() < 0) return FS_ERR_IO;
+        seq = fs.sb.journal_seq;
+    }
+    dedup_hits = 0;
+    dedup_rebuild();  // without memory for the index, writes are just not deduplicated
+    return journal_open(seq) < 0 ? FS_ERR_NO_MEMORY : FS_OK;
+}
+
+// Initialize the file system with the default (fd) backend
+int fs_init() {
+    return fs_init_io(IO_FD);
+}
+
+// Initialize the file system (open or create disk file, load or format)
+// using the given disk access backend
+int fs_init_io(enum IoMode mode) {
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    io_mode = mode;
+    // Without io_uring support the synchronous fd backend takes over
+    if (mode == IO_URING && uring_open(URING_DEPTH) < 0) io_mode = IO_FD;
+    disk_fd = open(DISK_NAME, O_RDWR | O_CREAT, 0666);
+    if (disk_fd < 0) {
+        uring_close();
+        return FS_ERR_IO;
+    }
+    int rc = mount_image();
+    if (rc < 0) {
+        uring_close();
+        close(disk_fd);
+        disk_fd = -1;
+        return rc;
+    }
+    cbt_load();
+    // Open log file for appending; without it the file system still works,
+    // operations are just not recorded
+    oplog_open(log_format == LOG_BINARY ? LOG_BINARY_NAME : LOG_NAME, log_format, log_background);
+    return FS_OK;
+}
+
+// Flush pending metadata, sync, and close disk and log file descriptors
+int fs_close() {
+    if (disk_fd >= 0) {
+        // Checkpointed, the image needs no replay at the next mount
+        save_metadata();
+        if (journal_checkpoint() == 0) pending_settle(false);
+        sync_disk();
+        journal_close();
+        cbt_save();
+        unmap_disk();
+        cache_configure(0, 0, 0);
+        uring_close();
+        close(disk_fd);
+        disk_fd = -1;
+    }
+    oplog_close();
+    return 0;
+}
+
+// Format the disk (reset filesystem) keeping the current geometry
+int fs_format() {
+    struct FsGeometry g = { fs.sb.disk_size, fs.sb.max_files, fs.sb.block_size, fs.sb.max_extents,
+                            (uint32_t)fs.sb.journal_size };
+    return fs_format_geometry(&g);
+}
+
+// Format the disk with a new geometry (image size, entry and extent table
+// capacity, block size); zero fields take the defaults
+static int fs_format_geometry_locked(const struct FsGeometry *geometry) {
+    struct FsGeometry g = *geometry;
+    if (resolve_geometry(&g) < 0) {
+        return fail("fs_format", NULL, FS_ERR_INVALID);
+    }
+    if (format_image(&g) < 0 || journal_open(fs.sb.journal_seq) < 0) {
+        return fail("fs_format", NULL, FS_ERR_IO);
+    }
+    backup_base = 0;  // earlier backups no longer describe this image
+    cbt_mark_open();
+    log_operation("fs_format", NULL, 0);
+    return 0;
+}
+
+int fs_format_geometry(const struct FsGeometry *geometry) {
+    lock_all_files(true);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_format_geometry_locked(geometry);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+// Report the geometry of the mounted image
+int fs_geometry(struct FsGeometry *geometry) {
+    if (!geometry) return FS_ERR_INVALID;
+    pthread_rwlock_rdlock(&meta_lock);
+    geometry->disk_size = fs.sb.disk_size;
+    geometry->max_files = fs.sb.max_files;
+    geometry->block_size = fs.sb.block_size;
+    geometry->max_extents = fs.sb.max_extents;
+    geometry->journal_size = (uint32_t)fs.sb.journal_size;
+    pthread_rwlock_unlock(&meta_lock);
+    return FS_OK;
+}
+
+// Stamp an entry's creation date-time with the current local time
+static void set_created(char created[20]) {
+    time_t now = time(NULL);
+    struct tm *tm_info = localtime(&now);
+    strftime(created, 20, "%Y-%m-%d %H:%M:%S", tm_info);
+}
+
+// Add an empty file, or directory, at path
+static int create_entry(const char *op, const char *path, bool directory) {
+    uint32_t dir;
+    char leaf[MAX_FILENAME_LEN];
+    int idx;
+    int rc = path_walk(path, &dir, leaf, &idx);
+    if (rc < 0) {
+        return fail(op, path, rc);
+    }
+    if (idx != -1) {
+        return fail(op, path, FS_ERR_EXISTS);
+    }
+    if (fs.file_count >= SNAPSHOT_BASE) {
+        return fail(op, path, FS_ERR_TABLE_FULL);
+    }
+    if (!dir_get(dir) || btree_reserve(&dirs[dir].tree) < 0) {
+        return fail(op, path, FS_ERR_NO_MEMORY);
+    }
+    // Prepare new file entry
+    struct FileEntry new_file;
+    memset(&new_file, 0, sizeof(new_file));
+    strcpy(new_file.name, leaf);
+    new_file.size = 0;
+    new_file.first_extent = EXTENT_NONE;  // no data allocated yet
+    new_file.flags = dir << FILE_PARENT_SHIFT;
+    set_created(new_file.created);
+    uint32_t id = 0;
+    if (directory) {
+        rc = dir_alloc(fs.file_count, &id);
+        if (rc < 0) {
+            return fail(op, path, rc);
+        }
+        new_file.flags |= FILE_DIRECTORY;
+        new_file.size = id;
+    }
+    // Add to metadata
+    fs.files[fs.file_count] = new_file;
+    index_insert(fs.file_count);
+    mark_entry_dirty(fs.file_count);
+    fs.file_count++;
+    mark_count_dirty();
+    if (save_metadata() < 0) {
+        fs.file_count--;
+        index_remove(fs.file_count);
+        if (directory) dir_release(id);
+        return fail(op, path, FS_ERR_IO);
+    }
+    log_operation(op, path, 0);
+    return 0;
+}
+
+// Create a new file (empty)
+static int fs_create_locked(const char *filename) {
+    return create_entry("fs_create", filename, false);
+}
+
+int fs_create(const char *filename) {
+    lock_names(filename, true, NULL, false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_create_locked(filename);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(filename, NULL);
+    return rc;
+}
+
+// Drop live entry idx, moving the last entry into its slot
+static void remove_entry(int idx) {
+    int last = fs.file_count - 1;
+    index_remove(idx);
+    if (idx != last) {
+        index_relocate(last, idx);
+        fs.files[idx] = fs.files[last];
+        if (defrag.idx == last) defrag.idx = idx;
+    }
+    memset(&fs.files[last], 0, sizeof(fs.files[last]));
+    mark_entry_dirty(idx);
+    mark_entry_dirty(last);
+    fs.file_count--;
+    mark_count_dirty();
+}
+
+// Delete a file
+static int fs_delete_locked(const char *filename) {
+    int idx = find_entry(filename);
+    if (idx == -1) {
+        return fail("fs_delete", filename, FS_ERR_NOT_FOUND);
+    }
+    if (is_dir(&fs.files[idx])) {
+        return fail("fs_delete", filename, FS_ERR_IS_DIR);
+    }
+    file_shrink(idx, 0);
+    remove_entry(idx);
+    if (save_metadata() < 0) {
+        return fail("fs_delete", filename, FS_ERR_IO);
+    }
+    log_operation("fs_delete", filename, 0);
+    return 0;
+}
+
+int fs_delete(const char *filename) {
+    lock_names(filename, true, NULL, false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_delete_locked(filename);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(filename, NULL);
+    return rc;
+}
+
+// Create a directory (empty)
+int fs_mkdir(const char *path) {
+    lock_names(path, true, NULL, false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = create_entry("fs_mkdir", path, true);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(path, NULL);
+    return rc;
+}
+
+// Remove an empty directory
+static int fs_rmdir_locked(const char *path) {
+    int idx = find_entry(path);
+    if (idx == -1) {
+        return fail("fs_rmdir", path, FS_ERR_NOT_FOUND);
+    }
+    if (!is_dir(&fs.files[idx])) {
+        return fail("fs_rmdir", path, FS_ERR_NOT_DIR);
+    }
+    uint32_t id = dir_id(&fs.files[idx]);
+    if (dirs[id].tree.count > 0) {
+        return fail("fs_rmdir", path, FS_ERR_NOT_EMPTY);
+    }
+    dir_release(id);
+    remove_entry(idx);
+    if (save_metadata() < 0) {
+        return fail("fs_rmdir", path, FS_ERR_IO);
+    }
+    log_operation("fs_rmdir", path, 0);
+    return 0;
+}
+
+int fs_rmdir(const char *path) {
+    lock_names(path, true, NULL, false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_rmdir_locked(path);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(path, NULL);
+    return rc;
+}
+
+// Write data to a file (overwrite from beginning)
+int fs_write(const char *filename, const char *data, int64_t size) {
+    if (!filename || !data || size < 0) {
+        return fail("fs_write", filename, FS_ERR_INVALID);
+    }
+    lock_names(filename, true, NULL, false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int idx = find_file_index(filename);
+    if (idx == -1) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        return fail("fs_write", filename, FS_ERR_NOT_FOUND);
+    }
+    struct FileEntry *file = &fs.files[idx];
+    if (size == 0) {
+        // Truncate file to 0
+        file_shrink(idx, 0);
+        file->size = 0;
+        mark_entry_dirty(idx);
+        save_metadata();
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        log_operation("fs_write", filename, 0);
+        return 0;
+    }
+    if (file->flags & FILE_COMPRESSED) {
+        pthread_rwlock_unlock(&meta_lock);
+        int rc = packed_update(filename, 0, data, size, true, false);
+        unlock_names(filename, NULL);
+        if (rc < 0) {
+            return fail("fs_write", filename, rc);
+        }
+        log_operation("fs_write", filename, 0);
+        return 0;
+    }
+    // Existing blocks are overwritten in place, unless shared with a copy;
+    // only the difference in block count is allocated or released. Blocks
+    // past the new end go only once the data is in, so a write that fails
+    // leaves the file as it was. Blocks already stored elsewhere are mapped,
+    // not written, when deduplicating.
+    defrag_cancel(idx);
+    struct FileMap map;
+    unsigned char *skip = dedup_index ? calloc(range_blocks(0, size), 1) : NULL;
+    int64_t reserve = size > file->size ? size : file->size;
+    int err = file_reserve(idx, reserve) < 0 || file_unshare(idx, 0, size) < 0 ? FS_ERR_NO_SPACE
+              : map_snapshot(idx, &map) < 0 ? FS_ERR_NO_MEMORY : FS_OK;
+    if (err < 0) {
+        file_reserve(idx, file->size);
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        free(skip);
+        return fail("fs_write", filename, err);
+    }
+    // Last, as it cannot be undone; the map stays right for the blocks
+    // written, as only the blocks it skips are remapped
+    if (skip) file_dedup(idx, 0, size, data, skip);
+    pthread_rwlock_unlock(&meta_lock);
+    // The copy and its checksums need only this file's lock, so writes to
+    // other files run alongside
+    int rc = 0;
+    for (int64_t k = 0, lo, hi; rc == 0 && next_unskipped(0, size, skip, &k, &lo, &hi);) {
+        rc = map_write_at(&map, lo, data + lo, hi - lo);
+    }
+    free(skip);
+    uint32_t *crcs = rc < 0 ? NULL : map_crcs(&map, 0, size, data);
+    free(map.extents);
+    pthread_rwlock_wrlock(&meta_lock);
+    idx = find_file_index(filename);  // the entry may have moved to another slot
+    file = &fs.files[idx];
+    defrag_cancel(idx);
+    if (!crcs || file_store_crcs(idx, 0, size, crcs, false) < 0) rc = -1;
+    free(crcs);
+    if (rc < 0) {
+        file_reserve(idx, file->size);
+        save_metadata();
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        return fail("fs_write", filename, FS_ERR_IO);
+    }
+    file_reserve(idx, size);
+    file->size = size;
+    mark_entry_dirty(idx);
+    rc = save_metadata();
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(filename, NULL);
+    if (rc < 0) {
+        return fail("fs_write", filename, FS_ERR_IO);
+    }
+    log_operation("fs_write", filename, 0);
+    return 0;
+}
+
+// Append data to end of file
+int fs_append(const char *filename, const char *data, int64_t size) {
+    if (!filename || !data || size <= 0) {
+        return fail("fs_append", filename, FS_ERR_INVALID);
+    }
+    lock_names(filename, true, NULL, false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int idx = find_file_index(filename);
+    if (idx == -1) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        return fail("fs_append", filename, FS_ERR_NOT_FOUND);
+    }
+    struct FileEntry *file = &fs.files[idx];
+    int64_t old_size = file->size;
+    int64_t new_size = old_size + size;
+    if (file->flags & FILE_COMPRESSED) {
+        // The last unit is packed again with the new bytes
+        pthread_rwlock_unlock(&meta_lock);
+        int rc = packed_update(filename, old_size, data, size, true, false);
+        unlock_names(filename, NULL);
+        if (rc < 0) {
+            return fail("fs_append", filename, rc);
+        }
+        log_operation("fs_append", filename, 0);
+        return 0;
+    }
+    // The tail block may have room; further blocks need not follow it
+    defrag_cancel(idx);
+    struct FileMap map;
+    unsigned char *skip = dedup_index ? calloc(range_blocks(old_size, size), 1) : NULL;
+    int err = file_reserve(idx, new_size) < 0 || file_unshare(idx, old_size, size) < 0 ? FS_ERR_NO_SPACE
+              : map_snapshot(idx, &map) < 0 ? FS_ERR_NO_MEMORY : FS_OK;
+    if (err < 0) {
+        file_reserve(idx, old_size);
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        free(skip);
+        return fail("fs_append", filename, err);
+    }
+    if (skip) file_dedup(idx, old_size, size, data, skip);  // last, as in fs_write
+    pthread_rwlock_unlock(&meta_lock);
+    int rc = 0;
+    for (int64_t k = 0, lo, hi; rc == 0 && next_unskipped(old_size, size, skip, &k, &lo, &hi);) {
+        rc = map_write_at(&map, lo, data + (lo - old_size), hi - lo);
+    }
+    free(skip);
+    uint32_t *crcs = rc < 0 ? NULL : map_crcs(&map, old_size, size, data);
+    free(map.extents);
+    pthread_rwlock_wrlock(&meta_lock);
+    idx = find_file_index(filename);
+    file = &fs.files[idx];
+    defrag_cancel(idx);
+    if (!crcs || file_store_crcs(idx, old_size, size, crcs, false) < 0) rc = -1;
+    free(crcs);
+    if (rc < 0) {
+        file_reserve(idx, old_size);
+        save_metadata();
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        return fail("fs_append", filename, FS_ERR_IO);
+    }
+    file->size = new_size;
+    mark_entry_dirty(idx);
+    save_metadata();
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(filename, NULL);
+    log_operation("fs_append", filename, 0);
+    return 0;
+}
+
+// Read up to size bytes at offset of entry idx (a live file or a
+// snapshot's); returns the bytes read or an FsError code
+static int64_t entry_read(int idx, int64_t offset, int64_t size, char *buffer) {
+    struct FileEntry *file = &fs.files[idx];
+    if (offset >= file->size) {
+        return FS_ERR_RANGE;
+    }
+    if (offset + size > file->size) {
+        size = file->size - offset;
+    }
+    if (size <= 0) {
+        return 0;
+    }
+    if (file->flags & FILE_COMPRESSED) {
+        int rc = packed_read(idx, offset, size, buffer, verify_reads);
+        return rc < 0 ? rc : size;
+    }
+    if (file_read_at(idx, offset, buffer, size) < 0) {
+        return FS_ERR_IO;
+    }
+    if (verify_reads) {
+        int64_t bad = file_verify(idx, offset, size, buffer);
+        if (bad != 0) return bad < 0 ? FS_ERR_IO : FS_ERR_CORRUPT;
+    }
+    return size;
+}
+
+static int64_t fs_read_locked(const char *filename, int64_t offset, int64_t size, char *buffer) {
+    if (!filename || !buffer || size < 0 || offset < 0) {
+        return fail("fs_read", filename, FS_ERR_INVALID);
+    }
+    int idx = find_file_index(filename);
+    if (idx == -1) {
+        return fail("fs_read", filename, FS_ERR_NOT_FOUND);
+    }
+    int64_t rc = entry_read(idx, offset, size, buffer);
+    if (rc < 0) {
+        return fail("fs_read", filename, (int)rc);
+    }
+    log_operation("fs_read", filename, 0);
+    return rc;
+}
+
+int64_t fs_read(const char *filename, int64_t offset, int64_t size, char *buffer) {
+    lock_names(filename, false, NULL, false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int64_t rc = fs_read_locked(filename, offset, size, buffer);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(filename, NULL);
+    return rc;
+}
+
+// Describe entry f; the size of a directory, its entry count, is left to the caller
+static void fill_info(const struct FileEntry *f, struct FsFileInfo *info) {
+    memcpy(info->name, f->name, MAX_FILENAME_LEN);
+    info->size = is_dir(f) ? 0 : f->size;
+    memcpy(info->created, f->created, sizeof(info->created));
+    info->extent_count = f->extent_count;
+    info->stored = file_blocks(f) * BLOCK_SIZE;
+    info->compressed = (f->flags & FILE_COMPRESSED) != 0;
+    info->directory = is_dir(f);
+}
+
+// Describe live entry idx
+static void live_info(int idx, struct FsFileInfo *info) {
+    fill_info(&fs.files[idx], info);
+    struct Directory *d = info->directory ? dir_get(dir_id(&fs.files[idx])) : NULL;
+    if (d) info->size = d->tree.count;
+}
+
+// Describe entries of directory id past name after, in name order, into
+// up to max entries of infos; returns how many
+static int list_dir(uint32_t id, const char *after, struct FsFileInfo *infos, int max) {
+    struct Directory *d = dir_get(id);
+    if (!d) return 0;
+    if (max > d->tree.count) max = (int)d->tree.count;
+    if (max == 0) return 0;
+    int *slots = malloc((size_t)max * sizeof(int));
+    if (!slots) return FS_ERR_NO_MEMORY;
+    int n = btree_scan(&d->tree, after, slots, max);
+    for (int i = 0; i < n; ++i) {
+        live_info(slots[i], &infos[i]);
+    }
+    free(slots);
+    return n;
+}
+
+// Describe one file or directory
+int fs_stat(const char *filename, struct FsFileInfo *info) {
+    if (!filename || !info) return FS_ERR_INVALID;
+    pthread_rwlock_rdlock(&meta_lock);
+    int idx = find_entry(filename);
+    if (idx != -1) live_info(idx, info);
+    pthread_rwlock_unlock(&meta_lock);
+    return idx == -1 ? FS_ERR_NOT_FOUND : FS_OK;
+}
+
+// List the root directory: fill up to max entries of files, in name order,
+// and return how many entries it has (call with max = 0 to size the array)
+int fs_list(struct FsFileInfo *files, int max) {
+    if (max < 0 || (max > 0 && !files)) return FS_ERR_INVALID;
+    pthread_rwlock_rdlock(&meta_lock);
+    int count = dir_get(0) ? (int)dirs[0].tree.count : 0;
+    int rc = list_dir(0, NULL, files, max);
+    pthread_rwlock_unlock(&meta_lock);
+    if (rc < 0) {
+        return fail("fs_ls", NULL, rc);
+    }
+    if (max > 0) log_operation("fs_ls", NULL, 0);
+    return count;
+}
+
+// List directory path ("" or "/" for the root): fill up to max entries of
+// entries, in name order, starting past the entry named after (NULL: from
+// the first), and return how many were filled. Passing the last name
+// filled as after gets the next page, in O(log n) however large the
+// directory.
+int fs_listdir(const char *path, const char *after, struct FsFileInfo *entries, int max) {
+    if (max < 0 || (max > 0 && !entries)) {
+        return fail("fs_listdir", path, FS_ERR_INVALID);
+    }
+    pthread_rwlock_rdlock(&meta_lock);
+    uint32_t id;
+    int rc = find_dir(path, &id);
+    if (rc == FS_OK) rc = list_dir(id, after, entries, max);
+    pthread_rwlock_unlock(&meta_lock);
+    if (rc < 0) {
+        return fail("fs_listdir", path, rc);
+    }
+    log_operation("fs_listdir", path, 0);
+    return rc;
+}
+
+// Whether directory id is dir or lies somewhere under it
+static bool dir_within(uint32_t id, uint32_t dir) {
+    for (int steps = 0; steps <= fs.file_count; ++steps) {
+        if (id == dir) return true;
+        struct Directory *d = dir_get(id);
+        if (!d || d->entry < 0) return false;
+        id = FILE_PARENT(&fs.files[d->entry]);
+    }
+    return false;
+}
+
+// Rename a file or directory, into another directory too. What is under a
+// directory names it by id, so moving it changes its own entry only.
+static int fs_rename_locked(const char *oldname, const char *newname) {
+    if (!oldname || !newname) {
+        return fail("fs_rename", oldname, FS_ERR_INVALID);
+    }
+    int idx = find_entry(oldname);
+    if (idx == -1) {
+        return fail("fs_rename", oldname, FS_ERR_NOT_FOUND);
+    }
+    uint32_t dir;
+    char leaf[MAX_FILENAME_LEN];
+    int taken;
+    int rc = path_walk(newname, &dir, leaf, &taken);
+    if (rc < 0) {
+        return fail("fs_rename", oldname, rc);
+    }
+    if (taken != -1) {
+        return fail("fs_rename", oldname, FS_ERR_EXISTS);
+    }
+    struct FileEntry *f = &fs.files[idx];
+    if (is_dir(f) && dir_within(dir, dir_id(f))) {
+        return fail("fs_rename", oldname, FS_ERR_INVALID);  // into itself
+    }
+    if (btree_reserve(&dirs[dir].tree) < 0) {
+        return fail("fs_rename", oldname, FS_ERR_NO_MEMORY);
+    }
+    index_remove(idx);
+    strcpy(f->name, leaf);
+    f->flags = (f->flags & FILE_FLAG_BITS) | dir << FILE_PARENT_SHIFT;
+    index_insert(idx);
+    mark_entry_dirty(idx);
+    if (save_metadata() < 0) {
+        return fail("fs_rename", oldname, FS_ERR_IO);
+    }
+    log_operation("fs_rename", oldname, 0);
+    return 0;
+}
+
+// A file is renamed under the stripes of its two paths, a directory under
+// every stripe: the paths of everything below it change too
+int fs_rename(const char *oldname, const char *newname) {
+    for (;;) {
+        pthread_rwlock_rdlock(&meta_lock);
+        int idx = find_entry(oldname);
+        bool dir = idx != -1 && is_dir(&fs.files[idx]);
+        pthread_rwlock_unlock(&meta_lock);
+        if (dir) lock_all_files(true);
+        else lock_names(oldname, true, newname, true);
+        pthread_rwlock_wrlock(&meta_lock);
+        idx = find_entry(oldname);
+        // Replaced by the other kind in between: lock again
+        bool changed = idx != -1 && is_dir(&fs.files[idx]) != dir;
+        int rc = changed ? FS_OK : fs_rename_locked(oldname, newname);
+        pthread_rwlock_unlock(&meta_lock);
+        if (dir) unlock_all_files();
+        else unlock_names(oldname, newname);
+        if (!changed) return rc;
+    }
+}
+
+// Check if file exists
+static bool fs_exists_locked(const char *filename) {
+    bool exists = (find_entry(filename) != -1);
+    log_operation("fs_exists", filename, exists ? 0 : -1);
+    return exists;
+}
+
+bool fs_exists(const char *filename) {
+    pthread_rwlock_rdlock(&meta_lock);
+    bool rc = fs_exists_locked(filename);
+    pthread_rwlock_unlock(&meta_lock);
+    return rc;
+}
+
+// Get size of a file
+static int64_t fs_size_locked(const char *filename) {
+    int idx = find_file_index(filename);
+    if (idx == -1) {
+        return fail("fs_size", filename, FS_ERR_NOT_FOUND);
+    }
+    log_operation("fs_size", filename, 0);
+    return fs.files[idx].size;
+}
+
+int64_t fs_size(const char *filename) {
+    pthread_rwlock_rdlock(&meta_lock);
+    int64_t rc = fs_size_locked(filename);
+    pthread_rwlock_unlock(&meta_lock);
+    return rc;
+}
+
+// Truncate a file to a smaller size
+static int fs_truncate_locked(const char *filename, int64_t new_size) {
+    if (new_size < 0) {
+        return fail("fs_truncate", filename, FS_ERR_INVALID);
+    }
+    int idx = find_file_index(filename);
+    if (idx == -1) {
+        return fail("fs_truncate", filename, FS_ERR_NOT_FOUND);
+    }
+    struct FileEntry *file = &fs.files[idx];
+    if (new_size > file->size) {
+        return fail("fs_truncate", filename, FS_ERR_RANGE);
+    }
+    if (new_size == file->size) {
+        log_operation("fs_truncate", filename, 0);
+        return 0;
+    }
+    if (file->flags & FILE_COMPRESSED) {
+        // The unit the file now ends in is packed again, to its new length
+        int rc = packed_update(filename, new_size, NULL, 0, true, true);
+        if (rc < 0) {
+            return fail("fs_truncate", filename, rc);
+        }
+        log_operation("fs_truncate", filename, 0);
+        return 0;
+    }
+    // Blocks past the new end go back to free space
+    file_shrink(idx, blocks_for(new_size));
+    if (new_size == 0) {
+        file->size = 0;
+        mark_entry_dirty(idx);
+        save_metadata();
+        log_operation("fs_truncate", filename, 0);
+        return 0;
+    }
+    file->size = new_size;
+    mark_entry_dirty(idx);
+    if (save_metadata() < 0) {
+        return fail("fs_truncate", filename, FS_ERR_IO);
+    }
+    log_operation("fs_truncate", filename, 0);
+    return 0;
+}
+
+int fs_truncate(const char *filename, int64_t new_size) {
+    lock_names(filename, true, NULL, false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_truncate_locked(filename, new_size);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(filename, NULL);
+    return rc;
+}
+
+// Copy a file to a new file
+int fs_copy(const char *src_filename, const char *dest_filename) {
+    if (!src_filename || !dest_filename) {
+        return fail("fs_copy", src_filename, FS_ERR_INVALID);
+    }
+    lock_names(src_filename, false, dest_filename, true);
+    pthread_rwlock_wrlock(&meta_lock);
+    int src_idx = find_file_index(src_filename);
+    if (src_idx == -1) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(src_filename, dest_filename);
+        return fail("fs_copy", src_filename, FS_ERR_NOT_FOUND);
+    }
+    if (find_file_index(dest_filename) != -1) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(src_filename, dest_filename);
+        return fail("fs_copy", src_filename, FS_ERR_EXISTS);
+    }
+    // Create destination file
+    int rc = fs_create_locked(dest_filename);
+    if (rc < 0) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(src_filename, dest_filename);
+        return fail("fs_copy", src_filename, rc);
+    }
+    int dest_idx = find_file_index(dest_filename);
+    int64_t size = fs.files[src_idx].size;
+    fs.files[dest_idx].flags |= fs.files[src_idx].flags & FILE_COMPRESSED;  // the blocks keep their layout
+    if (size == 0) {
+        // Source is empty, nothing to copy
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(src_filename, dest_filename);
+        log_operation("fs_copy", src_filename, 0);
+        return 0;
+    }
+    // The copy maps the source's blocks; either side gets private blocks
+    // only when it writes them (see file_unshare)
+    defrag_cancel(src_idx);
+    if (file_share(src_idx, dest_idx) < 0) {
+        fs_delete_locked(dest_filename);
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(src_filename, dest_filename);
+        return fail("fs_copy", src_filename, FS_ERR_NO_SPACE);
+    }
+    fs.files[dest_idx].size = size;
+    mark_entry_dirty(dest_idx);
+    rc = save_metadata();
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(src_filename, dest_filename);
+    if (rc < 0) {
+        return fail("fs_copy", src_filename, FS_ERR_IO);
+    }
+    log_operation("fs_copy", src_filename, 0);
+    return 0;
+}
+
+// Move (rename) a file or directory, to another directory too
+int fs_mv(const char *src_filename, const char *dest_filename) {
+    int result = fs_rename(src_filename, dest_filename);
+    // fs_rename already logs the result
+    return result;
+}
+
+// ---- snapshots ----
+//
+// A snapshot is a run of entries at the end of the entry table: a header
+// (FILE_SNAPSHOT, with the snapshot's name and creation time, and the
+// number of its files as size), then a copy of the entry of every file
+// live when it was taken (directories included, with their ids), each
+// with its own extent chain mapping the same blocks. Taking one copies
+// metadata only; a later write to a live file gets private blocks for
+// what it changes (file_unshare), as after fs_copy, and the snapshot
+// keeps the old ones. The newest snapshot starts at SNAPSHOT_BASE.
+
+// Header entry of the snapshot after the one whose header is entry h
+static int snapshot_next(int h) {
+    int64_t n = fs.files[h].size;
+    return n >= 0 && n < MAX_FILES - h ? h + 1 + (int)n : MAX_FILES;
+}
+
+// Header entry of snapshot name, or -1
+static int find_snapshot(const char *name) {
+    if (!name) return -1;
+    for (int h = SNAPSHOT_BASE; h < MAX_FILES; h = snapshot_next(h)) {
+        if (strcmp(fs.files[h].name, name) == 0) return h;
+    }
+    return -1;
+}
+
+// Entry name in directory dir of the snapshot whose header is entry h, or
+// -1. Snapshots keep no directory trees; they are searched through.
+static int find_snapshot_child(int h, uint32_t dir, const char *name) {
+    for (int i = h + 1; i <= h + fs.files[h].size; ++i) {
+        if (FILE_PARENT(&fs.files[i]) == dir && strcmp(fs.files[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Entry at path in the snapshot whose header is entry h, or -1; the root
+// ("" or "/") is -2
+static int find_snapshot_entry(int h, const char *path) {
+    if (!path || strlen(path) >= MAX_PATH_LEN) return -1;
+    path += strspn(path, "/");
+    if (*path == '\0') return -2;
+    uint32_t dir = 0;
+    for (;;) {
+        char name[MAX_FILENAME_LEN];
+        size_t len = strcspn(path, "/");
+        if (len == 0 || len >= MAX_FILENAME_LEN) return -1;
+        memcpy(name, path, len);
+        name[len] = '\0';
+        int i = find_snapshot_child(h, dir, name);
+        if (i == -1 || path[len] == '\0') return i;
+        if (!is_dir(&fs.files[i])) return -1;
+        dir = dir_id(&fs.files[i]);
+        path += len + 1;
+    }
+}
+
+// Extent records the chains of entries [first, end) take
+static int64_t entry_records(int first, int end) {
+    int64_t records = 0;
+    for (int i = first; i < end; ++i) {
+        records += fs.files[i].extent_count;
+    }
+    return records;
+}
+
+// Take a snapshot of every live file under name
+static int fs_snapshot_locked(const char *name) {
+    if (!name || strlen(name) == 0 || strlen(name) >= MAX_FILENAME_LEN) {
+        return fail("fs_snapshot", name, FS_ERR_INVALID);
+    }
+    if (find_snapshot(name) != -1) {
+        return fail("fs_snapshot", name, FS_ERR_EXISTS);
+    }
+    int n = fs.file_count;
+    if (n + 1 > SNAPSHOT_BASE - fs.file_count) {
+        return fail("fs_snapshot", name, FS_ERR_TABLE_FULL);
+    }
+    if (entry_records(0, n) > free_record_count) {
+        return fail("fs_snapshot", name, FS_ERR_NO_SPACE);
+    }
+    // A move in progress would not free the blocks the snapshot keeps
+    if (defrag.idx >= 0) defrag_cancel(defrag.idx);
+    int h = SNAPSHOT_BASE - 1 - n;
+    struct FileEntry *head = &fs.files[h];
+    memset(head, 0, sizeof(*head));
+    strcpy(head->name, name);
+    set_created(head->created);
+    head->size = n;
+    head->first_extent = EXTENT_NONE;
+    head->flags = FILE_SNAPSHOT;
+    mark_entry_dirty(h);
+    for (int i = 0; i < n; ++i) {
+        struct FileEntry *f = &fs.files[h + 1 + i];
+        *f = fs.files[i];
+        f->first_extent = EXTENT_NONE;
+        f->extent_count = 0;
+        file_share(i, h + 1 + i);  // the records were counted above
+    }
+    fs.sb.snapshot_entries += 1 + n;
+    mark_snapshots_dirty();
+    if (save_metadata() < 0) {
+        return fail("fs_snapshot", name, FS_ERR_IO);
+    }
+    log_operation("fs_snapshot", name, 0);
+    return 0;
+}
+
+// No write may be between reserving its blocks and filling them while the
+// snapshot takes them, so every file is locked
+int fs_snapshot(const char *name) {
+    lock_all_files(false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_snapshot_locked(name);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+// List the snapshots, oldest first: fill up to max entries of snapshots
+// and return how many there are
+int fs_snapshot_list(struct FsSnapshotInfo *snapshots, int max) {
+    if (max < 0 || (max > 0 && !snapshots)) return FS_ERR_INVALID;
+    pthread_rwlock_rdlock(&meta_lock);
+    int count = 0;
+    for (int h = SNAPSHOT_BASE; h < MAX_FILES; h = snapshot_next(h)) {
+        count++;
+    }
+    int k = count;
+    for (int h = SNAPSHOT_BASE; h < MAX_FILES; h = snapshot_next(h)) {
+        if (--k >= max) continue;
+        struct FsSnapshotInfo *info = &snapshots[k];
+        memcpy(info->name, fs.files[h].name, MAX_FILENAME_LEN);
+        memcpy(info->created, fs.files[h].created, sizeof(info->created));
+        info->files = 0;
+        info->size = 0;
+        for (int i = h + 1; i <= h + fs.files[h].size; ++i) {
+            if (is_dir(&fs.files[i])) continue;
+            info->files++;
+            info->size += fs.files[i].size;
+        }
+    }
+    pthread_rwlock_unlock(&meta_lock);
+    return count;
+}
+
+static int slot_name_cmp(const void *a, const void *b) {
+    return strcmp(fs.files[*(const int *)a].name, fs.files[*(const int *)b].name);
+}
+
+static int id_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Describe directory dir of the snapshot whose header is entry h into up
+// to max entries of files, in name order; returns its entry count
+static int snapshot_dir_list(int h, uint32_t dir, struct FsFileInfo *files, int max) {
+    int n = (int)fs.files[h].size, count = 0;
+    int *slots = malloc((n ? n : 1) * sizeof(int));
+    uint32_t *ids = malloc((n ? n : 1) * sizeof(uint32_t));
+    int64_t *sizes = calloc(n ? n : 1, sizeof(int64_t));
+    if (!slots || !ids || !sizes) {
+        free(slots);
+        free(ids);
+        free(sizes);
+        return FS_ERR_NO_MEMORY;
+    }
+    for (int i = h + 1; i <= h + n; ++i) {
+        if (FILE_PARENT(&fs.files[i]) == dir) slots[count++] = i;
+    }
+    qsort(slots, count, sizeof(int), slot_name_cmp);
+    if (max > count) max = count;
+    int listed = 0;
+    for (int i = 0; i < max; ++i) {
+        fill_info(&fs.files[slots[i]], &files[i]);
+        if (files[i].directory) ids[listed++] = dir_id(&fs.files[slots[i]]);
+    }
+    // The sizes of the directories listed, in one pass over the snapshot
+    qsort(ids, listed, sizeof(uint32_t), id_cmp);
+    for (int i = h + 1; i <= h + n && listed > 0; ++i) {
+        uint32_t parent = FILE_PARENT(&fs.files[i]);
+        uint32_t *at = bsearch(&parent, ids, listed, sizeof(uint32_t), id_cmp);
+        if (at) sizes[at - ids]++;
+    }
+    for (int i = 0; i < max; ++i) {
+        uint32_t id = dir_id(&fs.files[slots[i]]);
+        uint32_t *at = files[i].directory ? bsearch(&id, ids, listed, sizeof(uint32_t), id_cmp) : NULL;
+        if (at) files[i].size = sizes[at - ids];
+    }
+    free(slots);
+    free(ids);
+    free(sizes);
+    return count;
+}
+
+// List directory path (NULL: the root) of snapshot name, as fs_list does
+// the live root
+int fs_snapshot_files(const char *name, const char *path, struct FsFileInfo *files, int max) {
+    if (max < 0 || (max > 0 && !files)) return FS_ERR_INVALID;
+    pthread_rwlock_rdlock(&meta_lock);
+    int h = find_snapshot(name);
+    int idx = h == -1 ? -1 : find_snapshot_entry(h, path ? path : "");
+    int count = h == -1 || idx == -1 ? FS_ERR_NOT_FOUND
+                : idx >= 0 && !is_dir(&fs.files[idx]) ? FS_ERR_NOT_DIR
+                : snapshot_dir_list(h, idx < 0 ? 0 : dir_id(&fs.files[idx]), files, max);
+    pthread_rwlock_unlock(&meta_lock);
+    return count;
+}
+
+// Read from file filename as snapshot name holds it. A snapshot's blocks
+// are never written (a live file sharing one writes a copy), so only its
+// deletion has to be kept out.
+int64_t fs_snapshot_read(const char *name, const char *filename, int64_t offset, int64_t size, char *buffer) {
+    if (!filename || !buffer || size < 0 || offset < 0) {
+        return fail("fs_snapshot_read", filename, FS_ERR_INVALID);
+    }
+    pthread_rwlock_rdlock(&meta_lock);
+    int h = find_snapshot(name);
+    int idx = h == -1 ? -1 : find_snapshot_entry(h, filename);
+    if (idx == -2 || (idx >= 0 && is_dir(&fs.files[idx]))) idx = -1;
+    int64_t rc = idx == -1 ? FS_ERR_NOT_FOUND : entry_read(idx, offset, size, buffer);
+    pthread_rwlock_unlock(&meta_lock);
+    if (rc < 0) {
+        return fail("fs_snapshot_read", filename, (int)rc);
+    }
+    log_operation("fs_snapshot_read", filename, 0);
+    return rc;
+}
+
+// Replace the live files with those of snapshot name; the snapshot stays
+static int fs_rollback_locked(const char *name) {
+    int h = find_snapshot(name);
+    if (h == -1) {
+        return fail("fs_rollback", name, FS_ERR_NOT_FOUND);
+    }
+    int n = (int)fs.files[h].size;
+    if (n > SNAPSHOT_BASE) {
+        return fail("fs_rollback", name, FS_ERR_TABLE_FULL);
+    }
+    // The live files' records come free before the snapshot's are copied
+    if (entry_records(h + 1, h + 1 + n) > free_record_count + entry_records(0, fs.file_count)) {
+        return fail("fs_rollback", name, FS_ERR_NO_SPACE);
+    }
+    for (int i = 0; i < fs.file_count; ++i) {
+        file_shrink(i, 0);  // blocks a snapshot maps stay
+        memset(&fs.files[i], 0, sizeof(fs.files[i]));
+        mark_entry_dirty(i);
+    }
+    for (int i = 0; i < n; ++i) {
+        fs.files[i] = fs.files[h + 1 + i];
+        fs.files[i].first_extent = EXTENT_NONE;
+        fs.files[i].extent_count = 0;
+        file_share(h + 1 + i, i);
+    }
+    fs.file_count = n;
+    mark_count_dirty();
+    if (save_metadata() < 0) {
+        index_rebuild();
+        return fail("fs_rollback", name, FS_ERR_IO);
+    }
+    if (index_rebuild() < 0) {
+        return fail("fs_rollback", name, FS_ERR_NO_MEMORY);
+    }
+    log_operation("fs_rollback", name, 0);
+    return 0;
+}
+
+int fs_rollback(const char *name) {
+    lock_all_files(true);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_rollback_locked(name);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+// Delete snapshot name; blocks no one else maps go back to free space
+static int fs_snapshot_delete_locked(const char *name) {
+    int h = find_snapshot(name);
+    if (h == -1) {
+        return fail("fs_snapshot_delete", name, FS_ERR_NOT_FOUND);
+    }
+    int n = (int)fs.files[h].size;
+    for (int i = h + 1; i <= h + n; ++i) {
+        file_shrink(i, 0);
+    }
+    // The newer snapshots move up over the gap
+    int base = SNAPSHOT_BASE, gap = 1 + n;
+    memmove(&fs.files[base + gap], &fs.files[base], (size_t)(h - base) * sizeof(struct FileEntry));
+    memset(&fs.files[base], 0, (size_t)gap * sizeof(struct FileEntry));
+    mark_meta_dirty(SUPERBLOCK_SIZE + (size_t)base * sizeof(struct FileEntry),
+                    (size_t)(h + gap - base) * sizeof(struct FileEntry));
+    fs.sb.snapshot_entries -= gap;
+    mark_snapshots_dirty();
+    if (save_metadata() < 0) {
+        return fail("fs_snapshot_delete", name, FS_ERR_IO);
+    }
+    log_operation("fs_snapshot_delete", name, 0);
+    return 0;
+}
+
+int fs_snapshot_delete(const char *name) {
+    lock_all_files(false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_snapshot_delete_locked(name);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+// ---- batched submission ----
+
+#define BATCH_IOV 1024  // iovecs per preadv/pwritev call
+
+// A piece of batch data I/O: len bytes at image offset off, to or from buf,
+// on behalf of operation op
+struct IoSeg {
+    int64_t off;
+    char *buf;
+    int64_t len;
+    int op;
+};
+
+// Data I/O queued by fs_submit. The queue holds either writes or reads;
+// its segments never overlap, since anything that could free, reuse or
+// rewrite queued blocks flushes it first.
+struct IoBatch {
+    struct IoSeg *segs;
+    size_t count;
+    size_t cap;
+    bool writing;
+    struct FsOp *ops;
+    int first;          // first operation queued since the last flush
+    int *file;          // per operation: file index with queued I/O, -1 if none
+    int64_t *old_size;  // per operation: size a failed write returns the file to
+    char *pending;      // per file: has queued writes
+    char *buf;          // span_queue: buffer of the operation being queued
+    int64_t base;       // file offset that buf[0] corresponds to
+    int op;
+};
+
+static int span_queue(int64_t disk_off, int64_t file_off, int64_t len, void *ctx) {
+    struct IoBatch *b = ctx;
+    if (b->count == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        struct IoSeg *segs = realloc(b->segs, cap * sizeof(*segs));
+        if (!segs) return -1;
+        b->segs = segs;
+        b->cap = cap;
+    }
+    struct IoSeg *s = &b->segs[b->count++];
+    s->off = disk_off;
+    s->buf = b->buf + (file_off - b->base);
+    s->len = len;
+    s->op = b->op;
+    return 0;
+}
+
+static int seg_cmp(const void *a, const void *b) {
+    int64_t x = ((const struct IoSeg *)a)->off;
+    int64_t y = ((const struct IoSeg *)b)->off;
+    return x < y ? -1 : x > y;
+}
+
+// End of the run of adjacent segments starting at segment i
+static size_t run_end(const struct IoBatch *b, size_t i) {
+    size_t j = i + 1;
+    while (j < b->count && j - i < BATCH_IOV && b->segs[j].off == b->segs[j - 1].off + b->segs[j - 1].len) j++;
+    return j;
+}
+
+static void run_failed(struct IoBatch *b, size_t i, size_t j) {
+    for (size_t k = i; k < j; ++k) {
+        b->ops[b->segs[k].op].result = FS_ERR_IO;
+    }
+}
+
+static void fill_iov(struct iovec *iov, const struct IoSeg *segs, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        iov[i].iov_base = segs[i].buf;
+        iov[i].iov_len = segs[i].len;
+    }
+}
+
+// Complete a run whose vectored transfer moved only done bytes, piece by piece
+static int run_finish(const struct IoSeg *segs, size_t n, bool writing, int64_t done) {
+    int64_t skip = done;
+    for (size_t i = 0; i < n; ++i) {
+        if (skip >= segs[i].len) {
+            skip -= segs[i].len;
+            continue;
+        }
+        int64_t len = segs[i].len - skip;
+        ssize_t r = writing ? disk_write_at(segs[i].buf + skip, len, segs[i].off + skip)
+                            : disk_read_at(segs[i].buf + skip, len, segs[i].off + skip);
+        if (r != len) return -1;
+        skip = 0;
+    }
+    return 0;
+}
+
+// Synchronous backends: one preadv/pwritev per run
+static void batch_io_sync(struct IoBatch *b) {
+    for (size_t i = 0, j; i < b->count; i = j) {
+        j = run_end(b, i);
+        int rc = 0;
+        if (disk_map) {
+            for (size_t k = i; k < j && rc == 0; ++k) {
+                ssize_t n = b->writing ? disk_write_at(b->segs[k].buf, b->segs[k].len, b->segs[k].off)
+                                       : disk_read_at(b->segs[k].buf, b->segs[k].len, b->segs[k].off);
+                if (n != b->segs[k].len) rc = -1;
+            }
+        } else {
+            // Around the cache: its copies are written back (and dropped
+            // before a write) so neither side sees stale data
+            for (size_t k = i; k < j && rc == 0; ++k) {
+                rc = cache_settle(disk_fd, b->segs[k].off, b->segs[k].len, b->writing);
+            }
+            if (rc == 0) {
+                struct iovec iov[BATCH_IOV];
+                fill_iov(iov, &b->segs[i], j - i);
+                ssize_t done = b->writing ? pwritev(disk_fd, iov, j - i, b->segs[i].off)
+                                          : preadv(disk_fd, iov, j - i, b->segs[i].off);
+                rc = done < 0 ? -1 : run_finish(&b->segs[i], j - i, b->writing, done);
+            }
+        }
+        if (rc < 0) run_failed(b, i, j);
+    }
+}
+
+static void run_done(void *ctx, int result) {
+    *(int *)ctx = result;
+}
+
+// io_uring backend: every run is queued before any is waited for, so the
+// whole batch is in flight at once
+static void batch_io_uring(struct IoBatch *b) {
+    struct iovec *iov = malloc(b->count * sizeof(*iov));
+    int *result = malloc(b->count * sizeof(int));  // per run, at its first segment
+    if (!iov || !result) {
+        free(iov);
+        free(result);
+        batch_io_sync(b);
+        return;
+    }
+    fill_iov(iov, b->segs, b->count);
+    for (size_t i = 0, j; i < b->count; i = j) {
+        j = run_end(b, i);
+        int rc = b->writing ? uring_queue_writev(disk_fd, &iov[i], j - i, b->segs[i].off, run_done, &result[i])
+                            : uring_queue_readv(disk_fd, &iov[i], j - i, b->segs[i].off, run_done, &result[i]);
+        if (rc < 0) result[i] = -EIO;
+    }
+    if (uring_drain() < 0) {
+        run_failed(b, 0, b->count);
+    } else {
+        for (size_t i = 0, j; i < b->count; i = j) {
+            j = run_end(b, i);
+            if (result[i] < 0 || run_finish(&b->segs[i], j - i, b->writing, result[i]) < 0) run_failed(b, i, j);
+        }
+    }
+    free(iov);
+    free(result);
+}
+
+// Carry out the queued I/O in image order, one vectored call per run of
+// adjacent segments, then log the queued operations. An operation whose
+// data could not be transferred fails; a failed write leaves its file at
+// the size it had before.
+static void batch_flush(struct IoBatch *b) {
+    if (b->count > 1) qsort(b->segs, b->count, sizeof(*b->segs), seg_cmp);
+    for (size_t i = 0; i < b->count && b->writing; ++i) {
+        mark_changed(b->segs[i].off, b->segs[i].len);
+    }
+    if (b->count > 0 && io_mode == IO_URING) {
+        batch_io_uring(b);
+    } else {
+        batch_io_sync(b);
+    }
+    for (int i = b->first; i <= b->op; ++i) {
+        struct FsOp *op = &b->ops[i];
+        int idx = b->file[i];
+        if (idx < 0) continue;
+        const char *what = op->type == FS_OP_READ ? "fs_read" : op->type == FS_OP_WRITE ? "fs_write" : "fs_append";
+        if (op->result >= 0 && op->type != FS_OP_READ &&
+            file_update_crcs(idx, op->type == FS_OP_APPEND ? b->old_size[i] : 0, op->size, op->data) < 0) {
+            op->result = FS_ERR_IO;
+        }
+        if (op->result < 0 && op->type != FS_OP_READ) {
+            file_reserve(idx, b->old_size[i]);
+            fs.files[idx].size = b->old_size[i];
+            mark_entry_dirty(idx);
+        } else if (op->type == FS_OP_WRITE) {
+            file_reserve(idx, fs.files[idx].size);
+        }
+        log_operation(what, op->name, op->result < 0 ? -1 : 0);
+        b->file[i] = -1;
+    }
+    b->count = 0;
+    b->first = b->op;
+    memset(b->pending, 0, MAX_FILES);
+}
+
+// Resize a file for a batched write or append and queue its data
+static int batch_write(struct IoBatch *b, int i) {
+    struct FsOp *op = &b->ops[i];
+    bool append = op->type == FS_OP_APPEND;
+    const char *what = append ? "fs_append" : "fs_write";
+    if (!op->data || op->size < 0 || (append && op->size == 0)) {
+        return fail(what, op->name, FS_ERR_INVALID);
+    }
+    int idx = find_file_index(op->name);
+    if (idx == -1) {
+        return fail(what, op->name, FS_ERR_NOT_FOUND);
+    }
+    struct FileEntry *file = &fs.files[idx];
+    int64_t old_size = file->size;
+    int64_t start = append ? old_size : 0;
+    if (file->flags & FILE_COMPRESSED) {
+        // Packed and written at once; the blocks it frees may be queued
+        if (b->count > 0) batch_flush(b);
+        int rc = packed_update(op->name, start, op->data, op->size, true, true);
+        if (rc < 0) {
+            return fail(what, op->name, rc);
+        }
+        log_operation(what, op->name, 0);
+        return FS_OK;
+    }
+    // Earlier queued writes of this file may cover the same blocks
+    if (b->count > 0 && (!b->writing || b->pending[idx])) batch_flush(b);
+    defrag_cancel(idx);
+    // As in fs_write, blocks past the new end stay until the data is in
+    if (file_reserve(idx, start + op->size > old_size ? start + op->size : old_size) < 0 ||
+        file_unshare(idx, start, op->size) < 0) {
+        file_reserve(idx, old_size);
+        return fail(what, op->name, FS_ERR_NO_SPACE);
+    }
+    unsigned char *skip = dedup_index ? calloc(range_blocks(start, op->size) + 1, 1) : NULL;
+    if (skip) file_dedup(idx, start, op->size, op->data, skip);
+    b->writing = true;
+    b->buf = (char *)op->data;
+    b->base = start;
+    b->op = i;
+    size_t mark = b->count;
+    int rc = 0;
+    for (int64_t k = 0, lo, hi; rc == 0 && next_unskipped(start, op->size, skip, &k, &lo, &hi);) {
+        rc = file_for_each_span(idx, lo, hi - lo, span_queue, b);
+    }
+    free(skip);
+    if (rc < 0) {
+        b->count = mark;
+        file_reserve(idx, old_size);
+        return fail(what, op->name, FS_ERR_NO_MEMORY);
+    }
+    file->size = start + op->size;
+    mark_entry_dirty(idx);
+    if (op->size == 0) {
+        file_reserve(idx, 0);
+        log_operation(what, op->name, 0);
+        return FS_OK;
+    }
+    b->file[i] = idx;
+    b->old_size[i] = old_size;
+    b->pending[idx] = 1;
+    return FS_OK;
+}
+
+// Check a batched read and queue it; returns the bytes it will deliver
+static int64_t batch_read(struct IoBatch *b, int i) {
+    struct FsOp *op = &b->ops[i];
+    if (!op->buffer || op->size < 0 || op->offset < 0) {
+        return fail("fs_read", op->name, FS_ERR_INVALID);
     }
-    write(log_fd, msg, strlen(msg));
+    int idx = find_file_index(op->name);
+    if (idx == -1) {
+        return fail("fs_read", op->name, FS_ERR_NOT_FOUND);
+    }
+    int64_t size = fs.files[idx].size;
+    if (op->offset >= size) {
+        return fail("fs_read", op->name, FS_ERR_RANGE);
+    }
+    if (op->size < size - op->offset) size = op->offset + op->size;
+    int64_t len = size - op->offset;
+    if (len == 0) {
+        log_operation("fs_read", op->name, 0);
+        return 0;
+    }
+    if (fs.files[idx].flags & FILE_COMPRESSED) {
+        // Decompressed at once rather than queued
+        int rc = packed_read(idx, op->offset, len, op->buffer, false);
+        if (rc < 0) {
+            return fail("fs_read", op->name, rc);
+        }
+        log_operation("fs_read", op->name, 0);
+        return len;
+    }
+    if (b->count > 0 && b->writing) batch_flush(b);
+    b->writing = false;
+    b->buf = op->buffer;
+    b->base = op->offset;
+    b->op = i;
+    size_t mark = b->count;
+    if (file_for_each_span(idx, op->offset, len, span_queue, b) < 0) {
+        b->count = mark;
+        return fail("fs_read", op->name, FS_ERR_IO);
+    }
+    b->file[i] = idx;
+    return len;
 }
 
-// Find index of a file in metadata by name
-static int find_file_index(const char *filename) {
+// Run a batch of operations in order under one lock acquisition. Data of
+// writes, appends and reads is queued and transferred with vectored I/O,
+// coalescing adjacent blocks; metadata is written and synced once, at the
+// end. Each operation's outcome goes to its result field. Returns the
+// number of operations that failed.
+int fs_submit(struct FsOp *ops, int count) {
+    if ((!ops && count > 0) || count < 0) {
+        return fail("fs_submit", NULL, FS_ERR_INVALID);
+    }
+    struct IoBatch b;
+    memset(&b, 0, sizeof(b));
+    b.ops = ops;
+    b.file = malloc((count ? count : 1) * sizeof(int));
+    b.old_size = malloc((count ? count : 1) * sizeof(int64_t));
+    lock_all_files(true);
+    pthread_rwlock_wrlock(&meta_lock);
+    b.pending = calloc(MAX_FILES ? MAX_FILES : 1, 1);
+    if (!b.file || !b.old_size || !b.pending) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_all_files();
+        free(b.file);
+        free(b.old_size);
+        free(b.pending);
+        return fail("fs_submit", NULL, FS_ERR_NO_MEMORY);
+    }
+    batch_active = true;
+    for (int i = 0; i < count; ++i) {
+        struct FsOp *op = &ops[i];
+        b.file[i] = -1;
+        b.op = i;
+        if (!op->name) {
+            op->result = fail("fs_submit", NULL, FS_ERR_INVALID);
+            continue;
+        }
+        switch (op->type) {
+            case FS_OP_CREATE:
+                op->result = fs_create_locked(op->name);
+                break;
+            case FS_OP_WRITE:
+            case FS_OP_APPEND:
+                op->result = batch_write(&b, i);
+                break;
+            case FS_OP_READ:
+                op->result = batch_read(&b, i);
+                break;
+            case FS_OP_DELETE:
+                // The file's blocks may be queued for I/O or reused later on
+                if (b.count > 0) batch_flush(&b);
+                op->result = fs_delete_locked(op->name);
+                break;
+            case FS_OP_RENAME:
+                op->result = op->new_name ? fs_rename_locked(op->name, op->new_name)
+                                          : fail("fs_rename", op->name, FS_ERR_INVALID);
+                break;
+            default:
+                op->result = fail("fs_submit", op->name, FS_ERR_INVALID);
+        }
+    }
+    b.op = count - 1;
+    batch_flush(&b);
+    batch_active = false;
+    int rc = save_metadata();  // every change of the batch in one pass, then the policy's sync
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    free(b.segs);
+    free(b.file);
+    free(b.old_size);
+    free(b.pending);
+    if (rc < 0) {
+        return fail("fs_submit", NULL, FS_ERR_IO);
+    }
+    int failed = 0;
+    for (int i = 0; i < count; ++i) {
+        if (ops[i].result < 0) failed++;
+    }
+    log_operation("fs_submit", NULL, 0);
+    return failed;
+}
+
+// Choose the next file worth moving and reserve its destination run.
+// Fragmented files come first; after that, single-extent files that a free
+// run lower down could hold, lowest-placed first, which gathers free space
+// at the end of the data area. Returns 0 when no move would help.
+static int defrag_pick() {
+    int best = -1;
+    int64_t best_key = INT64_MAX;
     for (int i = 0; i < fs.file_count; ++i) {
-        if (strcmp(fs.files[i].name, filename) == 0) {
-            return i;
+        struct FileEntry *f = &fs.files[i];
+        // A compressed file's units are separate runs by design
+        if (f->extent_count == 0 || (f->flags & FILE_COMPRESSED)) continue;
+        int64_t blocks = file_blocks(f);
+        if (blocks > UINT32_MAX) continue;
+        int64_t target = alloc_lowest_fit(blocks);
+        if (target < 0) continue;
+        int64_t key;
+        if (f->extent_count > 1) {
+            key = -1;
+        } else {
+            key = (int64_t)fs.extents[f->first_extent].pblock;
+            if (target >= key) continue;  // already as low as it can go
+        }
+        // Moving a file would not free blocks a copy still maps; the move
+        // locks the file by path
+        char path[MAX_PATH_LEN];
+        if (key < best_key && !file_shared(i) && entry_path(i, path) == 0) {
+            best = i;
+            best_key = key;
+            if (key < 0) break;
         }
     }
-    return -1;
+    if (best < 0) return 0;
+    defrag.blocks = file_blocks(&fs.files[best]);
+    defrag.target = alloc_lowest_fit(defrag.blocks);
+    if (alloc_reserve(defrag.target, defrag.blocks) < 0) return 0;
+    defrag.idx = best;
+    defrag.copied = 0;
+    return 1;
 }
 
-// Save metadata (fs struct) to disk
-static int save_metadata() {
-    if (disk_fd < 0) return -1;
-    if (lseek(disk_fd, 0, SEEK_SET) < 0) return -1;
-    unsigned char meta_buf[META_SIZE];
-    memset(meta_buf, 0, META_SIZE);
-    memcpy(meta_buf, &fs, sizeof(fs));
-    ssize_t bytes = write(disk_fd, meta_buf, META_SIZE);
-    if (bytes != META_SIZE) return -1;
-    fsync(disk_fd);
+// Point the file being moved at its new run and free its old blocks
+static int defrag_finish() {
+    struct FileEntry *f = &fs.files[defrag.idx];
+    // The copy must be on disk before the metadata refers to it
+    if (sync_due()) sync_disk();
+    uint32_t first = f->first_extent;
+    for (uint32_t r = first; r != EXTENT_NONE; ) {
+        uint32_t next = fs.extents[r].next;
+        // The blocks were copied as they are, so their checksums carry over
+        for (uint32_t i = 0; i < fs.extents[r].count; ++i) {
+            set_block_crc(defrag.target + fs.extents[r].lblock + i, block_crc[fs.extents[r].pblock + i]);
+        }
+        block_unref(fs.extents[r].pblock, fs.extents[r].count);
+        if (r != first) record_free(r);
+        r = next;
+    }
+    struct Extent *e = &fs.extents[first];
+    e->lblock = 0;
+    e->pblock = defrag.target;
+    e->count = (uint32_t)defrag.blocks;
+    e->next = EXTENT_NONE;
+    block_ref(defrag.target, defrag.blocks);
+    mark_extent_dirty(first);
+    f->extent_count = 1;
+    mark_entry_dirty(defrag.idx);
+    defrag.moved_files++;
+    defrag.idx = -1;
+    return save_metadata();
+}
+
+// Run one bounded defragmentation step: copy at most the configured number
+// of bytes of the current move, staged through a buffer no larger than the
+// memory cap. Other operations may run between steps; one that changes the
+// file being moved cancels its move. During the copy the file is locked
+// shared, so it stays readable.
+int fs_defragment_step() {
+    pthread_mutex_lock(&defrag_lock);
+    pthread_rwlock_wrlock(&meta_lock);
+    if (defrag.idx < 0 && !defrag_pick()) {
+        pthread_rwlock_unlock(&meta_lock);
+        pthread_mutex_unlock(&defrag_lock);
+        return 0;
+    }
+    char name[MAX_PATH_LEN];
+    if (entry_path(defrag.idx, name) < 0) {
+        // Moved past the path limit since it was picked
+        defrag_cancel(defrag.idx);
+        pthread_rwlock_unlock(&meta_lock);
+        pthread_mutex_unlock(&defrag_lock);
+        return 1;
+    }
+    pthread_rwlock_unlock(&meta_lock);
+    lock_names(name, false, NULL, false);
+    pthread_rwlock_rdlock(&meta_lock);
+    if (defrag.idx < 0 || find_file_index(name) != defrag.idx) {
+        // Cancelled by a write to the file before its lock was taken, or
+        // renamed
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(name, NULL);
+        pthread_mutex_unlock(&defrag_lock);
+        return 1;
+    }
+    int64_t budget = defrag_step_bytes / BLOCK_SIZE;
+    int64_t chunk = defrag_memory / BLOCK_SIZE;
+    if (budget < 1) budget = 1;
+    if (chunk < 1) chunk = 1;
+    if (chunk > budget) chunk = budget;
+    char *buf = malloc(chunk * BLOCK_SIZE);
+    int rc = buf ? 0 : FS_ERR_NO_MEMORY;
+    while (rc == 0 && budget > 0 && defrag.copied < defrag.blocks) {
+        int64_t n = defrag.blocks - defrag.copied;
+        if (n > chunk) n = chunk;
+        if (n > budget) n = budget;
+        int64_t len = n * BLOCK_SIZE;
+        if (file_read_at(defrag.idx, defrag.copied * BLOCK_SIZE, buf, len) < 0 ||
+            data_write_at(buf, len, block_offset(defrag.target + defrag.copied)) != len) {
+            rc = FS_ERR_IO;
+            break;
+        }
+        defrag.copied += n;
+        defrag.moved_blocks += n;
+        budget -= n;
+    }
+    free(buf);
+    pthread_rwlock_unlock(&meta_lock);
+    if (rc < 0 || defrag.copied == defrag.blocks) {
+        pthread_rwlock_wrlock(&meta_lock);
+        if (rc < 0) {
+            defrag_cancel(defrag.idx);
+        } else if (defrag.idx >= 0) {  // fs_copy holds the file shared too and may have cancelled the move
+            rc = defrag_finish() < 0 ? FS_ERR_IO : 0;
+        }
+        pthread_rwlock_unlock(&meta_lock);
+    }
+    unlock_names(name, NULL);
+    pthread_mutex_unlock(&defrag_lock);
+    if (rc < 0) {
+        return fail("fs_defragment_step", NULL, rc);
+    }
+    return 1;
+}
+
+// Defragment the disk: make every file a single run of blocks and gather
+// free space, moving only the files that need it, in bounded steps
+int fs_defragment(int *moved_files, int64_t *moved_blocks) {
+    if (moved_files) *moved_files = 0;
+    if (moved_blocks) *moved_blocks = 0;
+    pthread_rwlock_rdlock(&meta_lock);
+    int count = fs.file_count;
+    pthread_rwlock_unlock(&meta_lock);
+    if (count == 0) {
+        log_operation("fs_defragment", NULL, 0);
+        return 0;
+    }
+    pthread_mutex_lock(&defrag_lock);
+    defrag.moved_files = 0;
+    defrag.moved_blocks = 0;
+    pthread_mutex_unlock(&defrag_lock);
+    int rc;
+    while ((rc = fs_defragment_step()) > 0) {
+    }
+    if (rc < 0) {
+        return fail("fs_defragment", NULL, rc);
+    }
+    if (moved_files) *moved_files = defrag.moved_files;
+    if (moved_blocks) *moved_blocks = defrag.moved_blocks;
+    log_operation("fs_defragment", NULL, 0);
     return 0;
 }
 
-// Load metadata from disk into fs struct
-static int load_metadata() {
-    if (disk_fd < 0) return -1;
-    if (lseek(disk_fd, 0, SEEK_SET) < 0) return -1;
-    unsigned char meta_buf[META_SIZE];
-    ssize_t bytes = read(disk_fd, meta_buf, META_SIZE);
-    if (bytes < 0) return -1;
-    if (bytes > 0) memcpy(&fs, meta_buf, sizeof(fs));
+// Set the per-step I/O budget and the staging memory cap for defragmentation
+int fs_set_defrag_limits(int64_t step_bytes, int64_t memory_bytes) {
+    if (step_bytes <= 0 || memory_bytes <= 0) {
+        return fail("fs_set_defrag_limits", NULL, FS_ERR_INVALID);
+    }
+    pthread_mutex_lock(&defrag_lock);
+    defrag_step_bytes = step_bytes;
+    defrag_memory = memory_bytes;
+    pthread_mutex_unlock(&defrag_lock);
+    log_operation("fs_set_defrag_limits", NULL, 0);
     return 0;
 }
 
-// Initialize the file system (open or create disk file, load or format)
-int fs_init() {
-    disk_fd = open(DISK_NAME, O_RDWR);
-    if (disk_fd < 0) {
-        // Disk doesn't exist, create new file
-        disk_fd = open(DISK_NAME, O_RDWR | O_CREAT, 0666);
-        if (disk_fd < 0) {
-            perror("Disk dosyası oluşturulamadı");
-            return -1;
-        }
-        if (ftruncate(disk_fd, DISK_SIZE) < 0) {
-            perror("Disk boyutu ayarlanamadı");
-            return -1;
+// Count one integrity problem and record what it concerns in the log
+static void report_issue(int *issues, const char *detail) {
+    (*issues)++;
+    log_operation("fs_check_integrity", detail, FS_ERR_CORRUPT);
+}
+
+// Check the entry and extent chain of file idx (live or a snapshot's),
+// counting the mappings of each block in refs and marking the records seen
+static void check_file(int idx, uint32_t *refs, unsigned char *record_seen, int *issues) {
+    struct FileEntry *f = &fs.files[idx];
+    uint32_t flags = f->flags & FILE_FLAG_BITS;
+    if (f->size < 0 || (flags & ~(FILE_COMPRESSED | FILE_DIRECTORY)) ||
+        flags == (FILE_COMPRESSED | FILE_DIRECTORY) || (is_dir(f) && (f->size == 0 || f->size >= MAX_DIRECTORIES))) {
+        report_issue(issues, f->name);
+    }
+    // A compressed file's chain may skip logical blocks (see packed_valid)
+    bool packed = f->flags & FILE_COMPRESSED;
+    bool walked = true;
+    int64_t blocks = 0, end = 0;
+    uint32_t extents = 0;
+    for (uint32_t r = f->first_extent; r != EXTENT_NONE; r = fs.extents[r].next) {
+        if (r >= MAX_EXTENTS || record_seen[r]) {
+            report_issue(issues, f->name);
+            walked = false;
+            break;
         }
-        fs.file_count = 0;
-        memset(fs.files, 0, sizeof(fs.files));
-        if (save_metadata() < 0) {
-            perror("Metadata yazılamadı");
-            return -1;
+        record_seen[r] = 1;
+        struct Extent *e = &fs.extents[r];
+        if (e->count == 0 || (int64_t)e->lblock < end || (!packed && (int64_t)e->lblock != end) ||
+            e->pblock + e->count > (uint64_t)BLOCK_COUNT) {
+            report_issue(issues, f->name);
+            walked = false;
+            break;
         }
-    } else {
-        struct stat st;
-        if (fstat(disk_fd, &st) == 0) {
-            if (st.st_size != DISK_SIZE) {
-                // If disk size is wrong, reset it
-                ftruncate(disk_fd, DISK_SIZE);
-                fs.file_count = 0;
-                memset(fs.files, 0, sizeof(fs.files));
-                save_metadata();
-            } else {
-                if (load_metadata() < 0) {
-                    fprintf(stderr, "Metadata yüklenemedi, disk bozuk olabilir.\n");
-                    fs.file_count = 0;
-                    memset(fs.files, 0, sizeof(fs.files));
-                    save_metadata();
-                }
-            }
+        for (uint64_t b = e->pblock; b < e->pblock + e->count; ++b) {
+            refs[b]++;
         }
+        blocks += e->count;
+        end = (int64_t)(e->lblock + e->count);
+        extents++;
     }
-    // Open log file for appending
-    log_fd = open(log_filename, O_RDWR | O_CREAT | O_APPEND, 0666);
-    if (log_fd < 0) {
-        perror("Log dosyası açılamadı");
+    bool layout_ok = is_dir(f) ? blocks == 0
+                     : packed ? walked && f->size >= 0 && packed_valid(idx, blocks)
+                              : blocks == blocks_for(f->size > 0 ? f->size : 0);
+    if (extents != f->extent_count || !layout_ok) {
+        report_issue(issues, f->name);
     }
-    return 0;
 }
 
-// Close disk and log file descriptors
-int fs_close() {
-    if (disk_fd >= 0) close(disk_fd);
-    if (log_fd >= 0) close(log_fd);
-    return 0;
+// Check that every live entry is found under its name in its directory
+// (which catches a name used twice, or a missing directory), that every
+// directory has its own id, and that each leads up to the root
+static void check_directories(int *issues) {
+    int count = fs.file_count < 0 ? 0 : (fs.file_count > MAX_FILES ? MAX_FILES : fs.file_count);
+    int64_t indexed = 0;
+    for (uint32_t id = 0; id < dir_count; ++id) {
+        indexed += dirs[id].tree.count;
+    }
+    if (indexed != count) {
+        report_issue(issues, "directories");
+    }
+    for (int i = 0; i < count; ++i) {
+        struct FileEntry *f = &fs.files[i];
+        struct Directory *d = is_dir(f) ? dir_get(dir_id(f)) : NULL;
+        if (find_child(FILE_PARENT(f), f->name) != i || (is_dir(f) && (!d || d->entry != i))) {
+            report_issue(issues, f->name);
+        }
+    }
+    // 1: on the walk up from the current directory, 2: leads to the root,
+    // 3: does not
+    unsigned char *state = calloc(dir_count ? dir_count : 1, 1);
+    if (!state) {
+        report_issue(issues, "directories");
+        return;
+    }
+    state[0] = 2;
+    for (uint32_t id = 1; id < dir_count; ++id) {
+        if (dirs[id].entry < 0) continue;
+        unsigned char result;
+        uint32_t u = id;
+        for (;;) {
+            if (state[u] != 0) {
+                result = state[u] == 1 ? 3 : state[u];  // back on this walk: a cycle
+                break;
+            }
+            state[u] = 1;
+            uint32_t parent = FILE_PARENT(&fs.files[dirs[u].entry]);
+            if (!dir_get(parent)) {
+                result = 3;
+                break;
+            }
+            u = parent;
+        }
+        for (u = id; state[u] == 1; u = FILE_PARENT(&fs.files[dirs[u].entry])) {
+            state[u] = result;
+        }
+        if (result == 3) {
+            report_issue(issues, fs.files[dirs[id].entry].name);
+        }
+    }
+    free(state);
 }
 
-// Format the disk (reset filesystem)
-int fs_format() {
-    fs.file_count = 0;
-    memset(fs.files, 0, sizeof(fs.files));
-    if (save_metadata() < 0) {
-        printf("Format başarısız (metadata yazılamadı)\n");
-        log_operation("fs_format", NULL, -1);
-        return -1;
+// Check file system integrity; returns the number of problems found
+static int fs_check_integrity_locked() {
+    int issues = 0;
+    // Check superblock and file count
+    struct SuperBlock sb = fs.sb;
+    sb.file_count = 0;
+    if (!superblock_valid(&sb)) {
+        report_issue(&issues, "superblock");
     }
-    // Wipe data area to zeros
-    char zeros[512];
-    memset(zeros, 0, sizeof(zeros));
-    if (lseek(disk_fd, META_SIZE, SEEK_SET) < 0) {
-        printf("Format başarısız (konum hatası)\n");
-        log_operation("fs_format", NULL, -1);
-        return -1;
+    if (fs.file_count < 0 || fs.file_count > MAX_FILES) {
+        report_issue(&issues, "file_count");
+    } else if (fs.file_count > SNAPSHOT_BASE) {
+        report_issue(&issues, "snapshot_entries");
     }
-    size_t remaining = DATA_SIZE;
-    while (remaining > 0) {
-        size_t chunk = remaining < sizeof(zeros) ? remaining : sizeof(zeros);
-        write(disk_fd, zeros, chunk);
-        remaining -= chunk;
+    check_directories(&issues);
+    // Walk every extent chain, counting the mappings of each block and
+    // marking records as they are seen. Files may share blocks, and a file
+    // may map one block more than once (repeated contents, deduplicated).
+    int count = fs.file_count < 0 ? 0 : (fs.file_count > MAX_FILES ? MAX_FILES : fs.file_count);
+    uint32_t *refs = calloc(BLOCK_COUNT ? BLOCK_COUNT : 1, sizeof(uint32_t));
+    unsigned char *record_seen = calloc(MAX_EXTENTS ? MAX_EXTENTS : 1, 1);
+    if (!refs || !record_seen) {
+        free(refs);
+        free(record_seen);
+        return fail("fs_check_integrity", NULL, FS_ERR_NO_MEMORY);
     }
-    fsync(disk_fd);
-    printf("Disk formatlandı (tüm veriler silindi)\n");
-    log_operation("fs_format", NULL, 0);
-    return 0;
+    for (int i = 0; i < count; ++i) {
+        check_file(i, refs, record_seen, &issues);
+    }
+    // Each snapshot: its header, then its files
+    for (int h = SNAPSHOT_BASE; h < MAX_FILES && count <= SNAPSHOT_BASE; ) {
+        struct FileEntry *head = &fs.files[h];
+        if (head->flags != FILE_SNAPSHOT || head->first_extent != EXTENT_NONE || head->size < 0 ||
+            head->size >= MAX_FILES - h) {
+            report_issue(&issues, "snapshots");
+            break;
+        }
+        for (int j = SNAPSHOT_BASE; j < h; j = snapshot_next(j)) {
+            if (strcmp(fs.files[j].name, head->name) == 0) {
+                report_issue(&issues, head->name);
+            }
+        }
+        for (int i = h + 1; i <= h + head->size; ++i) {
+            check_file(i, refs, record_seen, &issues);
+        }
+        h = snapshot_next(h);
+    }
+    int64_t used_blocks = 0;
+    bool refs_match = true;
+    for (int64_t b = 0; b < BLOCK_COUNT; ++b) {
+        if (refs[b] > 0) used_blocks++;
+        if (refs[b] != block_refs[b]) refs_match = false;
+    }
+    if (!refs_match) {
+        report_issue(&issues, "block_refs");
+    }
+    if (defrag.idx >= 0) {
+        used_blocks += defrag.blocks;  // destination of the move in progress
+    }
+    if (issues == 0 && used_blocks + pending_blocks() + alloc_free_total() != BLOCK_COUNT) {
+        report_issue(&issues, "free_blocks");
+    }
+    free(refs);
+    free(record_seen);
+    log_operation("fs_check_integrity", NULL, issues == 0 ? 0 : FS_ERR_CORRUPT);
+    return issues;
 }
 
-// Create a new file (empty)
-int fs_create(const char *filename) {
-    if (!filename || strlen(filename) == 0) {
-        printf("Hatalı dosya adı.\n");
-        log_operation("fs_create", filename, -1);
-        return -1;
+int fs_check_integrity() {
+    lock_all_files(false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int rc = fs_check_integrity_locked();
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+// Verify the contents of every block in use against its checksum, the
+// blocks shared out between threads; returns the number of bad blocks
+static int fs_scrub_locked(int threads, struct FsScrubStats *stats) {
+    if (threads < 0) {
+        return fail("fs_scrub", NULL, FS_ERR_INVALID);
     }
-    if (find_file_index(filename) != -1) {
-        printf("Hata: '%s' dosyası zaten mevcut.\n", filename);
-        log_operation("fs_create", filename, -1);
-        return -1;
+    struct Scrub sc;
+    memset(&sc, 0, sizeof(sc));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Blocks are read around the cache
+    int used = cache_flush(disk_fd) < 0 ? -1 : scrub_run(&sc, threads);
+    if (used < 0) {
+        return fail("fs_scrub", NULL, FS_ERR_IO);
     }
-    if (fs.file_count >= MAX_FILES) {
-        printf("Hata: Maksimum dosya sayısına ulaşıldı.\n");
-        log_operation("fs_create", filename, -1);
-        return -1;
+    if (stats) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats->threads = used;
+        stats->blocks = sc.blocks;
+        stats->bytes = sc.blocks * BLOCK_SIZE;
+        stats->bad_blocks = sc.bad;
+        stats->first_bad = sc.first_bad;
+        stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
     }
-    // Prepare new file entry
-    struct FileEntry new_file;
-    memset(&new_file, 0, sizeof(new_file));
-    strncpy(new_file.name, filename, MAX_FILENAME_LEN - 1);
-    new_file.size = 0;
-    new_file.start = -1;  // no data allocated yet
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(new_file.created, sizeof(new_file.created), "%Y-%m-%d %H:%M:%S", tm_info);
-    // Add to metadata
-    fs.files[fs.file_count] = new_file;
-    fs.file_count++;
-    if (save_metadata() < 0) {
-        printf("Dosya oluşturulamadı (yazma hatası)\n");
-        fs.file_count--;
-        log_operation("fs_create", filename, -1);
-        return -1;
+    if (sc.bad > 0) {
+        char detail[64];
+        snprintf(detail, sizeof(detail), "%lld bad block(s), first %lld", (long long)sc.bad, (long long)sc.first_bad);
+        log_operation("fs_scrub", detail, FS_ERR_CORRUPT);
+    } else {
+        log_operation("fs_scrub", NULL, 0);
+    }
+    return sc.bad > INT32_MAX ? INT32_MAX : (int)sc.bad;
+}
+
+int fs_scrub(int threads, struct FsScrubStats *stats) {
+    lock_all_files(false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int rc = fs_scrub_locked(threads, stats);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+// What a backup's manifest (backup file name + MANIFEST_SUFFIX) records
+struct Manifest {
+    bool full;           // whole image; otherwise changed blocks only
+    uint64_t id;
+    uint64_t parent;     // backup an incremental one applies on top of
+    uint64_t disk_size;  // geometry of the image backed up
+    uint64_t meta_size;
+    uint32_t block_size;
+    int64_t blocks;      // data blocks an incremental backup carries
+    uint64_t data_end;   // end of the data area; the checksum table follows
+    uint64_t crc_offset; // checksum table (0 in version 1)
+    uint64_t tail;       // bytes of the sectors of the table an incremental
+                         // backup carries: those covering its blocks
+};
+
+static char *manifest_name(const char *backup_filename) {
+    char *name = malloc(strlen(backup_filename) + sizeof(MANIFEST_SUFFIX));
+    if (name) {
+        strcpy(name, backup_filename);
+        strcat(name, MANIFEST_SUFFIX);
+    }
+    return name;
+}
+
+static int write_manifest(const char *backup_filename, const struct Manifest *m) {
+    char *name = manifest_name(backup_filename);
+    FILE *f = name ? fopen(name, "w") : NULL;
+    free(name);
+    if (!f) return -1;
+    fprintf(f, "%s 2\ntype %s\nid %016llx\nparent %016llx\n", MANIFEST_MAGIC, m->full ? "full" : "incremental",
+            (unsigned long long)m->id, (unsigned long long)m->parent);
+    fprintf(f, "disk_size %llu\nmeta_size %llu\nblock_size %u\nblocks %lld\n", (unsigned long long)m->disk_size,
+            (unsigned long long)m->meta_size, m->block_size, (long long)m->blocks);
+    fprintf(f, "data_end %llu\ncrc_offset %llu\ntail %llu\n", (unsigned long long)m->data_end,
+            (unsigned long long)m->crc_offset, (unsigned long long)m->tail);
+    int rc = ferror(f) ? -1 : 0;
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0) rc = -1;
+    if (fclose(f) != 0) rc = -1;
+    return rc;
+}
+
+// 0, or FS_ERR_NOT_FOUND when the backup has no manifest (a plain image
+// copy), or FS_ERR_CORRUPT when it cannot be parsed
+static int read_manifest(const char *backup_filename, struct Manifest *m) {
+    char *name = manifest_name(backup_filename);
+    FILE *f = name ? fopen(name, "r") : NULL;
+    free(name);
+    if (!f) return FS_ERR_NOT_FOUND;
+    char magic[32], type[16];
+    unsigned long long id, parent, disk_size, meta_size, data_end = 0, crc_offset = 0, tail = 0;
+    unsigned block_size;
+    long long blocks;
+    int version;
+    int n = fscanf(f, "%31s %d type %15s id %llx parent %llx disk_size %llu meta_size %llu block_size %u blocks %lld",
+                   magic, &version, type, &id, &parent, &disk_size, &meta_size, &block_size, &blocks);
+    // Version 1 images had nothing after the data area
+    if (n == 9 && version == 1) data_end = disk_size;
+    else if (n == 9 && fscanf(f, " data_end %llu crc_offset %llu tail %llu", &data_end, &crc_offset, &tail) != 3) n = 0;
+    fclose(f);
+    if (n != 9 || strcmp(magic, MANIFEST_MAGIC) != 0 || version < 1 || version > 2 || data_end > disk_size ||
+        tail > disk_size - data_end || (crc_offset && (crc_offset < data_end || crc_offset % META_SECTOR != 0)) ||
+        (strcmp(type, "full") != 0 && strcmp(type, "incremental") != 0) || blocks < 0) {
+        return FS_ERR_CORRUPT;
     }
-    printf("Dosya '%s' oluşturuldu.\n", filename);
-    log_operation("fs_create", filename, 0);
+    m->full = strcmp(type, "full") == 0;
+    m->id = id;
+    m->parent = parent;
+    m->disk_size = disk_size;
+    m->meta_size = meta_size;
+    m->block_size = block_size;
+    m->blocks = blocks;
+    m->data_end = data_end;
+    m->crc_offset = crc_offset;
+    m->tail = tail;
     return 0;
 }
 
-// Delete a file
-int fs_delete(const char *filename) {
-    int idx = find_file_index(filename);
-    if (idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", filename);
-        log_operation("fs_delete", filename, -1);
-        return -1;
+static uint64_t new_backup_id() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t id = ((uint64_t)now.tv_sec << 30) ^ (uint64_t)now.tv_nsec ^ ((uint64_t)getpid() << 48);
+    return id ? id : 1;
+}
+
+// Take the changed-block map, leaving it empty: writes from here on count
+// towards the next backup
+static unsigned char *changed_take() {
+    size_t bytes = BLOCK_COUNT / 8 + 1;
+    unsigned char *taken = malloc(bytes);
+    if (!taken) return NULL;
+    for (size_t i = 0; i < bytes; ++i) {
+        taken[i] = __atomic_exchange_n(&block_changed[i], 0, __ATOMIC_RELAXED);
     }
-    // Remove the file entry by shifting others
-    for (int i = idx; i < fs.file_count - 1; ++i) {
-        fs.files[i] = fs.files[i+1];
+    return taken;
+}
+
+// Put a taken map back after a failed backup
+static void changed_return(unsigned char *taken) {
+    size_t bytes = BLOCK_COUNT / 8 + 1;
+    for (size_t i = 0; i < bytes; ++i) {
+        if (taken[i]) __atomic_fetch_or(&block_changed[i], taken[i], __ATOMIC_RELAXED);
     }
-    fs.file_count--;
-    if (save_metadata() < 0) {
-        printf("Dosya silinirken hata oluştu.\n");
-        log_operation("fs_delete", filename, -1);
-        return -1;
+    free(taken);
+}
+
+// Write len bytes of the image from off to out_fd, in place on the mapping
+// or staged through buf (STREAM_CHUNK bytes)
+static int image_out(int out_fd, int64_t off, int64_t len, char *buf) {
+    const unsigned char *view = disk_view(off);
+    if (view) return write_all(out_fd, view, len);
+    for (int64_t done = 0; done < len; ) {
+        size_t n = len - done < STREAM_CHUNK ? (size_t)(len - done) : STREAM_CHUNK;
+        if (disk_read_at(buf, n, off + done) != (ssize_t)n || write_all(out_fd, buf, n) < 0) return -1;
+        done += n;
     }
-    printf("Dosya '%s' silindi.\n", filename);
-    log_operation("fs_delete", filename, 0);
     return 0;
 }
 
-// Write data to a file (overwrite from beginning)
-int fs_write(const char *filename, const char *data, int size) {
-    if (!filename || !data || size < 0) {
-        printf("Hatalı parametre.\n");
-        log_operation("fs_write", filename, -1);
-        return -1;
+// Bytes of sector k of the checksum table of block_count blocks (the last
+// may be partial)
+static uint64_t crc_sector_len(uint64_t k, uint64_t block_count) {
+    uint64_t table = block_count * sizeof(uint32_t), off = k * META_SECTOR;
+    return table - off < META_SECTOR ? table - off : META_SECTOR;
+}
+
+// Back up the image to backup_filename with a manifest beside it: the whole
+// image, or (incremental) the metadata region, the checksum table sectors
+// covering the data blocks written since the previous backup, the numbers
+// of those blocks and the blocks
+static int fs_backup_locked(const char *backup_filename, bool incremental) {
+    const char *op = incremental ? "fs_backup_incremental" : "fs_backup";
+    if (!backup_filename || strlen(backup_filename) == 0) {
+        return fail(op, backup_filename, FS_ERR_INVALID);
     }
-    int idx = find_file_index(filename);
-    if (idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", filename);
-        log_operation("fs_write", filename, -1);
-        return -1;
+    if (incremental && backup_base == 0) {
+        return fail(op, backup_filename, FS_ERR_INVALID);  // nothing to build on: take a full backup
     }
-    struct FileEntry *file = &fs.files[idx];
-    if (size == 0) {
-        // Truncate file to 0
-        file->size = 0;
-        file->start = -1;
-        save_metadata();
-        printf("Dosya '%s' içeriği sıfırlandı.\n", filename);
-        log_operation("fs_write", filename, 0);
-        return 0;
+    char *buf = malloc(STREAM_CHUNK);
+    unsigned char *taken = changed_take();
+    uint64_t *list = NULL;
+    if (!buf || !taken) {
+        free(buf);
+        if (taken) changed_return(taken);
+        return fail(op, backup_filename, FS_ERR_NO_MEMORY);
     }
-    // If new data fits in current allocated space
-    if (file->size >= size && file->start != -1) {
-        if (lseek(disk_fd, file->start, SEEK_SET) < 0) {
-            printf("Yazma hatası (konumlanamadı)\n");
-            log_operation("fs_write", filename, -1);
-            return -1;
-        }
-        if (write(disk_fd, data, size) != size) {
-            printf("Yazma hatası (disk)\n");
-            log_operation("fs_write", filename, -1);
-            return -1;
-        }
-        file->size = size;
-        save_metadata();
-        printf("Dosya '%s' üzerine %d bayt veri yazıldı (üstüne yazma).\n", filename, size);
-        log_operation("fs_write", filename, 0);
-        return 0;
+    // Blocks written since the last backup, found a map byte at a time
+    int64_t count = 0;
+    for (int64_t i = 0; incremental && i <= BLOCK_COUNT / 8; ++i) {
+        for (unsigned char bits = taken[i]; bits; bits &= bits - 1) count++;
     }
-    // Need to allocate new space (file empty or expanding beyond current space)
-    int needed = size;
-    // Build list of used segments (start and end of each file)
-    struct { int start; int end; } segs[MAX_FILES];
-    int seg_count = 0;
-    for (int i = 0; i < fs.file_count; ++i) {
-        if (fs.files[i].size > 0) {
-            segs[seg_count].start = fs.files[i].start;
-            segs[seg_count].end = fs.files[i].start + fs.files[i].size;
-            seg_count++;
-        }
+    if (incremental && !(list = malloc((count ? count : 1) * sizeof(uint64_t)))) {
+        free(buf);
+        changed_return(taken);
+        return fail(op, backup_filename, FS_ERR_NO_MEMORY);
     }
-    // Sort segments by start address
-    for (int i = 0; i < seg_count - 1; ++i) {
-        for (int j = 0; j < seg_count - 1 - i; ++j) {
-            if (segs[j].start > segs[j+1].start) {
-                // swap
-                int ts = segs[j].start;
-                int te = segs[j].end;
-                segs[j].start = segs[j+1].start;
-                segs[j].end = segs[j+1].end;
-                segs[j+1].start = ts;
-                segs[j+1].end = te;
-            }
+    int64_t n = 0;
+    for (int64_t b = 0; incremental && b < BLOCK_COUNT; ++b) {
+        if (!taken[b / 8]) {
+            b |= 7;
+        } else if (taken[b / 8] & (1u << (b % 8))) {
+            list[n++] = b;
         }
     }
-    // Find a free gap of sufficient size
-    int found_start = -1;
-    if (seg_count == 0) {
-        // no files, entire data area is free
-        if (needed <= DATA_SIZE) {
-            found_start = META_SIZE;
-        }
-    } else {
-        // check gap before first file
-        if (segs[0].start - META_SIZE >= needed) {
-            found_start = META_SIZE;
+    uint64_t tail = 0;
+    for (int64_t i = 0; fs.sb.crc_offset && i < count; ++i) {
+        uint64_t k = list[i] * sizeof(uint32_t) / META_SECTOR;
+        if (i == 0 || k != list[i - 1] * sizeof(uint32_t) / META_SECTOR) tail += crc_sector_len(k, BLOCK_COUNT);
+    }
+    // The metadata is copied from its home sectors, so they must hold every record
+    int rc = journal_checkpoint();
+    int backup_fd = rc == 0 ? open(backup_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    if (backup_fd < 0) rc = -1;
+    if (backup_fd >= 0) {
+        // The image is copied raw, so cached writes must reach it first
+        rc = cache_flush(disk_fd);
+        if (!incremental) {
+            // Only the data ranges are copied; holes stay holes
+            for (int64_t off = 0, end; rc == 0 && off < DISK_SIZE; off = end) {
+                off = next_data(disk_fd, off, DISK_SIZE, &end);
+                if (off >= DISK_SIZE) break;
+                rc = lseek(backup_fd, off, SEEK_SET) < 0 ? -1 : image_out(backup_fd, off, end - off, buf);
+            }
+            if (rc == 0 && ftruncate(backup_fd, DISK_SIZE) < 0) rc = -1;
         } else {
-            // check between files
-            for (int k = 0; k < seg_count - 1; ++k) {
-                int gap_start = segs[k].end;
-                int gap_end = segs[k+1].start;
-                if (gap_end - gap_start >= needed) {
-                    found_start = gap_start;
-                    break;
-                }
+            if (rc == 0) rc = image_out(backup_fd, 0, META_SIZE, buf);
+            for (int64_t i = 0; fs.sb.crc_offset && i < count && rc == 0; ++i) {
+                uint64_t k = list[i] * sizeof(uint32_t) / META_SECTOR;
+                if (i > 0 && k == list[i - 1] * sizeof(uint32_t) / META_SECTOR) continue;
+                rc = image_out(backup_fd, fs.sb.crc_offset + k * META_SECTOR, crc_sector_len(k, BLOCK_COUNT), buf);
             }
-            // check after last file
-            if (found_start == -1) {
-                if (DISK_SIZE - segs[seg_count-1].end >= needed) {
-                    found_start = segs[seg_count-1].end;
-                }
+            if (rc == 0) rc = write_all(backup_fd, list, count * sizeof(uint64_t));
+            // Consecutive blocks go out together
+            int64_t per_chunk = STREAM_CHUNK / BLOCK_SIZE;
+            for (int64_t i = 0, j; i < count && rc == 0; i = j) {
+                for (j = i + 1; j < count && j - i < per_chunk && list[j] == list[j - 1] + 1; ++j) {}
+                rc = image_out(backup_fd, block_offset(list[i]), (j - i) * BLOCK_SIZE, buf);
             }
         }
+        if (rc == 0 && fsync(backup_fd) < 0) rc = -1;
+        if (close(backup_fd) < 0) rc = -1;
     }
-    if (found_start == -1) {
-        printf("Hata: Disk üzerinde yeterli sürekli boş alan yok.\n");
-        printf("Lütfen 'fs_defragment' işlemini yapıp tekrar deneyin.\n");
-        log_operation("fs_write", filename, -1);
-        return -1;
-    }
-    // Write new data at found_start
-    if (lseek(disk_fd, found_start, SEEK_SET) < 0) {
-        printf("Disk konum hatası\n");
-        log_operation("fs_write", filename, -1);
-        return -1;
-    }
-    if (write(disk_fd, data, size) != size) {
-        printf("Disk yazma hatası\n");
-        log_operation("fs_write", filename, -1);
-        return -1;
+    struct Manifest m = { !incremental, new_backup_id(), incremental ? backup_base : 0, fs.sb.disk_size,
+                          fs.sb.meta_size, fs.sb.block_size, count, block_offset(BLOCK_COUNT), fs.sb.crc_offset, tail };
+    if (rc == 0) rc = write_manifest(backup_filename, &m);
+    free(buf);
+    free(list);
+    if (rc < 0) {
+        changed_return(taken);
+        return fail(op, backup_filename, FS_ERR_IO);
     }
-    // Update metadata for file
-    file->start = found_start;
-    file->size = size;
-    if (save_metadata() < 0) {
-        printf("Metadata güncellenemedi\n");
-        log_operation("fs_write", filename, -1);
-        return -1;
+    free(taken);
+    backup_base = m.id;
+    cbt_mark_open();
+    log_operation(op, backup_filename, 0);
+    return 0;
+}
+
+int fs_backup(const char *backup_filename) {
+    lock_all_files(false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int rc = fs_backup_locked(backup_filename, false);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+int fs_backup_incremental(const char *backup_filename) {
+    lock_all_files(false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int rc = fs_backup_locked(backup_filename, true);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+// Copy len bytes from backup_fd to the image at off
+static int image_in(int backup_fd, int64_t off, int64_t len, char *buf) {
+    for (int64_t done = 0; done < len; ) {
+        size_t n = len - done < STREAM_CHUNK ? (size_t)(len - done) : STREAM_CHUNK;
+        ssize_t got = read(backup_fd, buf, n);
+        if (got <= 0 || disk_write_at(buf, got, off + done) != got) return -1;
+        done += got;
     }
-    printf("Dosyaya '%s' %d bayt veri yazıldı (yeni boyut=%d).\n", filename, size, size);
-    log_operation("fs_write", filename, 0);
     return 0;
 }
 
-// Append data to end of file
-int fs_append(const char *filename, const char *data, int size) {
-    if (!filename || !data || size <= 0) {
-        printf("Hatalı parametre.\n");
-        log_operation("fs_append", filename, -1);
-        return -1;
+// Empty the journal region of an image of size bytes rebuilt from a chain
+// of backups: records left there belong to the full backup's image, and
+// the incremental ones carry metadata already checkpointed
+static int journal_wipe(int64_t size) {
+    struct SuperBlock sb;
+    if (disk_read_at(&sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) return -1;
+    if (sb.magic != FS_MAGIC || sb.version < JOURNAL_VERSION || sb.journal_size < META_SECTOR ||
+        sb.journal_offset < sb.meta_size || sb.journal_offset + META_SECTOR > (uint64_t)size) {
+        return 0;  // no journal, or nothing mount_image would accept
     }
-    int idx = find_file_index(filename);
-    if (idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", filename);
-        log_operation("fs_append", filename, -1);
-        return -1;
+    static const unsigned char empty[META_SECTOR];
+    return disk_write_at(empty, META_SECTOR, sb.journal_offset) == META_SECTOR ? 0 : -1;
+}
+
+// Apply an incremental backup: its metadata region and checksum table
+// sectors, then its blocks
+static int apply_incremental(int backup_fd, const struct Manifest *m, char *buf) {
+    uint64_t *list = malloc((m->blocks ? m->blocks : 1) * sizeof(uint64_t));
+    if (!list) return -1;
+    size_t list_bytes = m->blocks * sizeof(uint64_t);
+    int64_t block_count = (m->data_end - m->meta_size) / m->block_size;
+    // The block numbers come after the checksum sectors, which they say
+    // the place of: read them first
+    int rc = 0;
+    for (size_t got = 0; rc == 0 && got < list_bytes; ) {
+        ssize_t r = pread(backup_fd, (char *)list + got, list_bytes - got, m->meta_size + m->tail + got);
+        if (r <= 0) rc = -1;
+        else got += r;
     }
-    struct FileEntry *file = &fs.files[idx];
-    if (file->size == 0) {
-        // if file is empty, same as write
-        return fs_write(filename, data, size);
-    }
-    int new_size = file->size + size;
-    int file_end = file->start + file->size;
-    // Find the next file's start or disk end
-    int next_start = DISK_SIZE;
-    for (int i = 0; i < fs.file_count; ++i) {
-        if (fs.files[i].size > 0 && fs.files[i].start > file->start) {
-            if (fs.files[i].start < next_start) {
-                next_start = fs.files[i].start;
-            }
-        }
+    for (int64_t i = 0; i < m->blocks && rc == 0; ++i) {
+        if (list[i] >= (uint64_t)block_count || (i > 0 && list[i] <= list[i - 1])) rc = -1;
     }
-    int contig_space = next_start - file_end;
-    if (contig_space >= size) {
-        // enough space right after current file
-        if (lseek(disk_fd, file_end, SEEK_SET) < 0) {
-            printf("Disk konumlanma hatası\n");
-            log_operation("fs_append", filename, -1);
-            return -1;
+    if (rc == 0) rc = image_in(backup_fd, 0, m->meta_size, buf);
+    uint64_t carried = 0;
+    for (int64_t i = 0; m->crc_offset && i < m->blocks && rc == 0; ++i) {
+        uint64_t k = list[i] * sizeof(uint32_t) / META_SECTOR;
+        if (i > 0 && k == list[i - 1] * sizeof(uint32_t) / META_SECTOR) continue;
+        uint64_t len = crc_sector_len(k, block_count);
+        carried += len;
+        rc = carried > m->tail ? -1 : image_in(backup_fd, m->crc_offset + k * META_SECTOR, len, buf);
+    }
+    if (rc == 0 && carried != m->tail) rc = -1;
+    if (rc == 0 && lseek(backup_fd, m->meta_size + m->tail + list_bytes, SEEK_SET) < 0) rc = -1;
+    for (int64_t i = 0; i < m->blocks && rc == 0; ++i) {
+        rc = image_in(backup_fd, m->meta_size + list[i] * m->block_size, m->block_size, buf);
+    }
+    free(list);
+    return rc;
+}
+
+// Check that backup_filenames form a chain: a full backup, then incremental
+// ones each taken right after the one before, all of the same geometry. A
+// single file without a manifest is a plain image copy.
+static int check_chain(const char *const *backup_filenames, int count, struct Manifest *m) {
+    for (int i = 0; i < count; ++i) {
+        int rc = read_manifest(backup_filenames[i], &m[i]);
+        if (rc == FS_ERR_NOT_FOUND && count == 1) {
+            memset(&m[0], 0, sizeof(m[0]));
+            m[0].full = true;
+            return 0;
         }
-        if (write(disk_fd, data, size) != size) {
-            printf("Disk yazma hatası\n");
-            log_operation("fs_append", filename, -1);
-            return -1;
+        if (rc < 0) return rc;
+        if (m[i].full != (i == 0)) return FS_ERR_INVALID;
+        if (i > 0 && (m[i].parent != m[i - 1].id || m[i].disk_size != m[0].disk_size ||
+                      m[i].meta_size != m[0].meta_size || m[i].block_size != m[0].block_size ||
+                      m[i].data_end != m[0].data_end)) {
+            return FS_ERR_INVALID;
+        }
+        if (!m[i].full && (m[i].block_size == 0 || m[i].meta_size >= m[i].data_end)) return FS_ERR_CORRUPT;
+        if (!m[i].full && m[i].crc_offset &&
+            m[i].crc_offset + (m[i].data_end - m[i].meta_size) / m[i].block_size * sizeof(uint32_t) > m[i].disk_size) {
+            return FS_ERR_CORRUPT;
         }
-        file->size = new_size;
-        save_metadata();
-        printf("Dosyaya '%s' %d bayt veri eklendi (yeni boyut=%d).\n", filename, size, new_size);
-        log_operation("fs_append", filename, 0);
-        return 0;
-    } else {
-        printf("Hata: Dosyanın sonuna ekleme için yer yok.\n");
-        printf("Lütfen 'fs_defragment' işlemini yapıp tekrar deneyin.\n");
-        log_operation("fs_append", filename, -1);
-        return -1;
     }
+    return 0;
 }
 
-// Read data from a file
-int fs_read(const char *filename, int offset, int size, char *buffer) {
-    if (!filename || !buffer || size < 0 || offset < 0) {
-        printf("Hatalı parametre.\n");
-        log_operation("fs_read", filename, -1);
-        return -1;
+// Restore the disk from a full backup followed by any incremental ones
+static int fs_restore_locked(const char *const *backup_filenames, int count) {
+    const char *last = count > 0 ? backup_filenames[count - 1] : NULL;
+    if (count < 1) {
+        return fail("fs_restore", NULL, FS_ERR_INVALID);
     }
-    int idx = find_file_index(filename);
-    if (idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", filename);
-        log_operation("fs_read", filename, -1);
-        return -1;
+    for (int i = 0; i < count; ++i) {
+        if (!backup_filenames[i] || strlen(backup_filenames[i]) == 0) {
+            return fail("fs_restore", backup_filenames[i], FS_ERR_INVALID);
+        }
     }
-    struct FileEntry *file = &fs.files[idx];
-    if (offset >= file->size) {
-        printf("Hata: Ofset dosya boyutunun dışında.\n");
-        log_operation("fs_read", filename, -1);
-        return -1;
+    struct Manifest *m = calloc(count, sizeof(*m));
+    int *fds = malloc(count * sizeof(int));
+    char *buf = malloc(STREAM_CHUNK);
+    if (!m || !fds || !buf) {
+        free(m);
+        free(fds);
+        free(buf);
+        return fail("fs_restore", last, FS_ERR_NO_MEMORY);
     }
-    if (offset + size > file->size) {
-        size = file->size - offset;
+    int rc = check_chain(backup_filenames, count, m);
+    // Every file is opened and its size checked before the image is touched
+    int opened = 0;
+    for (; opened < count && rc == 0; ++opened) {
+        struct stat st;
+        fds[opened] = open(backup_filenames[opened], O_RDONLY);
+        if (fds[opened] < 0) {
+            rc = FS_ERR_IO;
+            break;
+        }
+        int64_t expect = opened == 0 ? (m[0].disk_size ? (int64_t)m[0].disk_size : -1)
+                                     : (int64_t)(m[opened].meta_size + m[opened].tail +
+                                                 m[opened].blocks * (sizeof(uint64_t) + m[opened].block_size));
+        if (fstat(fds[opened], &st) < 0 || st.st_size == 0 || (expect >= 0 && st.st_size != expect)) {
+            rc = FS_ERR_CORRUPT;
+        }
     }
-    if (size <= 0) {
-        printf("Okunacak veri yok.\n");
-        log_operation("fs_read", filename, 0);
-        return 0;
+    if (rc == 0) {
+        // The backup carries its own geometry: resize the image to match it
+        struct stat st;
+        fstat(fds[0], &st);
+        journal_close();  // records of the image being replaced are dropped
+        unmap_disk();
+        cache_drop();  // every block is about to be replaced
+        // Start from an all-hole image and copy only the data ranges of the
+        // full backup
+        if (ftruncate(disk_fd, 0) < 0 || ftruncate(disk_fd, st.st_size) < 0) rc = FS_ERR_IO;
+        for (int64_t off = 0, end; rc == 0 && off < st.st_size; off = end) {
+            off = next_data(fds[0], off, st.st_size, &end);
+            if (off >= st.st_size) break;
+            if (lseek(fds[0], off, SEEK_SET) < 0 || image_in(fds[0], off, end - off, buf) < 0) rc = FS_ERR_IO;
+        }
+        for (int i = 1; i < count && rc == 0; ++i) {
+            if (apply_incremental(fds[i], &m[i], buf) < 0) rc = FS_ERR_IO;
+        }
+        if (rc == 0 && count > 1 && journal_wipe(st.st_size) < 0) rc = FS_ERR_IO;
+        if (mount_image() < 0 && rc == 0) rc = FS_ERR_CORRUPT;
+        if (rc == 0 && count > 1) {
+            // Blocks the incremental backups freed still hold old data
+            for (int64_t b = 0, run = -1; b <= BLOCK_COUNT; ++b) {
+                if (b < BLOCK_COUNT && block_refs[b] == 0) {
+                    if (run < 0) run = b;
+                } else if (run >= 0) {
+                    punch_hole(block_offset(run), (b - run) * BLOCK_SIZE);
+                    run = -1;
+                }
+            }
+        }
+        sync_disk();
+        // Later incremental backups build on the last one applied
+        backup_base = rc == 0 ? m[count - 1].id : 0;
+        cbt_mark_open();
     }
-    if (lseek(disk_fd, file->start + offset, SEEK_SET) < 0) {
-        printf("Okuma hatası (konumlanamadı)\n");
-        log_operation("fs_read", filename, -1);
-        return -1;
+    for (int i = 0; i < opened; ++i) {
+        if (fds[i] >= 0) close(fds[i]);
     }
-    ssize_t bytes = read(disk_fd, buffer, size);
-    if (bytes < 0) {
-        printf("Disk okuma hatası\n");
-        log_operation("fs_read", filename, -1);
-        return -1;
+    free(m);
+    free(fds);
+    free(buf);
+    if (rc < 0) {
+        return fail("fs_restore", last, rc);
     }
-    buffer[bytes] = '\0';
-    printf("Dosyadan okunan veri (%d bayt): \"%.*s\"\n", (int)bytes, (int)bytes, buffer);
-    log_operation("fs_read", filename, 0);
-    return bytes;
+    log_operation("fs_restore", last, 0);
+    return 0;
 }
 
-// List files in the filesystem
-int fs_ls() {
-    if (fs.file_count == 0) {
-        printf("Dosya sistemi boş.\n");
-    } else {
-        printf("Dosya Listesi (%d dosya):\n", fs.file_count);
-        printf("%-20s %10s %20s\n", "Dosya Adı", "Boyut", "Oluşturulma Tarihi");
-        printf("------------------------------------------------------------\n");
-        for (int i = 0; i < fs.file_count; ++i) {
-            struct FileEntry *f = &fs.files[i];
-            printf("%-20s %10d %20s\n", f->name, f->size, f->created);
-        }
-    }
-    log_operation("fs_ls", NULL, 0);
-    return fs.file_count;
+int fs_restore(const char *backup_filename) {
+    return fs_restore_chain(&backup_filename, 1);
 }
 
-// Rename a file
-int fs_rename(const char *oldname, const char *newname) {
-    if (!oldname || !newname || strlen(newname) == 0) {
-        printf("Hatalı dosya adı.\n");
-        log_operation("fs_rename", oldname, -1);
-        return -1;
-    }
-    int idx = find_file_index(oldname);
-    if (idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", oldname);
-        log_operation("fs_rename", oldname, -1);
-        return -1;
-    }
-    if (find_file_index(newname) != -1) {
-        printf("Hata: '%s' ismi zaten kullanılıyor.\n", newname);
-        log_operation("fs_rename", oldname, -1);
-        return -1;
+int fs_restore_chain(const char *const *backup_filenames, int count) {
+    lock_all_files(true);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_restore_locked(backup_filenames, count);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    return rc;
+}
+
+// Copy one contiguous piece of a file to the descriptor in ctx
+static int span_print(int64_t disk_off, int64_t file_off, int64_t len, void *ctx) {
+    int out_fd = *(int *)ctx;
+    (void)file_off;
+    const unsigned char *view = disk_view(disk_off);
+    if (view) {
+        // Mapped: hand the whole piece over in one call
+        return write_all(out_fd, view, len);
     }
-    strncpy(fs.files[idx].name, newname, MAX_FILENAME_LEN - 1);
-    fs.files[idx].name[MAX_FILENAME_LEN - 1] = '\0';
-    if (save_metadata() < 0) {
-        printf("Yeniden adlandırma hatası (metadata)\n");
-        log_operation("fs_rename", oldname, -1);
-        return -1;
+    char buffer[4096];
+    int64_t done = 0;
+    while (done < len) {
+        size_t to_read = len - done < (int64_t)sizeof(buffer) ? (size_t)(len - done) : sizeof(buffer);
+        ssize_t bytes = data_read_at(buffer, to_read, disk_off + done);
+        if (bytes <= 0 || write_all(out_fd, buffer, bytes) < 0) return -1;
+        done += bytes;
     }
-    printf("Dosya '%s' yeni adı '%s' olarak değiştirildi.\n", oldname, newname);
-    log_operation("fs_rename", oldname, 0);
     return 0;
 }
 
-// Check if file exists
-bool fs_exists(const char *filename) {
-    bool exists = (find_file_index(filename) != -1);
-    printf("Dosya '%s' %s\n", filename, exists ? "mevcut." : "mevcut değil.");
-    log_operation("fs_exists", filename, exists ? 0 : -1);
-    return exists;
-}
-
-// Get size of a file
-int fs_size(const char *filename) {
-    int idx = find_file_index(filename);
-    if (idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", filename);
-        log_operation("fs_size", filename, -1);
-        return -1;
+// Write the whole of compressed file idx to out_fd, decompressed a chunk
+// at a time
+static int packed_out(int idx, int out_fd) {
+    int64_t size = fs.files[idx].size;
+    char *buf = malloc(STREAM_CHUNK);
+    int rc = buf ? 0 : -1;
+    for (int64_t done = 0; rc == 0 && done < size; ) {
+        int64_t n = size - done < STREAM_CHUNK ? size - done : STREAM_CHUNK;
+        rc = packed_read(idx, done, n, buf, false) < 0 || write_all(out_fd, buf, n) < 0 ? -1 : 0;
+        done += n;
     }
-    printf("Dosya '%s' boyutu: %d bayt\n", filename, fs.files[idx].size);
-    log_operation("fs_size", filename, 0);
-    return fs.files[idx].size;
+    free(buf);
+    return rc;
 }
 
-// Truncate a file to a smaller size
-int fs_truncate(const char *filename, int new_size) {
-    if (new_size < 0) {
-        printf("Hatalı boyut.\n");
-        log_operation("fs_truncate", filename, -1);
-        return -1;
-    }
+// Write a file's whole content to out_fd; returns the bytes written
+static int64_t fs_cat_locked(const char *filename, int out_fd) {
     int idx = find_file_index(filename);
     if (idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", filename);
-        log_operation("fs_truncate", filename, -1);
-        return -1;
+        return fail("fs_cat", filename, FS_ERR_NOT_FOUND);
     }
     struct FileEntry *file = &fs.files[idx];
-    if (new_size > file->size) {
-        printf("Hata: Yeni boyut mevcut boyuttan büyük (fs_append kullanın).\n");
-        log_operation("fs_truncate", filename, -1);
-        return -1;
+    int rc = 0;
+    if (file->size > 0) {
+        rc = file->flags & FILE_COMPRESSED ? packed_out(idx, out_fd)
+                                           : file_for_each_span(idx, 0, file->size, span_print, &out_fd);
     }
-    if (new_size == file->size) {
-        printf("Dosya zaten %d bayt.\n", new_size);
-        log_operation("fs_truncate", filename, 0);
-        return 0;
+    if (rc < 0) {
+        return fail("fs_cat", filename, FS_ERR_IO);
     }
-    if (new_size == 0) {
-        file->size = 0;
-        file->start = -1;
-        save_metadata();
-        printf("Dosya '%s' boyutu sıfırlandı.\n", filename);
-        log_operation("fs_truncate", filename, 0);
+    log_operation("fs_cat", filename, 0);
+    return file->size;
+}
+
+int64_t fs_cat(const char *filename, int out_fd) {
+    lock_names(filename, false, NULL, false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int64_t rc = fs_cat_locked(filename, out_fd);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(filename, NULL);
+    return rc;
+}
+
+// Transfer between a host file and the image for fs_import/fs_export. An
+// import reads the host file at the file offsets; an export writes it
+// sequentially, so it may also be a pipe.
+struct HostIo {
+    int fd;
+    bool import;      // host -> image
+    bool no_offload;  // copy_file_range refused; stage through buf
+    char *buf;        // STREAM_CHUNK bytes, allocated on first use
+};
+
+// Let the kernel move up to len bytes between the two descriptors (a NULL
+// offset means the descriptor's position); returns the bytes moved, or -1
+// with errno set
+static ssize_t copy_range(int in_fd, int64_t *in_off, int out_fd, int64_t *out_off, int64_t len) {
+#ifdef SYS_copy_file_range
+    return syscall(SYS_copy_file_range, in_fd, in_off, out_fd, out_off, (size_t)len, 0);
+#else
+    (void)in_fd, (void)in_off, (void)out_fd, (void)out_off, (void)len;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Move one contiguous piece of a file between the image and the host file:
+// in place on the mapping, with copy_file_range on the descriptor backends
+// (the data never enters user memory), or through the staging buffer
+static int span_host(int64_t disk_off, int64_t file_off, int64_t len, void *ctx) {
+    struct HostIo *io = ctx;
+    if (io->import) mark_changed(disk_off, len);
+    if (disk_map) {
+        for (int64_t done = 0; done < len; ) {
+            ssize_t n = io->import ? pread(io->fd, disk_map + disk_off + done, len - done, file_off + done)
+                                   : write(io->fd, disk_map + disk_off + done, len - done);
+            if (n <= 0) return -1;
+            done += n;
+        }
         return 0;
     }
-    file->size = new_size;
-    if (save_metadata() < 0) {
-        printf("Boyut kısaltma hatası (metadata)\n");
-        log_operation("fs_truncate", filename, -1);
-        return -1;
+    // Cached copies of these blocks: written back for an export, dropped
+    // for an import so they cannot land on top of the new data
+    if (cache_settle(disk_fd, disk_off, len, io->import) < 0) return -1;
+    int64_t done = 0;
+    while (done < len && !io->no_offload) {
+        int64_t disk_pos = disk_off + done, host_pos = file_off + done;
+        ssize_t n = io->import ? copy_range(io->fd, &host_pos, disk_fd, &disk_pos, len - done)
+                               : copy_range(disk_fd, &disk_pos, io->fd, NULL, len - done);
+        if (n > 0) {
+            done += n;
+        } else if (n == 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP ||
+                   errno == EBADF) {
+            io->no_offload = true;  // e.g. a pipe, or a kernel or file system without support
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (done < len && !io->buf && !(io->buf = malloc(STREAM_CHUNK))) return -1;
+    while (done < len) {
+        size_t n = len - done < STREAM_CHUNK ? (size_t)(len - done) : STREAM_CHUNK;
+        if (io->import) {
+            ssize_t got = pread(io->fd, io->buf, n, file_off + done);
+            if (got <= 0 || disk_write_at(io->buf, got, disk_off + done) != got) return -1;
+            n = got;
+        } else {
+            if (disk_read_at(io->buf, n, disk_off + done) != (ssize_t)n || write_all(io->fd, io->buf, n) < 0) {
+                return -1;
+            }
+        }
+        done += n;
     }
-    printf("Dosya '%s' boyutu %d bayta kısaltıldı.\n", filename, new_size);
-    log_operation("fs_truncate", filename, 0);
     return 0;
 }
 
-// Copy a file to a new file
-int fs_copy(const char *src_filename, const char *dest_filename) {
-    if (!src_filename || !dest_filename) {
-        printf("Hatalı parametre.\n");
-        log_operation("fs_copy", src_filename, -1);
-        return -1;
+// Create file filename holding the contents of the host file: its blocks
+// are allocated up front, then filled straight from the host file without
+// meta_lock, so files larger than memory load at disk speed
+int fs_import(const char *host_filename, const char *filename) {
+    if (!host_filename || !filename) {
+        return fail("fs_import", filename, FS_ERR_INVALID);
     }
-    int src_idx = find_file_index(src_filename);
-    if (src_idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", src_filename);
-        log_operation("fs_copy", src_filename, -1);
-        return -1;
+    int host_fd = open(host_filename, O_RDONLY);
+    if (host_fd < 0) {
+        return fail("fs_import", filename, FS_ERR_IO);
     }
-    if (find_file_index(dest_filename) != -1) {
-        printf("Hata: '%s' adı zaten kullanılıyor.\n", dest_filename);
-        log_operation("fs_copy", src_filename, -1);
-        return -1;
+    struct stat st;
+    if (fstat(host_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(host_fd);
+        return fail("fs_import", filename, FS_ERR_INVALID);
     }
-    // Create destination file
-    if (fs_create(dest_filename) != 0) {
-        return -1;
+    int64_t size = st.st_size;
+    lock_names(filename, true, NULL, false);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = fs_create_locked(filename);
+    if (rc < 0) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        close(host_fd);
+        return fail("fs_import", filename, rc);
     }
-    int dest_idx = find_file_index(dest_filename);
-    if (dest_idx == -1) {
-        printf("Kopyalama hatası: hedef oluşturulamadı.\n");
-        log_operation("fs_copy", src_filename, -1);
-        return -1;
+    int idx = find_file_index(filename);
+    struct FileMap map = { NULL, 0 };
+    if (file_reserve(idx, size) < 0 || map_snapshot(idx, &map) < 0) {
+        fs_delete_locked(filename);
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        close(host_fd);
+        free(map.extents);
+        return fail("fs_import", filename, FS_ERR_NO_SPACE);
     }
-    struct FileEntry *src = &fs.files[src_idx];
-    struct FileEntry *dest = &fs.files[dest_idx];
-    if (src->size == 0) {
-        // Source is empty, nothing to copy
-        dest->size = 0;
-        dest->start = -1;
-        save_metadata();
-        printf("Boş dosya kopyalandı: '%s' oluşturuldu (0 bayt)\n", dest_filename);
-        log_operation("fs_copy", src_filename, 0);
-        return 0;
+    pthread_rwlock_unlock(&meta_lock);
+    struct HostIo io = { host_fd, true, false, NULL };
+    rc = size > 0 ? chain_for_each_span(map.extents, map.count ? 0 : EXTENT_NONE, 0, size, span_host, &io) : 0;
+    // The data never passed through memory here: checksum it from the image
+    uint32_t *crcs = rc < 0 ? NULL : map_crcs(&map, 0, size, NULL);
+    free(io.buf);
+    free(map.extents);
+    close(host_fd);
+    pthread_rwlock_wrlock(&meta_lock);
+    if (!crcs || file_store_crcs(find_file_index(filename), 0, size, crcs, false) < 0) rc = -1;
+    free(crcs);
+    if (rc < 0) {
+        fs_delete_locked(filename);
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        return fail("fs_import", filename, FS_ERR_IO);
     }
-    // Allocate buffer and copy data
-    char *buf = (char*) malloc(src->size);
-    if (!buf) {
-        printf("Bellek yetersiz.\n");
-        fs_delete(dest_filename);
-        log_operation("fs_copy", src_filename, -1);
-        return -1;
+    idx = find_file_index(filename);
+    defrag_cancel(idx);
+    fs.files[idx].size = size;
+    mark_entry_dirty(idx);
+    rc = save_metadata();
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(filename, NULL);
+    if (rc < 0) {
+        return fail("fs_import", filename, FS_ERR_IO);
     }
-    if (lseek(disk_fd, src->start, SEEK_SET) < 0) {
-        printf("Kopyalama hatası (kaynak okunamadı)\n");
-        free(buf);
-        fs_delete(dest_filename);
-        log_operation("fs_copy", src_filename, -1);
-        return -1;
+    log_operation("fs_import", filename, 0);
+    return 0;
+}
+
+// Write the contents of file filename to the host file (created or
+// replaced, or a FIFO); returns the bytes written. The file stays readable meanwhile.
+int64_t fs_export(const char *filename, const char *host_filename) {
+    if (!filename || !host_filename) {
+        return fail("fs_export", filename, FS_ERR_INVALID);
     }
-    if (read(disk_fd, buf, src->size) != src->size) {
-        printf("Kopyalama hatası (kaynak okuma)\n");
-        free(buf);
-        fs_delete(dest_filename);
-        log_operation("fs_copy", src_filename, -1);
-        return -1;
+    lock_names(filename, false, NULL, false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int idx = find_file_index(filename);
+    if (idx == -1) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        return fail("fs_export", filename, FS_ERR_NOT_FOUND);
     }
-    if (fs_write(dest_filename, buf, src->size) < 0) {
-        printf("Kopyalama hatası (hedef yazma)\n");
-        free(buf);
-        fs_delete(dest_filename);
-        // fs_write logs failure
-        return -1;
+    int64_t size = fs.files[idx].size;
+    // A compressed file is decompressed under meta_lock, as fs_cat does
+    bool packed = fs.files[idx].flags & FILE_COMPRESSED;
+    struct FileMap map = { NULL, 0 };
+    if (!packed && map_snapshot(idx, &map) < 0) {
+        pthread_rwlock_unlock(&meta_lock);
+        unlock_names(filename, NULL);
+        return fail("fs_export", filename, FS_ERR_NO_MEMORY);
     }
-    free(buf);
-    printf("Dosya '%s' kopyası oluşturuldu -> '%s'\n", src_filename, dest_filename);
-    log_operation("fs_copy", src_filename, 0);
-    return 0;
+    if (!packed) pthread_rwlock_unlock(&meta_lock);
+    int rc = -1;
+    int host_fd = open(host_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (host_fd >= 0) {
+        struct HostIo io = { host_fd, false, false, NULL };
+        if (packed) {
+            rc = packed_out(idx, host_fd);
+        } else {
+            rc = size > 0 ? chain_for_each_span(map.extents, map.count ? 0 : EXTENT_NONE, 0, size, span_host, &io) : 0;
+        }
+        free(io.buf);
+        if (close(host_fd) < 0) rc = -1;
+    }
+    if (packed) pthread_rwlock_unlock(&meta_lock);
+    free(map.extents);
+    unlock_names(filename, NULL);
+    if (rc < 0) {
+        return fail("fs_export", filename, FS_ERR_IO);
+    }
+    log_operation("fs_export", filename, 0);
+    return size;
 }
 
-// Move (rename) a file
-int fs_mv(const char *src_filename, const char *dest_filename) {
-    if (strchr(dest_filename, '/') != NULL) {
-        printf("Hata: Dizin desteği yok.\n");
-        log_operation("fs_mv", src_filename, -1);
-        return -1;
+// Length of the common prefix of a and b (n if they are equal), 64 bytes
+// per step with SSE2 compares
+static int64_t mismatch(const unsigned char *a, const unsigned char *b, int64_t n) {
+    int64_t i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= n; i += 64) {
+        __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 16)),
+                                    _mm_loadu_si128((const __m128i *)(b + i + 16)));
+        __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 32)),
+                                    _mm_loadu_si128((const __m128i *)(b + i + 32)));
+        __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 48)),
+                                    _mm_loadu_si128((const __m128i *)(b + i + 48)));
+        __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+        if (_mm_movemask_epi8(all) != 0xFFFF) break;  // the scalar loop finds the byte
     }
-    int result = fs_rename(src_filename, dest_filename);
-    // fs_rename already logs and prints result
-    return result;
+#endif
+    while (i < n && a[i] == b[i]) i++;
+    return i;
 }
 
-// Defragment the disk (consolidate free space)
-int fs_defragment() {
-    if (fs.file_count == 0) {
-        printf("Diskte dosya yok.\n");
-        log_operation("fs_defragment", NULL, 0);
+// Compare two files: 0 if equal, 1 if not. *first_diff gets the offset of
+// the first differing byte, or -1 when the files are equal or only their
+// sizes differ.
+static int fs_diff_locked(const char *file1, const char *file2, int64_t *first_diff) {
+    *first_diff = -1;
+    int idx1 = find_file_index(file1);
+    int idx2 = find_file_index(file2);
+    if (idx1 == -1 || idx2 == -1) {
+        return fail("fs_diff", idx1 == -1 ? file1 : file2, FS_ERR_NOT_FOUND);
+    }
+    struct FileEntry *f1 = &fs.files[idx1];
+    struct FileEntry *f2 = &fs.files[idx2];
+    if (f1->size != f2->size) {
+        log_operation("fs_diff", file1, 0);
+        return 1;
+    }
+    if (f1->size == 0 && f2->size == 0) {
+        log_operation("fs_diff", file1, 0);
         return 0;
     }
-    // Sort files by current start (move 0-size entries to end)
-    for (int i = 0; i < fs.file_count - 1; ++i) {
-        for (int j = 0; j < fs.file_count - 1 - i; ++j) {
-            if (fs.files[j].size > 0 && fs.files[j+1].size > 0) {
-                if (fs.files[j].start > fs.files[j+1].start) {
-                    struct FileEntry temp = fs.files[j];
-                    fs.files[j] = fs.files[j+1];
-                    fs.files[j+1] = temp;
-                }
-            } else if (fs.files[j].size == 0 && fs.files[j+1].size > 0) {
-                struct FileEntry temp = fs.files[j];
-                fs.files[j] = fs.files[j+1];
-                fs.files[j+1] = temp;
+    // Walk both files a contiguous piece at a time: compared in place on the
+    // mapping, or staged through two chunk buffers (always, when one is
+    // compressed)
+    bool packed = (f1->flags | f2->flags) & FILE_COMPRESSED;
+    unsigned char *buf1 = NULL, *buf2 = NULL;
+    if (!disk_map || packed) {
+        buf1 = malloc(COPY_CHUNK);
+        buf2 = malloc(COPY_CHUNK);
+        if (!buf1 || !buf2) {
+            free(buf1);
+            free(buf2);
+            return fail("fs_diff", file1, FS_ERR_NO_MEMORY);
+        }
+    }
+    int diff_found = 0;
+    int64_t pos = 0;
+    while (pos < f1->size && !diff_found) {
+        int64_t n = f1->size - pos;
+        const unsigned char *p1, *p2;
+        if (packed) {
+            if (n > COPY_CHUNK) n = COPY_CHUNK;
+            if (file_read_data(idx1, pos, buf1, n) < 0 || file_read_data(idx2, pos, buf2, n) < 0) break;
+            p1 = buf1;
+            p2 = buf2;
+        } else {
+            int64_t run1, run2;
+            int64_t off1 = file_locate(idx1, pos, &run1);
+            int64_t off2 = file_locate(idx2, pos, &run2);
+            if (off1 < 0 || off2 < 0) break;
+            if (run1 < n) n = run1;
+            if (run2 < n) n = run2;
+            p1 = disk_view(off1);
+            p2 = disk_view(off2);
+            if (!p1 || !p2) {
+                if (n > COPY_CHUNK) n = COPY_CHUNK;
+                if (data_read_at(buf1, n, off1) != n || data_read_at(buf2, n, off2) != n) break;
+                p1 = buf1;
+                p2 = buf2;
             }
         }
+        int64_t same = mismatch(p1, p2, n);
+        if (same < n) {
+            *first_diff = pos + same;
+            diff_found = 1;
+        }
+        pos += n;
     }
-    // Copy all file data to a new arrangement
-    char *old_data = (char*) malloc(DATA_SIZE);
-    if (!old_data) {
-        printf("Bellek yetersiz, birleştirme yapılamadı.\n");
-        log_operation("fs_defragment", NULL, -1);
-        return -1;
+    free(buf1);
+    free(buf2);
+    if (!diff_found && pos < f1->size) {
+        return fail("fs_diff", file1, FS_ERR_IO);  // a read failed
     }
-    lseek(disk_fd, META_SIZE, SEEK_SET);
-    read(disk_fd, old_data, DATA_SIZE);
-    char *new_data = (char*) malloc(DATA_SIZE);
-    if (!new_data) {
-        printf("Bellek yetersiz, birleştirme yapılamadı.\n");
-        free(old_data);
-        log_operation("fs_defragment", NULL, -1);
-        return -1;
+    log_operation("fs_diff", file1, 0);
+    return diff_found ? 1 : 0;
+}
+
+int fs_diff(const char *file1, const char *file2, int64_t *first_diff) {
+    int64_t where;
+    lock_names(file1, false, file2, false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int rc = fs_diff_locked(file1, file2, first_diff ? first_diff : &where);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(file1, file2);
+    return rc;
+}
+
+// ---- delta ----
+//
+// fs_delta describes the new file in terms of the old one, rsync style:
+// every full block of the old file gets a weak rolling checksum and a
+// CRC32C; a window of the same size slides over the new file a byte at a
+// time, its weak checksum updated in O(1), and where both checksums match
+// a block (and the bytes agree) the match is grown in both directions with
+// SIMD compares. Where the last match left off is tried first, once per
+// block, so an edit that keeps the length resynchronizes without hashing
+// and identical stretches are compared rather than hashed.
+
+// Buffered random access to a file's bytes
+struct DeltaFile {
+    int idx;
+    int64_t size;
+    unsigned char *buf;  // STREAM_CHUNK bytes
+    int64_t base, len;   // file range held in buf
+};
+
+// Bytes [off, off+n) of the file (n at most STREAM_CHUNK and inside the
+// file); valid until the next call for the same file
+static const unsigned char *delta_bytes(struct DeltaFile *f, int64_t off, int64_t n) {
+    if (off < f->base || off + n > f->base + f->len) {
+        f->len = f->size - off < STREAM_CHUNK ? f->size - off : STREAM_CHUNK;
+        f->base = off;
+        if (file_read_data(f->idx, off, f->buf, f->len) < 0) {
+            f->len = 0;
+            return NULL;
+        }
     }
-    memset(new_data, 0, DATA_SIZE);
-    int current_offset = 0;
-    for (int i = 0; i < fs.file_count; ++i) {
-        if (fs.files[i].size <= 0) continue;
-        int old_off = fs.files[i].start - META_SIZE;
-        memmove(new_data + current_offset, old_data + old_off, fs.files[i].size);
-        fs.files[i].start = META_SIZE + current_offset;
-        current_offset += fs.files[i].size;
-    }
-    // Write rearranged data back to disk
-    lseek(disk_fd, META_SIZE, SEEK_SET);
-    write(disk_fd, new_data, DATA_SIZE);
-    fsync(disk_fd);
-    free(old_data);
-    free(new_data);
-    save_metadata();
-    printf("Disk birleştirme tamamlandı.\n");
-    log_operation("fs_defragment", NULL, 0);
-    return 0;
+    return f->buf + (off - f->base);
 }
 
-// Check file system integrity
-int fs_check_integrity() {
-    int issues = 0;
-    // Check file count
-    if (fs.file_count < 0 || fs.file_count > MAX_FILES) {
-        printf("Hata: Dosya sayısı uyumsuz: %d\n", fs.file_count);
-        issues++;
+// Signature of one block of the old file, in an open-addressing table
+// keyed by the weak checksum
+struct DeltaSig {
+    uint32_t weak;
+    uint32_t crc;
+    int64_t block;  // -1 = empty slot
+};
+
+// Rolling checksum of rsync: a = sum of the bytes, b = sum of the bytes
+// weighted by their distance from the window's end, both mod 2^16
+static uint32_t weak_sum(const unsigned char *p, int64_t n, uint32_t *a_out, uint32_t *b_out) {
+    uint32_t a = 0, b = 0;
+    for (int64_t i = 0; i < n; ++i) {
+        a += p[i];
+        b += (uint32_t)(n - i) * p[i];
     }
-    // Check duplicate names
-    for (int i = 0; i < fs.file_count; ++i) {
-        for (int j = i+1; j < fs.file_count; ++j) {
-            if (strcmp(fs.files[i].name, fs.files[j].name) == 0) {
-                printf("Hata: Birden fazla dosya '%s' ismine sahip.\n", fs.files[i].name);
-                issues++;
-            }
+    *a_out = a & 0xFFFF;
+    *b_out = b & 0xFFFF;
+    return *a_out | *b_out << 16;
+}
+
+static uint32_t sig_slot(uint32_t weak, uint32_t mask) {
+    return (weak * 2654435761u) & mask;
+}
+
+// The ranges found so far (the first max of them stored); a range that
+// continues the one before merges with it
+struct DeltaOut {
+    struct FsDeltaRange *ranges;
+    int max;
+    int count;
+    struct FsDeltaRange last;
+    int64_t copied, literal;
+};
+
+static void delta_emit(struct DeltaOut *o, enum FsDeltaType type, int64_t new_off, int64_t old_off, int64_t len) {
+    if (len <= 0) return;
+    if (type == FS_DELTA_COPY) o->copied += len;
+    else o->literal += len;
+    struct FsDeltaRange *last = &o->last;
+    if (o->count > 0 && last->type == type && last->new_off + last->len == new_off &&
+        (type == FS_DELTA_DATA || last->old_off + last->len == old_off)) {
+        last->len += len;
+    } else {
+        struct FsDeltaRange r = { type, new_off, type == FS_DELTA_COPY ? old_off : 0, len };
+        *last = r;
+        o->count++;
+    }
+    if (o->count <= o->max) o->ranges[o->count - 1] = *last;
+}
+
+// Checksum every full block of the old file into a table of 2^k slots
+static struct DeltaSig *delta_signatures(struct DeltaFile *old, int64_t block, uint32_t *mask) {
+    int64_t count = old->size / block;
+    uint32_t slots = 1;
+    while (slots < 2 * count) slots <<= 1;
+    struct DeltaSig *sigs = malloc(slots * sizeof(*sigs));
+    if (!sigs) return NULL;
+    for (uint32_t i = 0; i < slots; ++i) {
+        sigs[i].block = -1;
+    }
+    *mask = slots - 1;
+    for (int64_t k = 0; k < count; ++k) {
+        const unsigned char *p = delta_bytes(old, k * block, block);
+        if (!p) {
+            free(sigs);
+            return NULL;
         }
+        uint32_t a, b;
+        uint32_t weak = weak_sum(p, block, &a, &b);
+        uint32_t i = sig_slot(weak, *mask);
+        while (sigs[i].block >= 0) i = (i + 1) & *mask;
+        sigs[i].weak = weak;
+        sigs[i].crc = crc32c(0, p, block);
+        sigs[i].block = k;
     }
-    // Sort by start for overlap check
-    for (int i = 0; i < fs.file_count - 1; ++i) {
-        for (int j = 0; j < fs.file_count - 1 - i; ++j) {
-            if (fs.files[j].start > fs.files[j+1].start) {
-                struct FileEntry temp = fs.files[j];
-                fs.files[j] = fs.files[j+1];
-                fs.files[j+1] = temp;
-            }
+    return sigs;
+}
+
+// Old-file offset of a block equal to the new file's window at pos, or -1;
+// any window of new already buffered stays valid
+static int64_t delta_lookup(const struct DeltaSig *sigs, uint32_t mask, uint32_t weak, struct DeltaFile *old,
+                            struct DeltaFile *new, int64_t pos, int64_t block) {
+    uint32_t crc = 0;
+    bool have_crc = false;
+    for (uint32_t i = sig_slot(weak, mask); sigs[i].block >= 0; i = (i + 1) & mask) {
+        if (sigs[i].weak != weak) continue;
+        const unsigned char *p = delta_bytes(new, pos, block);
+        if (!p) return -1;
+        if (!have_crc) {
+            crc = crc32c(0, p, block);
+            have_crc = true;
         }
+        if (sigs[i].crc != crc) continue;
+        const unsigned char *q = delta_bytes(old, sigs[i].block * block, block);
+        if (q && mismatch(p, q, block) == block) return sigs[i].block * block;
     }
-    // Check each file
-    for (int i = 0; i < fs.file_count; ++i) {
-        struct FileEntry *f = &fs.files[i];
-        if (f->size < 0) {
-            printf("Hata: '%s' dosyası için negatif boyut.\n", f->name);
-            issues++;
+    return -1;
+}
+
+static int fs_delta_locked(const char *old_filename, const char *new_filename, int64_t block,
+                           struct FsDeltaRange *ranges, int max, struct FsDeltaStats *stats) {
+    if (!old_filename || !new_filename || block < 0 || max < 0 || (max > 0 && !ranges)) {
+        return fail("fs_delta", new_filename, FS_ERR_INVALID);
+    }
+    int old_idx = find_file_index(old_filename);
+    int new_idx = find_file_index(new_filename);
+    if (old_idx == -1 || new_idx == -1) {
+        return fail("fs_delta", old_idx == -1 ? old_filename : new_filename, FS_ERR_NOT_FOUND);
+    }
+    struct DeltaFile old = { old_idx, fs.files[old_idx].size, malloc(STREAM_CHUNK), 0, 0 };
+    struct DeltaFile new = { new_idx, fs.files[new_idx].size, malloc(STREAM_CHUNK), 0, 0 };
+    if (block == 0) {
+        for (block = DELTA_MIN_BLOCK; block < DELTA_MAX_BLOCK && block * block < old.size; block *= 2) {}
+    }
+    if (block > DELTA_MAX_BLOCK) block = DELTA_MAX_BLOCK;
+    uint32_t mask = 0;
+    struct DeltaSig *sigs = old.buf && new.buf ? delta_signatures(&old, block, &mask) : NULL;
+    if (!sigs) {
+        free(old.buf);
+        free(new.buf);
+        return fail("fs_delta", new_filename, old.buf && new.buf ? FS_ERR_IO : FS_ERR_NO_MEMORY);
+    }
+    struct DeltaOut out;
+    memset(&out, 0, sizeof(out));
+    out.ranges = ranges;
+    out.max = max;
+    int64_t pos = 0, literal_start = 0;
+    int64_t hint_pos = 0, hint_old = 0;  // the old file lines up with pos at hint_old + (pos - hint_pos)
+    uint32_t a = 0, b = 0;
+    bool rolling = false;
+    int rc = 0;
+    while (pos < new.size && rc == 0) {
+        int64_t match = -1;
+        const unsigned char *p, *q;
+        // Where the previous match would continue, once per block; a run
+        // shorter than a block will do here
+        int64_t guess = hint_old + (pos - hint_pos);
+        if ((pos - hint_pos) % block == 0 && guess < old.size) {
+            int64_t n = block;
+            if (n > new.size - pos) n = new.size - pos;
+            if (n > old.size - guess) n = old.size - guess;
+            p = delta_bytes(&new, pos, n);
+            q = delta_bytes(&old, guess, n);
+            if (!p || !q) break;
+            int64_t same = mismatch(p, q, n);
+            if (same == n || same >= DELTA_MIN_MATCH) match = guess;
+        }
+        if (match < 0 && pos + block <= new.size) {
+            // Look up every window up to the next guess in one sweep
+            int64_t stop = pos + block - (pos - hint_pos) % block;
+            if (stop > new.size - block + 1) stop = new.size - block + 1;
+            int64_t start = pos;
+            const unsigned char *w = delta_bytes(&new, start, stop - start - 1 + block);
+            if (!w) break;
+            if (!rolling) weak_sum(w, block, &a, &b);
+            rolling = true;
+            for (;;) {
+                match = delta_lookup(sigs, mask, a | b << 16, &old, &new, pos, block);
+                if (match >= 0 || pos + 1 == stop) break;
+                a = (a - w[pos - start] + w[pos - start + block]) & 0xFFFF;
+                b = (b - (uint32_t)block * w[pos - start] + a) & 0xFFFF;
+                pos++;
+            }
         }
-        if (f->size > 0) {
-            if (f->start < META_SIZE || f->start + f->size > DISK_SIZE) {
-                printf("Hata: '%s' dosyasının veri aralığı geçersiz.\n", f->name);
-                issues++;
+        if (match < 0) {
+            // Slide the window one byte: drop new[pos], take in new[pos+block]
+            if (rolling && pos + block < new.size) {
+                if (!(p = delta_bytes(&new, pos, block + 1))) break;
+                a = (a - p[0] + p[block]) & 0xFFFF;
+                b = (b - (uint32_t)block * p[0] + a) & 0xFFFF;
+            } else {
+                rolling = false;
             }
+            pos++;
+            continue;
         }
-        if (i < fs.file_count - 1 && f->size > 0 && fs.files[i+1].size > 0) {
-            if (f->start + f->size > fs.files[i+1].start) {
-                printf("Hata: '%s' ve '%s' dosyalarının verileri çakışıyor.\n", f->name, fs.files[i+1].name);
-                issues++;
+        // Grow the match back into the pending literal bytes...
+        int64_t back = pos - literal_start;
+        if (back > match) back = match;
+        if (back > STREAM_CHUNK / 2) back = STREAM_CHUNK / 2;
+        int64_t grown = 0;
+        if (back > 0) {
+            if (!(p = delta_bytes(&new, pos - back, back)) || !(q = delta_bytes(&old, match - back, back))) break;
+            while (grown < back && p[back - grown - 1] == q[back - grown - 1]) grown++;
+        }
+        // ...and forward, a buffer at a time
+        int64_t end = pos, old_end = match;
+        for (;;) {
+            int64_t n = STREAM_CHUNK / 2;
+            if (n > new.size - end) n = new.size - end;
+            if (n > old.size - old_end) n = old.size - old_end;
+            if (n == 0) break;
+            if (!(p = delta_bytes(&new, end, n)) || !(q = delta_bytes(&old, old_end, n))) {
+                rc = -1;
+                break;
             }
+            int64_t same = mismatch(p, q, n);
+            end += same;
+            old_end += same;
+            if (same < n) break;
         }
+        delta_emit(&out, FS_DELTA_DATA, literal_start, 0, pos - grown - literal_start);
+        delta_emit(&out, FS_DELTA_COPY, pos - grown, match - grown, end - pos + grown);
+        pos = literal_start = hint_pos = end;
+        hint_old = old_end;
+        rolling = false;
     }
-    if (issues == 0) {
-        printf("Dosya sistemi tutarlı.\n");
-    } else {
-        printf("Bütünlük kontrolü tamamlandı, sorun sayısı: %d\n", issues);
+    if (pos < new.size) rc = -1;  // a read failed
+    delta_emit(&out, FS_DELTA_DATA, literal_start, 0, new.size - literal_start);
+    free(sigs);
+    free(old.buf);
+    free(new.buf);
+    if (rc < 0) {
+        return fail("fs_delta", new_filename, FS_ERR_IO);
     }
-    log_operation("fs_check_integrity", NULL, issues == 0 ? 0 : -1);
-    return issues == 0 ? 0 : -1;
+    if (stats) {
+        stats->block_size = block;
+        stats->copied = out.copied;
+        stats->literal = out.literal;
+    }
+    log_operation("fs_delta", new_filename, 0);
+    return out.count;
 }
 
-// Backup the entire disk to a file
-int fs_backup(const char *backup_filename) {
-    if (!backup_filename || strlen(backup_filename) == 0) {
-        printf("Yedek dosya adı belirtilmedi.\n");
-        log_operation("fs_backup", backup_filename, -1);
-        return -1;
-    }
-    int backup_fd = open(backup_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (backup_fd < 0) {
-        printf("Yedek dosyası oluşturulamadı.\n");
-        log_operation("fs_backup", backup_filename, -1);
-        return -1;
+// Describe new_filename as ranges copied from old_filename and ranges of
+// its own (block_size 0 = chosen from the old file's size). Fills up to max
+// ranges and returns how many there are.
+int fs_delta(const char *old_filename, const char *new_filename, int64_t block_size,
+             struct FsDeltaRange *ranges, int max, struct FsDeltaStats *stats) {
+    lock_names(old_filename, false, new_filename, false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int rc = fs_delta_locked(old_filename, new_filename, block_size, ranges, max, stats);
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_names(old_filename, new_filename);
+    return rc;
+}
+
+// Write the operation log history to out_fd as text
+int fs_log(int out_fd) {
+    return oplog_dump(out_fd) < 0 ? FS_ERR_IO : FS_OK;
+}
+
+// Choose the log format (text or compact binary) and whether a background
+// thread writes the log out; takes effect immediately if the log is open
+int fs_set_log_options(enum LogFormat format, bool background) {
+    if (format != LOG_TEXT && format != LOG_BINARY) {
+        return FS_ERR_INVALID;
     }
-    if (lseek(disk_fd, 0, SEEK_SET) < 0) {
-        printf("Disk okunamadı.\n");
-        close(backup_fd);
-        log_operation("fs_backup", backup_filename, -1);
-        return -1;
+    log_format = format;
+    log_background = background;
+    if (disk_fd >= 0 &&
+        oplog_open(format == LOG_BINARY ? LOG_BINARY_NAME : LOG_NAME, format, background) < 0) {
+        return FS_ERR_IO;
     }
-    char buffer[4096];
-    ssize_t bytes;
-    size_t total = 0;
-    while ((bytes = read(disk_fd, buffer, sizeof(buffer))) > 0) {
-        write(backup_fd, buffer, bytes);
-        total += bytes;
-    }
-    close(backup_fd);
-    lseek(disk_fd, 0, SEEK_SET);
-    if (total != DISK_SIZE) {
-        printf("Yedekleme hatası: eksik veri kopyalandı (%zu/%d bayt)\n", total, DISK_SIZE);
-        log_operation("fs_backup", backup_filename, -1);
-        return -1;
+    return FS_OK;
+}
+
+// Select the placement policy used for new data extents
+int fs_set_alloc_policy(enum AllocPolicy policy) {
+    static const char *names[] = { "first-fit", "best-fit", "next-fit" };
+    if (policy < ALLOC_FIRST_FIT || policy > ALLOC_NEXT_FIT) {
+        return fail("fs_set_alloc_policy", NULL, FS_ERR_INVALID);
     }
-    printf("Disk yedeği '%s' dosyasına alındı (%zu bayt)\n", backup_filename, total);
-    log_operation("fs_backup", backup_filename, 0);
+    pthread_rwlock_wrlock(&meta_lock);
+    alloc_set_policy(policy);
+    pthread_rwlock_unlock(&meta_lock);
+    log_operation("fs_set_alloc_policy", names[policy], 0);
     return 0;
 }
 
-// Restore disk from a backup file
-int fs_restore(const char *backup_filename) {
-    if (!backup_filename || strlen(backup_filename) == 0) {
-        printf("Yedek dosya adı belirtilmedi.\n");
-        log_operation("fs_restore", backup_filename, -1);
-        return -1;
-    }
-    int backup_fd = open(backup_filename, O_RDONLY);
-    if (backup_fd < 0) {
-        printf("Yedek dosyası açılamadı.\n");
-        log_operation("fs_restore", backup_filename, -1);
-        return -1;
+// Select when writes are made durable: after every operation, at most every
+// interval_ms milliseconds (checked at operation boundaries), or only on close
+int fs_set_sync_policy(enum SyncPolicy policy, int interval_ms) {
+    if (policy < SYNC_ALWAYS || policy > SYNC_ON_CLOSE || interval_ms < 0) {
+        return fail("fs_set_sync_policy", NULL, FS_ERR_INVALID);
     }
-    if (lseek(disk_fd, 0, SEEK_SET) < 0) {
-        printf("Disk yazma hatası (konum)\n");
-        close(backup_fd);
-        log_operation("fs_restore", backup_filename, -1);
-        return -1;
-    }
-    char buffer[4096];
-    ssize_t bytes;
-    size_t total = 0;
-    while ((bytes = read(backup_fd, buffer, sizeof(buffer))) > 0) {
-        write(disk_fd, buffer, bytes);
-        total += bytes;
-    }
-    close(backup_fd);
-    ftruncate(disk_fd, DISK_SIZE);
-    fsync(disk_fd);
-    load_metadata();
-    printf("Disk '%s' yedeğinden geri yüklendi (%zu bayt)\n", backup_filename, total);
-    log_operation("fs_restore", backup_filename, 0);
+    pthread_rwlock_wrlock(&meta_lock);
+    pthread_mutex_lock(&journal.lock);
+    sync_policy = policy;
+    sync_interval_ms = interval_ms;
+    pthread_mutex_unlock(&journal.lock);
+    pthread_rwlock_unlock(&meta_lock);
+    log_operation("fs_set_sync_policy", NULL, 0);
     return 0;
 }
 
-// Print file content to console
-int fs_cat(const char *filename) {
-    int idx = find_file_index(filename);
-    if (idx == -1) {
-        printf("Hata: '%s' dosyası bulunamadı.\n", filename);
-        log_operation("fs_cat", filename, -1);
-        return -1;
-    }
-    struct FileEntry *file = &fs.files[idx];
-    if (file->size == 0) {
-        printf("(boş dosya)\n");
-        log_operation("fs_cat", filename, 0);
-        return 0;
+// Check the checksums of the blocks fs_read returns, failing the read with
+// FS_ERR_CORRUPT on a mismatch
+int fs_set_verify_reads(bool verify) {
+    pthread_rwlock_wrlock(&meta_lock);
+    verify_reads = verify;
+    pthread_rwlock_unlock(&meta_lock);
+    log_operation("fs_set_verify_reads", NULL, 0);
+    return 0;
+}
+
+// Store each block of written data once: a block that matches one already
+// in use (same checksum, then the same bytes) is mapped to it instead of
+// being written. Shared blocks are copied on write like those of fs_copy.
+// Turning it on indexes the blocks in use.
+int fs_set_dedup(bool enabled) {
+    lock_all_files(true);  // no write may be in flight while blocks are indexed
+    pthread_rwlock_wrlock(&meta_lock);
+    dedup_enabled = enabled;
+    int rc = disk_fd >= 0 ? dedup_rebuild() : 0;
+    if (rc < 0) dedup_enabled = false;
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    if (rc < 0) {
+        return fail("fs_set_dedup", NULL, FS_ERR_NO_MEMORY);
     }
-    if (lseek(disk_fd, file->start, SEEK_SET) < 0) {
-        printf("Disk okuma hatası (konum)\n");
-        log_operation("fs_cat", filename, -1);
-        return -1;
+    log_operation("fs_set_dedup", NULL, 0);
+    return 0;
+}
+
+// Report how much the files map against what is stored
+int fs_dedup_stats(struct FsDedupStats *stats) {
+    if (!stats) {
+        return fail("fs_dedup_stats", NULL, FS_ERR_INVALID);
     }
-    char buffer[256];
-    int bytes_left = file->size;
-    char last_char = '\0';
-    while (bytes_left > 0) {
-        int to_read = bytes_left < (int)sizeof(buffer) ? bytes_left : (int)sizeof(buffer);
-        int bytes = read(disk_fd, buffer, to_read);
-        if (bytes < 0) {
-            printf("Disk okuma hatası\n");
-            log_operation("fs_cat", filename, -1);
-            return -1;
-        }
-        if (bytes > 0) last_char = buffer[bytes-1];
-        write(1, buffer, bytes);
-        bytes_left -= bytes;
+    memset(stats, 0, sizeof(*stats));
+    pthread_rwlock_rdlock(&meta_lock);
+    stats->enabled = dedup_index != NULL;
+    stats->block_size = BLOCK_SIZE;
+    for (int i = 0; i < fs.file_count; ++i) {
+        if (!is_dir(&fs.files[i])) stats->logical_bytes += fs.files[i].size;
+        stats->mapped_blocks += file_blocks(&fs.files[i]);
     }
-    if (last_char != '\n') {
-        printf("\n");
+    for (int64_t b = 0; b < BLOCK_COUNT; ++b) {
+        if (block_refs[b] > 0) stats->stored_blocks++;
+        if (block_refs[b] > 1) stats->shared_blocks++;
     }
-    log_operation("fs_cat", filename, 0);
-    return file->size;
+    stats->dedup_blocks = dedup_hits;
+    pthread_rwlock_unlock(&meta_lock);
+    return 0;
 }
 
-// Compare two files
-int fs_diff(const char *file1, const char *file2) {
-    int idx1 = find_file_index(file1);
-    int idx2 = find_file_index(file2);
-    if (idx1 == -1 || idx2 == -1) {
-        if (idx1 == -1) printf("Hata: '%s' dosyası bulunamadı.\n", file1);
-        if (idx2 == -1) printf("Hata: '%s' dosyası bulunamadı.\n", file2);
-        log_operation("fs_diff", file1, -1);
-        return -1;
+// Store file filename compressed from now on (enabled), or plain again;
+// its current contents are converted
+int fs_set_compression(const char *filename, bool enabled) {
+    if (!filename) {
+        return fail("fs_set_compression", filename, FS_ERR_INVALID);
     }
-    struct FileEntry *f1 = &fs.files[idx1];
-    struct FileEntry *f2 = &fs.files[idx2];
-    if (f1->size != f2->size) {
-        printf("Dosyalar farklı: boyutları farklı (%d vs %d bayt)\n", f1->size, f2->size);
-        log_operation("fs_diff", file1, -1);
-        return 1;
+    lock_names(filename, true, NULL, false);
+    pthread_rwlock_rdlock(&meta_lock);
+    int idx = find_file_index(filename);
+    int rc = idx == -1 ? FS_ERR_NOT_FOUND : FS_OK;
+    bool convert = rc == FS_OK && ((fs.files[idx].flags & FILE_COMPRESSED) != 0) != enabled;
+    int64_t size = convert ? fs.files[idx].size : 0;
+    char *data = convert ? malloc(size > 0 ? size : 1) : NULL;
+    if (convert && !data) {
+        rc = FS_ERR_NO_MEMORY;
+    } else if (convert && file_read_data(idx, 0, data, size) < 0) {
+        rc = FS_ERR_IO;
     }
-    if (f1->size == 0 && f2->size == 0) {
-        printf("Dosyalar her ikisi de boş, aynıdır.\n");
-        log_operation("fs_diff", file1, 0);
-        return 0;
+    pthread_rwlock_unlock(&meta_lock);
+    if (convert && rc == FS_OK) rc = packed_update(filename, 0, data, size, enabled, false);
+    free(data);
+    unlock_names(filename, NULL);
+    if (rc < 0) {
+        return fail("fs_set_compression", filename, rc);
     }
-    char *buf1 = (char*) malloc(f1->size);
-    char *buf2 = (char*) malloc(f2->size);
-    if (!buf1 || !buf2) {
-        printf("Bellek yetersiz.\n");
-        free(buf1);
-        free(buf2);
-        log_operation("fs_diff", file1, -1);
-        return -1;
+    log_operation("fs_set_compression", filename, 0);
+    return 0;
+}
+
+// Set the memory budget of the block cache that serves file data on the fd
+// backend; 0 turns it off. Dirty cached blocks are written out first.
+int fs_set_cache_size(int64_t bytes) {
+    if (bytes < 0) {
+        return fail("fs_set_cache_size", NULL, FS_ERR_INVALID);
     }
-    lseek(disk_fd, f1->start, SEEK_SET);
-    read(disk_fd, buf1, f1->size);
-    lseek(disk_fd, f2->start, SEEK_SET);
-    read(disk_fd, buf2, f2->size);
-    int diff_found = 0;
-    for (int i = 0; i < f1->size; ++i) {
-        if (buf1[i] != buf2[i]) {
-            printf("Dosyalar farklı: ilk fark %d. baytta (0x%02X vs 0x%02X)\n",
-                   i, (unsigned char)buf1[i], (unsigned char)buf2[i]);
-            diff_found = 1;
-            break;
-        }
+    lock_all_files(true);
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = 0;
+    if (disk_fd >= 0) {
+        rc = cache_flush(disk_fd);
+        if (rc == 0) rc = cache_configure(META_SIZE, BLOCK_SIZE, io_mode == IO_FD ? bytes : 0);
     }
-    if (!diff_found) {
-        printf("Dosyalar aynıdır (içerikleri aynı).\n");
+    if (rc == 0) cache_budget = bytes;
+    pthread_rwlock_unlock(&meta_lock);
+    unlock_all_files();
+    if (rc < 0) {
+        return fail("fs_set_cache_size", NULL, FS_ERR_IO);
     }
-    free(buf1);
-    free(buf2);
-    log_operation("fs_diff", file1, diff_found ? -1 : 0);
-    return diff_found ? 1 : 0;
+    log_operation("fs_set_cache_size", NULL, 0);
+    return 0;
 }
 
-// Show operation log history
-int fs_log() {
-    fflush(stdout);
-    printf("\nİşlem Günlüğü:\n");
-    fflush(stdout);
-    int fd = open(log_filename, O_RDONLY);
-    if (fd < 0) {
-        printf("Log okunamadı.\n");
-        return -1;
-    }
-    char buffer[256];
-    ssize_t bytes;
-    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
-        write(1, buffer, bytes);
+// Report block cache counters
+void fs_cache_stats(struct CacheStats *stats) {
+    cache_stats(stats);
+}
+
+// Flush pending metadata and sync the disk now, regardless of policy
+int fs_sync() {
+    pthread_rwlock_wrlock(&meta_lock);
+    int rc = save_metadata() < 0 || journal_flush(journal.next_seq - 1) < 0 || sync_disk() < 0 ? FS_ERR_IO : FS_OK;
+    pthread_rwlock_unlock(&meta_lock);
+    if (rc < 0) {
+        return fail("fs_sync", NULL, rc);
     }
-    close(fd);
+    log_operation("fs_sync", NULL, 0);
     return 0;
 }
+
+// Describe an FsError code
+const char *fs_strerror(int err) {
+    switch (err) {
+    case FS_OK: return "Başarılı";
+    case FS_ERR_INVALID: return "Geçersiz parametre";
+    case FS_ERR_NOT_FOUND: return "Dosya bulunamadı";
+    case FS_ERR_EXISTS: return "Bu isimde bir dosya zaten var";
+    case FS_ERR_TABLE_FULL: return "Maksimum dosya sayısına ulaşıldı";
+    case FS_ERR_NO_SPACE: return "Diskte yeterli boş alan yok";
+    case FS_ERR_RANGE: return "Ofset veya boyut dosya sınırlarının dışında";
+    case FS_ERR_IO: return "Disk okuma/yazma hatası";
+    case FS_ERR_NO_MEMORY: return "Bellek yetersiz";
+    case FS_ERR_CORRUPT: return "Disk imajı bozuk veya tanınmadı";
+    case FS_ERR_NOT_DIR: return "Dizin değil";
+    case FS_ERR_IS_DIR: return "Bir dizin, dosya değil";
+    case FS_ERR_NOT_EMPTY: return "Dizin boş değil";
+    default: return "Bilinmeyen hata";
+    }
+}
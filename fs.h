@@ -2,57 +2,286 @@
 #define SIMPLEFS_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include "alloc.h"
+#include "oplog.h"
+#include "cache.h"
 
 // Disk parameters
 #define DISK_NAME "disk.sim"
-#define DISK_SIZE (1024*1024)  // 1 MB
-#define META_SIZE 4096         // 4 KB for metadata
-#define DATA_SIZE (DISK_SIZE - META_SIZE)
+#define LOG_NAME "fs.log"            // operation log, text format
+#define LOG_BINARY_NAME "fs.log.bin"  // operation log, binary format
+#define CBT_NAME "disk.sim.cbt"       // blocks changed since the last backup
+#define MANIFEST_SUFFIX ".manifest"   // appended to a backup's name for its manifest
+#define DEFAULT_DISK_SIZE (1024*1024)  // 1 MB, used when a new image is created
+#define DEFAULT_MAX_FILES 64
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_EXTENTS_PER_FILE 16    // extent table capacity = max_files * this
+#define DEFAULT_DEFRAG_STEP (1024*1024)   // bytes moved per defragmentation step
+#define DEFAULT_DEFRAG_MEMORY (256*1024)  // staging buffer cap for defragmentation
+#define DEFAULT_CACHE_SIZE (4*1024*1024)  // block cache budget
+#define DEFAULT_JOURNAL_SHARE 16          // journal = image size / this, 16 KB .. 16 MB
+
+// On-disk format
+#define FS_MAGIC 0x31534653u   // "SFS1"
+#define FS_VERSION 8
+#define SUPERBLOCK_SIZE 512    // superblock sector; entry table, then extent table follow
+#define META_ALIGN 4096        // data area starts on this boundary
+#define EXTENT_NONE 0xFFFFFFFFu  // end of an extent chain
 
 // File system limits
-#define MAX_FILENAME_LEN 32
-#define MAX_FILES 64
+#define MAX_FILENAME_LEN 32  // one path component
+#define MAX_PATH_LEN 1024    // a whole path, "dir/sub/file"
+
+// Durability policies for metadata and data writes
+enum SyncPolicy {
+    SYNC_ALWAYS = 0,   // fsync at the end of every modifying operation
+    SYNC_INTERVAL,     // fsync when the given interval has elapsed
+    SYNC_ON_CLOSE      // fsync only in fs_sync/fs_close
+};
+
+// Disk access backends selectable at fs_init_io
+enum IoMode {
+    IO_FD = 0,   // pread/pwrite on the disk file descriptor
+    IO_MMAP,     // whole image mapped; reads and compares work in place
+    IO_URING     // requests through an io_uring queue; IO_FD where unavailable
+};
 
 // Data structures
+struct SuperBlock {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t disk_size;    // image size in bytes
+    uint64_t meta_size;    // superblock + entry and extent tables; data blocks start here
+    uint64_t block_count;  // number of data blocks
+    uint32_t block_size;   // data block size in bytes
+    uint32_t max_files;    // entry table capacity
+    uint32_t file_count;
+    uint32_t entry_size;   // sizeof(struct FileEntry) the image was formatted with
+    uint32_t max_extents;  // extent table capacity
+    uint32_t extent_size;  // sizeof(struct Extent) the image was formatted with
+    uint64_t crc_offset;   // table of block_count CRC32C values, one per data block (0 = none)
+    uint64_t journal_offset;  // write-ahead journal region at the end of the image
+    uint64_t journal_size;    // its size in bytes (0 = none)
+    uint64_t journal_seq;     // sequence number of the region's first record
+    uint32_t snapshot_entries;  // entries at the end of the entry table held by snapshots
+    uint32_t reserved;
+};
+
+// A run of consecutive data blocks of one file; a file's extents form a
+// chain through the extent table, ordered by logical block
+struct Extent {
+    uint64_t lblock;   // first logical block within the file
+    uint64_t pblock;   // first physical data block
+    uint32_t count;    // number of blocks (0 = unused record)
+    uint32_t next;     // next extent of the same file, or EXTENT_NONE
+};
+
 struct FileEntry {
     char name[MAX_FILENAME_LEN];
-    int size;
-    int start;
+    int64_t size;
     char created[20];  // creation date-time string "YYYY-MM-DD HH:MM:SS"
+    uint32_t first_extent;   // head of the extent chain, or EXTENT_NONE
+    uint32_t extent_count;
+    uint32_t flags;          // FILE_* bits, and the directory the entry is in
 };
 
+// File flags
+#define FILE_COMPRESSED 0x1u  // data stored compressed, a unit at a time (see fs_set_compression)
+#define FILE_SNAPSHOT 0x2u    // not a file: the header of a snapshot (see fs_snapshot)
+#define FILE_DIRECTORY 0x4u   // not a file: a directory, whose id is kept in size
+#define FILE_FLAG_BITS 0xFFu
+
+// The bits of flags above FILE_FLAG_BITS hold the id of the directory the
+// entry is in; the root, which has no entry, is directory 0
+#define FILE_PARENT_SHIFT 8
+#define FILE_PARENT(f) ((f)->flags >> FILE_PARENT_SHIFT)
+#define MAX_DIRECTORIES (1u << (32 - FILE_PARENT_SHIFT))  // ids, the root's included
+
 struct FileSystem {
+    struct SuperBlock sb;     // geometry of the mounted image
     int file_count;
-    struct FileEntry files[MAX_FILES];
+    struct FileEntry *files;  // sb.max_files entries
+    struct Extent *extents;   // sb.max_extents records
+};
+
+// Error codes; every fs_* call that can fail returns one of these (< 0)
+enum FsError {
+    FS_OK = 0,
+    FS_ERR_INVALID = -1,     // bad argument, name or geometry
+    FS_ERR_NOT_FOUND = -2,   // no such file
+    FS_ERR_EXISTS = -3,      // name already in use
+    FS_ERR_TABLE_FULL = -4,  // no free file entry
+    FS_ERR_NO_SPACE = -5,    // no free blocks or extent records
+    FS_ERR_RANGE = -6,       // offset or size outside the file
+    FS_ERR_IO = -7,          // disk image or host file could not be read or written
+    FS_ERR_NO_MEMORY = -8,
+    FS_ERR_CORRUPT = -9,     // image not recognised or inconsistent
+    FS_ERR_NOT_DIR = -10,    // a directory was expected
+    FS_ERR_IS_DIR = -11,     // a file was expected
+    FS_ERR_NOT_EMPTY = -12   // directory still has entries
+};
+
+// One file or directory, as returned by fs_stat and the listings
+struct FsFileInfo {
+    char name[MAX_FILENAME_LEN];  // last component of its path
+    int64_t size;  // of a directory: the entries in it
+    char created[20];
+    uint32_t extent_count;
+    int64_t stored;   // bytes its blocks take in the image
+    bool compressed;  // FILE_COMPRESSED
+    bool directory;   // FILE_DIRECTORY
+};
+
+// One snapshot, as returned by fs_snapshot_list
+struct FsSnapshotInfo {
+    char name[MAX_FILENAME_LEN];
+    char created[20];
+    int files;     // files it holds
+    int64_t size;  // sum of their sizes
+};
+
+// Geometry for fs_format_geometry; zero fields take the defaults above
+struct FsGeometry {
+    uint64_t disk_size;    // image size in bytes
+    uint32_t max_files;    // file entry capacity
+    uint32_t block_size;   // power of two, 512 B .. 1 MB
+    uint32_t max_extents;  // extent record capacity
+    uint32_t journal_size; // metadata journal, multiple of 512 B
+};
+
+// Outcome of fs_scrub
+struct FsScrubStats {
+    int threads;
+    int64_t blocks;      // data blocks verified
+    int64_t bytes;
+    int64_t bad_blocks;  // blocks whose contents no longer match their checksum
+    int64_t first_bad;   // lowest such block, -1 if none
+    double seconds;
+};
+
+// Block sharing, as reported by fs_dedup_stats. Blocks mapped by several
+// files (copies, or deduplicated writes) are stored once.
+struct FsDedupStats {
+    bool enabled;           // see fs_set_dedup
+    int64_t block_size;
+    int64_t logical_bytes;  // sum of the file sizes
+    int64_t mapped_blocks;  // blocks the files map, a shared block once per mapping
+    int64_t stored_blocks;  // data blocks in use
+    int64_t shared_blocks;  // blocks in use mapped more than once
+    int64_t dedup_blocks;   // blocks mapped instead of written since mount
+};
+
+// One range of a delta from fs_delta: bytes [new_off, new_off+len) of the
+// new file either equal bytes [old_off, old_off+len) of the old one, or
+// are not found there
+enum FsDeltaType {
+    FS_DELTA_COPY = 0,
+    FS_DELTA_DATA
+};
+
+struct FsDeltaRange {
+    enum FsDeltaType type;
+    int64_t new_off;
+    int64_t old_off;  // FS_DELTA_COPY
+    int64_t len;
+};
+
+struct FsDeltaStats {
+    int64_t block_size;  // match granularity used
+    int64_t copied;      // bytes of the new file found in the old one
+    int64_t literal;     // bytes that were not
+};
+
+// Operations accepted by fs_submit
+enum FsOpType {
+    FS_OP_CREATE = 0,
+    FS_OP_WRITE,    // replace the contents with data[0..size)
+    FS_OP_APPEND,
+    FS_OP_READ,     // up to size bytes at offset into buffer
+    FS_OP_DELETE,
+    FS_OP_RENAME    // name -> new_name
+};
+
+// One operation of a batch; fs_submit fills in result
+struct FsOp {
+    enum FsOpType type;
+    const char *name;
+    const char *new_name;  // FS_OP_RENAME
+    const char *data;      // FS_OP_WRITE, FS_OP_APPEND
+    char *buffer;          // FS_OP_READ
+    int64_t offset;        // FS_OP_READ
+    int64_t size;
+    int64_t result;        // FsError, or the bytes read for FS_OP_READ
 };
 
 // Extern global FileSystem instance (defined in fs.c)
 extern struct FileSystem fs;
 
-// Function prototypes
-int fs_format();
+// Function prototypes. The library prints nothing: results come back
+// through return values and caller-provided buffers, failures as FsError codes.
+// Files are named by paths, "dir/sub/file", relative to the root directory
+// (a leading '/' is allowed); "." and ".." are not special and not allowed.
+int fs_format();  // reformat with the current geometry
+int fs_format_geometry(const struct FsGeometry *geometry);
+int fs_geometry(struct FsGeometry *geometry);  // geometry of the mounted image
 int fs_create(const char *filename);
 int fs_delete(const char *filename);
-int fs_write(const char *filename, const char *data, int size);
-int fs_append(const char *filename, const char *data, int size);
-int fs_read(const char *filename, int offset, int size, char *buffer);
-int fs_ls();
-int fs_rename(const char *oldname, const char *newname);
+int fs_write(const char *filename, const char *data, int64_t size);
+int fs_append(const char *filename, const char *data, int64_t size);
+int64_t fs_read(const char *filename, int64_t offset, int64_t size, char *buffer);  // bytes read
+int fs_stat(const char *filename, struct FsFileInfo *info);
+int fs_list(struct FsFileInfo *files, int max);  // root directory; fills up to max entries, returns the entry count
+int fs_mkdir(const char *path);
+int fs_rmdir(const char *path);  // the directory must be empty
+int fs_listdir(const char *path, const char *after, struct FsFileInfo *entries,
+               int max);  // entries past name after (NULL: all) in name order; returns how many were filled
+int fs_rename(const char *oldname, const char *newname);  // files or directories, across directories too
 bool fs_exists(const char *filename);
-int fs_size(const char *filename);
-int fs_truncate(const char *filename, int new_size);
+int64_t fs_size(const char *filename);
+int fs_truncate(const char *filename, int64_t new_size);
 int fs_copy(const char *src_filename, const char *dest_filename);
 int fs_mv(const char *src_filename, const char *dest_filename);
-int fs_defragment();
-int fs_check_integrity();
-int fs_backup(const char *backup_filename);
+int fs_submit(struct FsOp *ops, int count);  // run ops in order, sync once; returns how many failed
+int fs_defragment(int *moved_files, int64_t *moved_blocks);  // run steps until nothing is left to move
+int fs_defragment_step();  // one bounded step: 1 = more work may remain, 0 = done, < 0 = error
+int fs_set_defrag_limits(int64_t step_bytes, int64_t memory_bytes);
+int fs_check_integrity();  // number of problems found, 0 = consistent
+int fs_scrub(int threads, struct FsScrubStats *stats);  // verify every block's checksum; 0 threads = one per CPU
+int fs_set_verify_reads(bool verify);  // fs_read checks the checksums of the blocks it reads
+int fs_set_dedup(bool enabled);  // store identical written blocks once
+int fs_dedup_stats(struct FsDedupStats *stats);
+int fs_set_compression(const char *filename, bool enabled);  // store the file compressed, or plain again
+int fs_snapshot(const char *name);  // freeze the current files under name; shares their blocks
+int fs_snapshot_list(struct FsSnapshotInfo *snapshots, int max);  // fills up to max entries, returns the count
+int fs_snapshot_files(const char *name, const char *path, struct FsFileInfo *files,
+                      int max);  // a directory of a snapshot (NULL: the root), as fs_list
+int64_t fs_snapshot_read(const char *name, const char *filename, int64_t offset, int64_t size,
+                         char *buffer);  // bytes read from a snapshot's file
+int fs_rollback(const char *name);  // replace the current files with the snapshot's
+int fs_snapshot_delete(const char *name);
+int fs_backup(const char *backup_filename);              // whole image
+int fs_backup_incremental(const char *backup_filename);  // blocks written since the last backup
 int fs_restore(const char *backup_filename);
-int fs_cat(const char *filename);
-int fs_diff(const char *file1, const char *file2);
-int fs_log();  // show log of operations
+int fs_restore_chain(const char *const *backup_filenames, int count);  // full backup, then incremental ones in order
+int64_t fs_cat(const char *filename, int out_fd);  // write the whole file to out_fd
+int fs_import(const char *host_filename, const char *filename);  // new file from a host file
+int64_t fs_export(const char *filename, const char *host_filename);  // file to a host file; bytes written
+int fs_diff(const char *file1, const char *file2, int64_t *first_diff);  // 0 = same, 1 = different
+int fs_delta(const char *old_filename, const char *new_filename, int64_t block_size,
+             struct FsDeltaRange *ranges, int max, struct FsDeltaStats *stats);  // fills up to max ranges, returns the count
+int fs_log(int out_fd);  // write the operation log to out_fd as text
+int fs_set_log_options(enum LogFormat format, bool background);
+int fs_set_alloc_policy(enum AllocPolicy policy);  // first/best/next fit
+int fs_set_sync_policy(enum SyncPolicy policy, int interval_ms);
+int fs_sync();   // flush pending metadata and sync now
+int fs_set_cache_size(int64_t bytes);  // block cache budget, 0 = off
+void fs_cache_stats(struct CacheStats *stats);
+const char *fs_strerror(int err);  // message for an FsError code
 
 // Utility functions
 int fs_init();   // initialize filesystem (open disk, load metadata)
+int fs_init_io(enum IoMode mode);  // same, with an explicit disk backend
 int fs_close();  // close files and cleanup
 
 #endif // SIMPLEFS_H
@@ -0,0 +1,146 @@
+#include <string.h>
+#include "lz.h"
+
+// Stream format: a sequence is a token byte (literal count in the high
+// nibble, match length - MIN_MATCH in the low one, 15 meaning more length
+// bytes follow: 255s and a final smaller one), the literals, then a
+// two-byte little-endian offset back into the output. The last sequence is
+// literals only; the input ends after them.
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define SKIP_SHIFT 6  // after 2^this misses in a row, probe every other position, and so on
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Number of equal bytes at a and b, up to end (the end of a)
+static size_t match_length(const unsigned char *a, const unsigned char *b, const unsigned char *end) {
+    const unsigned char *start = a;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (a + 8 <= end) {
+        uint64_t x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y) return (a - start) + (__builtin_ctzll(x ^ y) >> 3);
+        a += 8;
+        b += 8;
+    }
+#endif
+    while (a < end && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+static unsigned char *put_length(unsigned char *op, size_t n) {
+    for (; n >= 255; n -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+// Append a sequence (match_len 0: the closing literals-only one); NULL if
+// it does not fit before out_end
+static unsigned char *emit(unsigned char *op, const unsigned char *out_end, const unsigned char *lit, size_t lit_len,
+                           size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len + lit_len / 255 + 1 + (match_len ? 2 + match_len / 255 + 1 : 0);
+    if (need > (size_t)(out_end - op)) return NULL;
+    unsigned char *token = op++;
+    *token = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len) {
+        size_t m = match_len - MIN_MATCH;
+        *op++ = (unsigned char)(offset & 0xFF);
+        *op++ = (unsigned char)(offset >> 8);
+        *token |= (unsigned char)(m < 15 ? m : 15);
+        if (m >= 15) op = put_length(op, m - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+    const unsigned char *in = src, *end = in + len;
+    const unsigned char *ip = in, *anchor = in;
+    unsigned char *out = dst, *op = out, *out_end = out + cap;
+    uint32_t table[1 << HASH_BITS];  // last position of each hash
+    memset(table, 0, sizeof(table));
+    unsigned misses = 0;
+    while (len >= MIN_MATCH && ip + MIN_MATCH <= end) {
+        uint32_t v = read32(ip);
+        uint32_t h = hash4(v);
+        const unsigned char *ref = in + table[h];
+        table[h] = (uint32_t)(ip - in);
+        if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != v) {
+            ip += 1 + (misses++ >> SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+        while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        size_t match_len = MIN_MATCH + match_length(ip + MIN_MATCH, ref + MIN_MATCH, end);
+        if (!(op = emit(op, out_end, anchor, ip - anchor, ip - ref, match_len))) return 0;
+        ip += match_len;
+        anchor = ip;
+        if (ip + MIN_MATCH <= end) table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+    }
+    if (!(op = emit(op, out_end, anchor, end - anchor, 0, 0))) return 0;
+    return op - out;
+}
+
+// A length continued past 15 in the bytes at *ip; false if they run out
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *n) {
+    unsigned char b;
+    do {
+        if (*ip >= end) return 0;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 1;
+}
+
+int64_t lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+    const unsigned char *ip = src, *end = ip + len;
+    unsigned char *out = dst, *op = out, *out_end = out + cap;
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !get_length(&ip, end, &lit_len)) return -1;
+        if (lit_len > (size_t)(end - ip) || lit_len > (size_t)(out_end - op)) return -1;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == end) break;
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(&ip, end, &match_len)) return -1;
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || match_len > (size_t)(out_end - op)) return -1;
+        // An overlapping copy repeats the last offset bytes: copy what is
+        // there so far, doubling each time
+        const unsigned char *ref = op - offset;
+        while (match_len > 0) {
+            size_t n = (size_t)(op - ref) < match_len ? (size_t)(op - ref) : match_len;
+            memcpy(op, ref, n);
+            op += n;
+            match_len -= n;
+        }
+    }
+    return op - out;
+}
@@ -0,0 +1,14 @@
+#ifndef SIMPLEFS_LZ_H
+#define SIMPLEFS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A small LZ77 codec in the LZ4 mould: greedy matching through a hash of
+// the next four bytes, sequences of literals and (offset, length) copies
+// with byte-aligned lengths, no entropy stage. Fast in both directions;
+// meant for blocks of up to a few hundred kilobytes.
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);  // compressed size, 0 if over cap
+int64_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);  // bytes produced, -1 if src is damaged
+
+#endif // SIMPLEFS_LZ_H
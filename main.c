@@ -5,8 +5,607 @@
 #include <unistd.h>
 #include "fs.h"
 
-int main() {
-    if (fs_init() != 0) {
+#define LIST_PAGE 256  // entries per fs_listdir call
+
+// Copy of a live directory's listing, read a page at a time
+static struct FsFileInfo *list_dir(const char *dir, int *count) {
+    struct FsFileInfo *files = NULL;
+    int n = 0;
+    for (;;) {
+        struct FsFileInfo *grown = realloc(files, (n + LIST_PAGE) * sizeof(*files));
+        if (!grown) {
+            free(files);
+            *count = FS_ERR_NO_MEMORY;
+            return NULL;
+        }
+        files = grown;
+        int got = fs_listdir(dir, n > 0 ? files[n - 1].name : NULL, files + n, LIST_PAGE);
+        if (got < 0) {
+            free(files);
+            *count = got;
+            return NULL;
+        }
+        n += got;
+        if (got < LIST_PAGE) {
+            *count = n;
+            return files;
+        }
+    }
+}
+
+// Copy of the listing of directory dir ("" for the root), of the live
+// files or of the named snapshot's; *count gets the number of entries
+// returned, or the error code
+static struct FsFileInfo *list_files(const char *snapshot, const char *dir, int *count) {
+    if (!snapshot) return list_dir(dir, count);
+    for (;;) {
+        int n = fs_snapshot_files(snapshot, dir, NULL, 0);
+        struct FsFileInfo *files = n >= 0 ? malloc((n > 0 ? n : 1) * sizeof(*files)) : NULL;
+        if (!files) {
+            *count = n < 0 ? n : FS_ERR_NO_MEMORY;
+            return NULL;
+        }
+        int filled = fs_snapshot_files(snapshot, dir, files, n);
+        if (filled >= 0 && filled <= n) {
+            *count = filled;
+            return files;
+        }
+        free(files);  // the snapshot was deleted and taken again in between; try again
+    }
+}
+
+// Compression column of a listing: size over bytes stored for a compressed
+// file, "-" for a plain one
+static const char *ratio_text(const struct FsFileInfo *f, char *buf, size_t len) {
+    if (!f->compressed || f->size == 0) return "-";
+    if (f->stored == 0) return "∞";  // all zeros: nothing stored
+    snprintf(buf, len, "%.2fx", (double)f->size / f->stored);
+    return buf;
+}
+
+// Delta of new_name against old_name; *count gets the number of ranges
+static struct FsDeltaRange *delta_ranges(const char *old_name, const char *new_name, int64_t block_size,
+                                         int *count, struct FsDeltaStats *stats) {
+    int n = fs_delta(old_name, new_name, block_size, NULL, 0, stats);
+    if (n < 0) {
+        *count = n;
+        return NULL;
+    }
+    struct FsDeltaRange *ranges = malloc((n > 0 ? n : 1) * sizeof(*ranges));
+    if (ranges) *count = fs_delta(old_name, new_name, block_size, ranges, n, stats);
+    if (ranges && *count > n) *count = n;  // a file changed in between
+    return ranges;
+}
+
+// Print the message for a failed call; true if rc is a success
+static bool report(int64_t rc) {
+    if (rc < 0) printf("Hata: %s.\n", fs_strerror((int)rc));
+    return rc >= 0;
+}
+
+// ---- batch mode ----
+//
+// Commands are separated by newlines or ';'. Each produces one result line
+// on stdout, "ok [value]" or "err <command>"; read and cat follow "ok <n>"
+// with the n data bytes and a newline. Error messages go to stderr.
+// A data argument is either the rest of the command or @hostfile.
+// Consecutive create, delete, write, append and rename commands are
+// collected and run together with fs_submit (one metadata flush and sync);
+// their result lines appear, in order, when the run ends.
+
+#define BATCH_QUEUE 4096
+static struct FsOp queue_ops[BATCH_QUEUE];
+static char *queue_mem[BATCH_QUEUE];  // command name, then the op's strings and data
+static int queued = 0;
+static long queue_failures = 0;
+
+// Split off the next whitespace-separated token, or NULL at the end
+static char *next_token(char **p) {
+    char *s = *p;
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s == '\0') {
+        *p = s;
+        return NULL;
+    }
+    char *tok = s;
+    while (*s && *s != ' ' && *s != '\t') s++;
+    if (*s) *s++ = '\0';
+    *p = s;
+    return tok;
+}
+
+// Resolve a data argument: the remaining text, or the contents of @hostfile.
+// *owned is set when the returned buffer must be freed.
+static char *batch_data(char *rest, int64_t *len, char **owned) {
+    *owned = NULL;
+    while (*rest == ' ' || *rest == '\t') rest++;
+    if (rest[0] != '@') {
+        *len = strlen(rest);
+        return rest;
+    }
+    FILE *f = fopen(rest + 1, "rb");
+    if (!f) return NULL;
+    char *buf = NULL;
+    size_t cap = 0, used = 0, n;
+    do {
+        if (used == cap) {
+            cap = cap ? cap * 2 : 65536;
+            char *grown = realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                fclose(f);
+                return NULL;
+            }
+            buf = grown;
+        }
+        n = fread(buf + used, 1, cap - used, f);
+        used += n;
+    } while (n > 0);
+    fclose(f);
+    *len = used;
+    *owned = buf ? buf : malloc(1);
+    return *owned;
+}
+
+// Submit the queued commands and print their result lines
+static void batch_submit(FILE *out) {
+    if (queued == 0) return;
+    int rc = fs_submit(queue_ops, queued);
+    for (int i = 0; i < queued; ++i) {
+        int err = rc < 0 ? rc : (int)queue_ops[i].result;
+        if (err < 0) {
+            fprintf(out, "err %s\n", queue_mem[i]);
+            fprintf(stderr, "%s: %s\n", queue_mem[i], fs_strerror(err));
+            queue_failures++;
+        } else {
+            fprintf(out, "ok\n");
+        }
+        free(queue_mem[i]);
+    }
+    queued = 0;
+}
+
+// Add a command to the queue, copying its arguments; false if out of memory
+static bool queue_op(FILE *out, enum FsOpType type, const char *cmd, const char *name,
+                     const char *new_name, const char *data, int64_t len) {
+    if (queued == BATCH_QUEUE) batch_submit(out);
+    size_t cmd_len = strlen(cmd) + 1, name_len = strlen(name) + 1;
+    size_t new_len = new_name ? strlen(new_name) + 1 : 0;
+    char *mem = malloc(cmd_len + name_len + new_len + (data ? len : 0));
+    if (!mem) return false;
+    struct FsOp *op = &queue_ops[queued];
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    memcpy(mem, cmd, cmd_len);
+    op->name = memcpy(mem + cmd_len, name, name_len);
+    if (new_name) op->new_name = memcpy(mem + cmd_len + name_len, new_name, new_len);
+    if (data) {
+        op->data = memcpy(mem + cmd_len + name_len + new_len, data, len);
+        op->size = len;
+    }
+    queue_mem[queued++] = mem;
+    return true;
+}
+
+// Print "ok <n>" followed by n bytes of a file starting at offset; the
+// file as the named snapshot holds it, if snapshot is not NULL
+static int batch_read(FILE *out, const char *snapshot, const char *name, int64_t offset, int64_t len) {
+    char *buf = malloc(len + 1);
+    if (!buf) return FS_ERR_NO_MEMORY;
+    int64_t n = len <= 0 ? 0 : snapshot ? fs_snapshot_read(snapshot, name, offset, len, buf)
+                                        : fs_read(name, offset, len, buf);
+    if (n < 0) {
+        free(buf);
+        return (int)n;
+    }
+    fprintf(out, "ok %lld\n", (long long)n);
+    fwrite(buf, 1, n, out);
+    fputc('\n', out);
+    free(buf);
+    return 0;
+}
+
+// Run one command; returns 0 on success, -1 on failure, 1 for a blank line
+static int batch_exec(char *line, FILE *out) {
+    char *p = line;
+    char *cmd = next_token(&p);
+    if (!cmd || cmd[0] == '#') return 1;
+    char *a = NULL, *b = NULL;
+    int rc = FS_ERR_INVALID;
+    bool queueable = strcmp(cmd, "create") == 0 || strcmp(cmd, "delete") == 0 || strcmp(cmd, "write") == 0 ||
+                     strcmp(cmd, "append") == 0 || strcmp(cmd, "rename") == 0;
+    if (!queueable) batch_submit(out);
+    if (strcmp(cmd, "create") == 0 || strcmp(cmd, "delete") == 0) {
+        if ((a = next_token(&p))) {
+            if (queue_op(out, cmd[0] == 'c' ? FS_OP_CREATE : FS_OP_DELETE, cmd, a, NULL, NULL, 0)) return 0;
+            rc = FS_ERR_NO_MEMORY;
+        }
+    } else if (strcmp(cmd, "write") == 0 || strcmp(cmd, "append") == 0) {
+        if ((a = next_token(&p))) {
+            int64_t len;
+            char *owned;
+            char *data = batch_data(p, &len, &owned);
+            if (data) {
+                bool ok = queue_op(out, cmd[0] == 'w' ? FS_OP_WRITE : FS_OP_APPEND, cmd, a, NULL, data, len);
+                free(owned);
+                if (ok) return 0;
+                rc = FS_ERR_NO_MEMORY;
+            }
+        }
+    } else if (strcmp(cmd, "rename") == 0) {
+        a = next_token(&p);
+        b = next_token(&p);
+        if (a && b) {
+            if (queue_op(out, FS_OP_RENAME, cmd, a, b, NULL, 0)) return 0;
+            rc = FS_ERR_NO_MEMORY;
+        }
+    } else if (strcmp(cmd, "read") == 0) {
+        a = next_token(&p);
+        char *off = next_token(&p), *len = next_token(&p);
+        if (a && off && len) {
+            rc = batch_read(out, NULL, a, atoll(off), atoll(len));
+            if (rc == 0) return 0;
+        }
+    } else if (strcmp(cmd, "cat") == 0) {
+        if ((a = next_token(&p))) {
+            int64_t size = fs_size(a);
+            rc = size < 0 ? (int)size : batch_read(out, NULL, a, 0, size);
+            if (rc == 0) return 0;
+        }
+    } else if (strcmp(cmd, "ls") == 0 || strcmp(cmd, "snapshot-ls") == 0) {
+        // ls [dir] | snapshot-ls <snapshot> [dir]: ok <n>, then n lines
+        // "<name> <size> <created> <bytes stored> <ratio>", tab-separated,
+        // in name order; a directory's name ends in '/' and its size is
+        // its entry count
+        a = cmd[0] == 's' ? next_token(&p) : NULL;
+        b = next_token(&p);
+        int count = FS_ERR_INVALID;
+        struct FsFileInfo *files = cmd[0] == 'l' || a ? list_files(a, b ? b : "", &count) : NULL;
+        if (!files) {
+            rc = count;
+        } else {
+            fprintf(out, "ok %d\n", count);
+            for (int i = 0; i < count; ++i) {
+                char ratio[32];
+                fprintf(out, "%s%s\t%lld\t%s\t%lld\t%s\n", files[i].name, files[i].directory ? "/" : "",
+                        (long long)files[i].size, files[i].created, (long long)files[i].stored,
+                        ratio_text(&files[i], ratio, sizeof(ratio)));
+            }
+            free(files);
+            return 0;
+        }
+    } else if (strcmp(cmd, "mkdir") == 0) {
+        if ((a = next_token(&p))) rc = fs_mkdir(a);
+    } else if (strcmp(cmd, "rmdir") == 0) {
+        if ((a = next_token(&p))) rc = fs_rmdir(a);
+    } else if (strcmp(cmd, "format") == 0) {
+        char *size = next_token(&p), *files = next_token(&p), *block = next_token(&p);
+        struct FsGeometry geometry;
+        fs_geometry(&geometry);
+        if (size) {
+            geometry.disk_size = strtoull(size, NULL, 10);
+            geometry.journal_size = 0;  // sized for the new image
+        }
+        if (files) {
+            geometry.max_files = strtoul(files, NULL, 10);
+            geometry.max_extents = 0;
+        }
+        if (block) geometry.block_size = strtoul(block, NULL, 10);
+        rc = fs_format_geometry(&geometry);
+    } else if (strcmp(cmd, "mv") == 0 || strcmp(cmd, "copy") == 0 || strcmp(cmd, "diff") == 0) {
+        a = next_token(&p);
+        b = next_token(&p);
+        if (a && b) {
+            if (cmd[0] == 'm') rc = fs_mv(a, b);
+            else if (cmd[0] == 'c') rc = fs_copy(a, b);
+            else {
+                rc = fs_diff(a, b, NULL);
+                if (rc >= 0) {
+                    fprintf(out, "ok %d\n", rc);
+                    return 0;
+                }
+            }
+        }
+    } else if (strcmp(cmd, "delta") == 0) {
+        // delta <old> <new> [block size]: ok <n> <bytes copied> <bytes literal>, then n lines
+        // "copy <new offset> <old offset> <length>" or "data <new offset> <length>"
+        a = next_token(&p);
+        b = next_token(&p);
+        char *block = next_token(&p);
+        int count = FS_ERR_INVALID;
+        struct FsDeltaStats st;
+        struct FsDeltaRange *ranges = a && b ? delta_ranges(a, b, block ? atoll(block) : 0, &count, &st) : NULL;
+        if (ranges && count >= 0) {
+            fprintf(out, "ok %d %lld %lld\n", count, (long long)st.copied, (long long)st.literal);
+            for (int i = 0; i < count; ++i) {
+                if (ranges[i].type == FS_DELTA_COPY) {
+                    fprintf(out, "copy %lld %lld %lld\n", (long long)ranges[i].new_off,
+                            (long long)ranges[i].old_off, (long long)ranges[i].len);
+                } else {
+                    fprintf(out, "data %lld %lld\n", (long long)ranges[i].new_off, (long long)ranges[i].len);
+                }
+            }
+            free(ranges);
+            return 0;
+        }
+        free(ranges);
+        rc = a && b && count >= 0 ? FS_ERR_NO_MEMORY : count;
+    } else if (strcmp(cmd, "exists") == 0) {
+        if ((a = next_token(&p))) {
+            fprintf(out, "ok %d\n", fs_exists(a) ? 1 : 0);
+            return 0;
+        }
+    } else if (strcmp(cmd, "size") == 0) {
+        if ((a = next_token(&p))) {
+            int64_t size = fs_size(a);
+            if (size >= 0) {
+                fprintf(out, "ok %lld\n", (long long)size);
+                return 0;
+            }
+        }
+    } else if (strcmp(cmd, "truncate") == 0) {
+        a = next_token(&p);
+        b = next_token(&p);
+        if (a && b) rc = fs_truncate(a, atoll(b));
+    } else if (strcmp(cmd, "defrag") == 0) {
+        rc = fs_defragment(NULL, NULL);
+    } else if (strcmp(cmd, "check") == 0) {
+        // ok <number of problems>
+        rc = fs_check_integrity();
+        if (rc >= 0) {
+            fprintf(out, "ok %d\n", rc);
+            return 0;
+        }
+    } else if (strcmp(cmd, "scrub") == 0) {
+        // scrub [threads]: ok <bad blocks> <blocks verified> <MB/s> <threads>
+        struct FsScrubStats st;
+        a = next_token(&p);
+        rc = fs_scrub(a ? atoi(a) : 0, &st);
+        if (rc >= 0) {
+            fprintf(out, "ok %d %lld %.0f %d\n", rc, (long long)st.blocks,
+                    st.seconds > 0 ? st.bytes / st.seconds / 1e6 : 0.0, st.threads);
+            return 0;
+        }
+    } else if (strcmp(cmd, "verify") == 0) {
+        // verify on | off: checksum checks on read
+        if ((a = next_token(&p))) {
+            if (strcmp(a, "on") == 0) rc = fs_set_verify_reads(true);
+            else if (strcmp(a, "off") == 0) rc = fs_set_verify_reads(false);
+        }
+    } else if (strcmp(cmd, "dedup") == 0) {
+        // dedup on | off: store identical written blocks once
+        if ((a = next_token(&p))) {
+            if (strcmp(a, "on") == 0) rc = fs_set_dedup(true);
+            else if (strcmp(a, "off") == 0) rc = fs_set_dedup(false);
+        }
+    } else if (strcmp(cmd, "compress") == 0) {
+        // compress <name> on | off: store the file compressed, or plain again
+        a = next_token(&p);
+        b = next_token(&p);
+        if (a && b) {
+            if (strcmp(b, "on") == 0) rc = fs_set_compression(a, true);
+            else if (strcmp(b, "off") == 0) rc = fs_set_compression(a, false);
+        }
+    } else if (strcmp(cmd, "dedup-stats") == 0) {
+        // ok <logical bytes> <mapped blocks> <stored blocks> <shared blocks> <blocks not written>
+        struct FsDedupStats st;
+        rc = fs_dedup_stats(&st);
+        if (rc == 0) {
+            fprintf(out, "ok %lld %lld %lld %lld %lld\n", (long long)st.logical_bytes, (long long)st.mapped_blocks,
+                    (long long)st.stored_blocks, (long long)st.shared_blocks, (long long)st.dedup_blocks);
+            return 0;
+        }
+    } else if (strcmp(cmd, "import") == 0) {
+        // import <host path> <name>
+        a = next_token(&p);
+        b = next_token(&p);
+        if (a && b) rc = fs_import(a, b);
+    } else if (strcmp(cmd, "export") == 0) {
+        // export <name> <host path>: ok <bytes written>
+        a = next_token(&p);
+        b = next_token(&p);
+        if (a && b) {
+            fflush(out);  // the host path may be our own output
+            int64_t size = fs_export(a, b);
+            if (size >= 0) {
+                fprintf(out, "ok %lld\n", (long long)size);
+                return 0;
+            }
+            rc = (int)size;
+        }
+    } else if (strcmp(cmd, "snapshot") == 0) {
+        if ((a = next_token(&p))) rc = fs_snapshot(a);
+    } else if (strcmp(cmd, "snapshots") == 0) {
+        // ok <n>, then n lines "<name> <created> <files> <bytes>", tab-separated
+        int n = fs_snapshot_list(NULL, 0);
+        struct FsSnapshotInfo *snaps = n >= 0 ? malloc((n > 0 ? n : 1) * sizeof(*snaps)) : NULL;
+        if (snaps) {
+            int count = fs_snapshot_list(snaps, n);
+            if (count > n) count = n;  // one was taken in between
+            fprintf(out, "ok %d\n", count);
+            for (int i = 0; i < count; ++i) {
+                fprintf(out, "%s\t%s\t%d\t%lld\n", snaps[i].name, snaps[i].created, snaps[i].files,
+                        (long long)snaps[i].size);
+            }
+            free(snaps);
+            return 0;
+        }
+        rc = n < 0 ? n : FS_ERR_NO_MEMORY;
+    } else if (strcmp(cmd, "snapshot-read") == 0) {
+        // snapshot-read <snapshot> <name> <offset> <length>
+        a = next_token(&p);
+        b = next_token(&p);
+        char *off = next_token(&p), *len = next_token(&p);
+        if (a && b && off && len) {
+            rc = batch_read(out, a, b, atoll(off), atoll(len));
+            if (rc == 0) return 0;
+        }
+    } else if (strcmp(cmd, "snapshot-cat") == 0) {
+        // snapshot-cat <snapshot> <name>: its size comes from the listing
+        // of the directory it is in
+        a = next_token(&p);
+        b = next_token(&p);
+        char dir[MAX_PATH_LEN] = "";
+        const char *slash = b ? strrchr(b, '/') : NULL;
+        if (slash && slash - b < MAX_PATH_LEN) {
+            memcpy(dir, b, slash - b);
+            dir[slash - b] = '\0';
+        }
+        int count = FS_ERR_INVALID;
+        struct FsFileInfo *files = a && b ? list_files(a, dir, &count) : NULL;
+        if (files) {
+            rc = FS_ERR_NOT_FOUND;
+            for (int i = 0; i < count; ++i) {
+                if (strcmp(files[i].name, slash ? slash + 1 : b) == 0 && !files[i].directory) {
+                    rc = batch_read(out, a, b, 0, files[i].size);
+                }
+            }
+            free(files);
+            if (rc == 0) return 0;
+        } else {
+            rc = count;
+        }
+    } else if (strcmp(cmd, "rollback") == 0) {
+        if ((a = next_token(&p))) rc = fs_rollback(a);
+    } else if (strcmp(cmd, "snapshot-delete") == 0) {
+        if ((a = next_token(&p))) rc = fs_snapshot_delete(a);
+    } else if (strcmp(cmd, "backup") == 0) {
+        if ((a = next_token(&p))) rc = fs_backup(a);
+    } else if (strcmp(cmd, "backup-incr") == 0) {
+        if ((a = next_token(&p))) rc = fs_backup_incremental(a);
+    } else if (strcmp(cmd, "restore") == 0) {
+        // restore <full backup> [incremental backup...]
+        const char *chain[64];
+        int count = 0;
+        while (count < 64 && (a = next_token(&p))) chain[count++] = a;
+        if (count > 0) rc = fs_restore_chain(chain, count);
+    } else if (strcmp(cmd, "sync") == 0) {
+        rc = fs_sync();
+    } else if (strcmp(cmd, "sync-policy") == 0) {
+        // sync-policy always | interval <ms> | close
+        a = next_token(&p);
+        b = next_token(&p);
+        if (a && strcmp(a, "always") == 0) rc = fs_set_sync_policy(SYNC_ALWAYS, 0);
+        else if (a && strcmp(a, "interval") == 0 && b) rc = fs_set_sync_policy(SYNC_INTERVAL, atoi(b));
+        else if (a && strcmp(a, "close") == 0) rc = fs_set_sync_policy(SYNC_ON_CLOSE, 0);
+    } else if (strcmp(cmd, "alloc-policy") == 0) {
+        // alloc-policy first | best | next
+        if ((a = next_token(&p))) {
+            if (strcmp(a, "first") == 0) rc = fs_set_alloc_policy(ALLOC_FIRST_FIT);
+            else if (strcmp(a, "best") == 0) rc = fs_set_alloc_policy(ALLOC_BEST_FIT);
+            else if (strcmp(a, "next") == 0) rc = fs_set_alloc_policy(ALLOC_NEXT_FIT);
+        }
+    } else if (strcmp(cmd, "cache") == 0) {
+        if ((a = next_token(&p))) rc = fs_set_cache_size(atoll(a));
+    } else if (strcmp(cmd, "cache-stats") == 0) {
+        // ok <hits> <misses> <evictions> <writebacks> <capacity> <dirty bytes>
+        struct CacheStats st;
+        fs_cache_stats(&st);
+        fprintf(out, "ok %llu %llu %llu %llu %lld %lld\n", (unsigned long long)st.hits,
+                (unsigned long long)st.misses, (unsigned long long)st.evictions,
+                (unsigned long long)st.writebacks, (long long)st.capacity, (long long)st.dirty);
+        return 0;
+    } else if (strcmp(cmd, "log") == 0) {
+        fflush(out);
+        rc = fs_log(fileno(out));
+    } else if (strcmp(cmd, "log-options") == 0) {
+        // log-options text|binary [background]
+        a = next_token(&p);
+        b = next_token(&p);
+        bool background = b && strcmp(b, "background") == 0;
+        if (a && strcmp(a, "text") == 0) rc = fs_set_log_options(LOG_TEXT, background);
+        else if (a && strcmp(a, "binary") == 0) rc = fs_set_log_options(LOG_BINARY, background);
+    }
+    if (rc < 0) {
+        batch_submit(out);  // earlier queued commands report first
+        fprintf(out, "err %s\n", cmd);
+        fprintf(stderr, "%s: %s\n", cmd, fs_strerror(rc));
+        return -1;
+    }
+    fprintf(out, "ok\n");
+    return 0;
+}
+
+// Run every ';'-separated command in text; returns the number of failures
+static long batch_run_text(char *text, FILE *out) {
+    long failures = 0;
+    char *cmd = text;
+    for (;;) {
+        char *end = cmd + strcspn(cmd, ";\n");
+        char sep = *end;
+        *end = '\0';
+        if (batch_exec(cmd, out) < 0) failures++;
+        if (sep == '\0') break;
+        cmd = end + 1;
+    }
+    return failures;
+}
+
+// Batch mode: simplefs [-m | -u] -c "cmd; cmd ..." | -f script | - (stdin)
+static int run_batch(int argc, char **argv) {
+    enum IoMode mode = IO_FD;
+    const char *script = NULL;
+    int first_cmd = 0;
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-m") == 0) {
+        mode = IO_MMAP;
+        i++;
+    } else if (i < argc && strcmp(argv[i], "-u") == 0) {
+        mode = IO_URING;
+        i++;
+    }
+    if (i < argc && strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+        first_cmd = i + 1;
+    } else if (i < argc && strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+        script = argv[i + 1];
+    } else if (i < argc && strcmp(argv[i], "-") == 0) {
+        script = "-";
+    } else {
+        fprintf(stderr, "Kullanım: %s [-m | -u] (-c \"komut; komut ...\" | -f betik | -)\n", argv[0]);
+        return 2;
+    }
+    FILE *in = NULL;
+    if (script) {
+        in = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+        if (!in) {
+            perror(script);
+            return 2;
+        }
+    }
+    FILE *out = stdout;
+    int rc = fs_init_io(mode);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", DISK_NAME, fs_strerror(rc));
+        return 1;
+    }
+    long failures = 0;
+    if (first_cmd) {
+        for (int k = first_cmd; k < argc; ++k) {
+            failures += batch_run_text(argv[k], out);
+        }
+    } else {
+        char *line = NULL;
+        size_t cap = 0;
+        while (getline(&line, &cap, in) >= 0) {
+            failures += batch_run_text(line, out);
+        }
+        free(line);
+        if (in != stdin) fclose(in);
+    }
+    batch_submit(out);
+    failures += queue_failures;
+    fs_close();
+    fflush(out);
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        return run_batch(argc, argv);
+    }
+    int rc = fs_init();
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", DISK_NAME, fs_strerror(rc));
         return 1;
     }
     printf("Basit Dosya Sistemi Simülatörü\n");
@@ -36,7 +635,9 @@ int main() {
         printf("18. Dosya içeriğini görüntüle (cat)\n");
         printf("19. İki dosyayı karşılaştır (diff)\n");
         printf("20. İşlem günlüğünü göster\n");
-        printf("21. Çıkış\n");
+        printf("21. Ana makineden dosya al (import)\n");
+        printf("22. Ana makineye dosya ver (export)\n");
+        printf("23. Çıkış\n");
         printf("Seçiminiz: ");
         if (!fgets(input, sizeof(input), stdin)) {
             break;
@@ -47,8 +648,8 @@ int main() {
                 printf("Oluşturulacak dosyanın adı: ");
                 if (!fgets(filename, sizeof(filename), stdin)) break;
                 filename[strcspn(filename, "\n")] = '\0';
-                if (strlen(filename) > 0) {
-                    fs_create(filename);
+                if (strlen(filename) > 0 && report(fs_create(filename))) {
+                    printf("Dosya '%s' oluşturuldu.\n", filename);
                 }
                 break;
             }
@@ -56,8 +657,8 @@ int main() {
                 printf("Silinecek dosyanın adı: ");
                 if (!fgets(filename, sizeof(filename), stdin)) break;
                 filename[strcspn(filename, "\n")] = '\0';
-                if (strlen(filename) > 0) {
-                    fs_delete(filename);
+                if (strlen(filename) > 0 && report(fs_delete(filename))) {
+                    printf("Dosya '%s' silindi.\n", filename);
                 }
                 break;
             }
@@ -78,7 +679,9 @@ int main() {
                     data[linelen-1] = '\0';
                     linelen--;
                 }
-                fs_write(filename, data, (int)linelen);
+                if (report(fs_write(filename, data, linelen))) {
+                    printf("Dosyaya '%s' %lld bayt veri yazıldı.\n", filename, (long long)linelen);
+                }
                 free(data);
                 break;
             }
@@ -89,27 +692,86 @@ int main() {
                 if (strlen(filename) == 0) break;
                 printf("Okuma başlangıç ofseti: ");
                 if (!fgets(input, sizeof(input), stdin)) break;
-                int offset = atoi(input);
+                long long offset = atoll(input);
                 printf("Okunacak byte sayısı: ");
                 if (!fgets(input, sizeof(input), stdin)) break;
-                int read_len = atoi(input);
+                long long read_len = atoll(input);
+                if (read_len < 0) read_len = 0;
                 char *read_buf = malloc(read_len + 1);
                 if (!read_buf) {
                     printf("Bellek yetersiz.\n");
                     break;
                 }
-                fs_read(filename, offset, read_len, read_buf);
+                int64_t got = fs_read(filename, offset, read_len, read_buf);
+                if (report(got)) {
+                    printf("Dosyadan okunan veri (%lld bayt): \"%.*s\"\n", (long long)got, (int)got, read_buf);
+                }
                 free(read_buf);
                 break;
             }
-            case 5:
-                fs_ls();
+            case 5: {
+                int count;
+                struct FsFileInfo *files = list_files(NULL, "", &count);
+                if (!files) {
+                    printf("Bellek yetersiz.\n");
+                    break;
+                }
+                if (count == 0) {
+                    printf("Dosya sistemi boş.\n");
+                } else {
+                    printf("Kök dizin (%d girdi; dizin adları '/' ile biter):\n", count);
+                    printf("%-20s %10s %10s %8s %20s\n", "Dosya Adı", "Boyut", "Diskte", "Oran",
+                           "Oluşturulma Tarihi");
+                    printf("------------------------------------------------------------------------------\n");
+                    for (int i = 0; i < count; ++i) {
+                        char ratio[32];
+                        char name[MAX_FILENAME_LEN + 1];
+                        snprintf(name, sizeof(name), "%s%s", files[i].name, files[i].directory ? "/" : "");
+                        printf("%-20s %10lld %10lld %8s %20s\n", name, (long long)files[i].size,
+                               (long long)files[i].stored, ratio_text(&files[i], ratio, sizeof(ratio)),
+                               files[i].created);
+                    }
+                    struct FsDedupStats st;
+                    if (fs_dedup_stats(&st) == 0 && st.mapped_blocks > 0) {
+                        printf("Diskte %lld blok (%lld bayt) kullanılıyor, dosyalar %lld blok eşliyor (%.2fx); "
+                               "%lld blok paylaşılıyor.\n",
+                               (long long)st.stored_blocks, (long long)(st.stored_blocks * st.block_size),
+                               (long long)st.mapped_blocks, (double)st.mapped_blocks / st.stored_blocks,
+                               (long long)st.shared_blocks);
+                        if (st.enabled) {
+                            printf("Tekilleştirme açık: bu oturumda %lld blok yazılmadan eşlendi.\n",
+                                   (long long)st.dedup_blocks);
+                        }
+                    }
+                }
+                free(files);
                 break;
+            }
             case 6: {
                 printf("Disk formatlanacak, emin misiniz? (E/H): ");
                 if (!fgets(input, sizeof(input), stdin)) break;
                 if (input[0] == 'E' || input[0] == 'e') {
-                    fs_format();
+                    // Empty answers keep the current geometry
+                    printf("Disk boyutu (bayt, boş = mevcut): ");
+                    if (!fgets(input, sizeof(input), stdin)) break;
+                    unsigned long long disk_size = strtoull(input, NULL, 10);
+                    printf("Maksimum dosya sayısı (boş = mevcut): ");
+                    if (!fgets(input, sizeof(input), stdin)) break;
+                    unsigned long max_files = strtoul(input, NULL, 10);
+                    printf("Blok boyutu (bayt, boş = mevcut): ");
+                    if (!fgets(input, sizeof(input), stdin)) break;
+                    unsigned long block_size = strtoul(input, NULL, 10);
+                    struct FsGeometry current;
+                    fs_geometry(&current);
+                    struct FsGeometry geometry = { disk_size, (uint32_t)max_files, (uint32_t)block_size, 0, 0 };
+                    if (geometry.disk_size == 0) geometry.disk_size = current.disk_size;
+                    if (geometry.max_files == 0) geometry.max_files = current.max_files;
+                    if (geometry.block_size == 0) geometry.block_size = current.block_size;
+                    if (geometry.max_files == current.max_files) geometry.max_extents = current.max_extents;
+                    if (geometry.disk_size == current.disk_size) geometry.journal_size = current.journal_size;
+                    if (report(fs_format_geometry(&geometry))) {
+                        printf("Disk formatlandı (tüm veriler silindi)\n");
+                    }
                 } else {
                     printf("Formatlama iptal edildi.\n");
                 }
@@ -124,7 +786,9 @@ int main() {
                 if (!fgets(filename2, sizeof(filename2), stdin)) break;
                 filename2[strcspn(filename2, "\n")] = '\0';
                 if (strlen(filename2) == 0) break;
-                fs_rename(filename, filename2);
+                if (report(fs_rename(filename, filename2))) {
+                    printf("Dosya '%s' yeni adı '%s' olarak değiştirildi.\n", filename, filename2);
+                }
                 break;
             }
             case 8: {
@@ -132,7 +796,7 @@ int main() {
                 if (!fgets(filename, sizeof(filename), stdin)) break;
                 filename[strcspn(filename, "\n")] = '\0';
                 if (strlen(filename) == 0) break;
-                fs_exists(filename);
+                printf("Dosya '%s' %s\n", filename, fs_exists(filename) ? "mevcut." : "mevcut değil.");
                 break;
             }
             case 9: {
@@ -140,7 +804,10 @@ int main() {
                 if (!fgets(filename, sizeof(filename), stdin)) break;
                 filename[strcspn(filename, "\n")] = '\0';
                 if (strlen(filename) == 0) break;
-                fs_size(filename);
+                int64_t size = fs_size(filename);
+                if (report(size)) {
+                    printf("Dosya '%s' boyutu: %lld bayt\n", filename, (long long)size);
+                }
                 break;
             }
             case 10: {
@@ -160,7 +827,9 @@ int main() {
                     data[linelen-1] = '\0';
                     linelen--;
                 }
-                fs_append(filename, data, (int)linelen);
+                if (report(fs_append(filename, data, linelen))) {
+                    printf("Dosyaya '%s' %lld bayt veri eklendi.\n", filename, (long long)linelen);
+                }
                 free(data);
                 break;
             }
@@ -171,8 +840,10 @@ int main() {
                 if (strlen(filename) == 0) break;
                 printf("Yeni boyut (byte): ");
                 if (!fgets(input, sizeof(input), stdin)) break;
-                int newsize = atoi(input);
-                fs_truncate(filename, newsize);
+                long long newsize = atoll(input);
+                if (report(fs_truncate(filename, newsize))) {
+                    printf("Dosya '%s' boyutu %lld bayta kısaltıldı.\n", filename, newsize);
+                }
                 break;
             }
             case 12: {
@@ -184,7 +855,9 @@ int main() {
                 if (!fgets(filename2, sizeof(filename2), stdin)) break;
                 filename2[strcspn(filename2, "\n")] = '\0';
                 if (strlen(filename2) == 0) break;
-                fs_copy(filename, filename2);
+                if (report(fs_copy(filename, filename2))) {
+                    printf("Dosya '%s' kopyası oluşturuldu -> '%s'\n", filename, filename2);
+                }
                 break;
             }
             case 13: {
@@ -196,29 +869,67 @@ int main() {
                 if (!fgets(filename2, sizeof(filename2), stdin)) break;
                 filename2[strcspn(filename2, "\n")] = '\0';
                 if (strlen(filename2) == 0) break;
-                fs_mv(filename, filename2);
+                if (report(fs_mv(filename, filename2))) {
+                    printf("Dosya '%s' -> '%s' taşındı.\n", filename, filename2);
+                }
                 break;
             }
-            case 14:
-                fs_defragment();
+            case 14: {
+                int moved_files;
+                int64_t moved_blocks;
+                if (report(fs_defragment(&moved_files, &moved_blocks))) {
+                    printf("Disk birleştirme tamamlandı (%d dosya, %lld blok taşındı).\n",
+                           moved_files, (long long)moved_blocks);
+                }
                 break;
-            case 15:
-                fs_check_integrity();
+            }
+            case 15: {
+                int issues = fs_check_integrity();
+                if (issues == 0) {
+                    printf("Dosya sistemi tutarlı.\n");
+                } else if (report(issues)) {
+                    printf("Bütünlük kontrolü tamamlandı, sorun sayısı: %d (ayrıntılar işlem günlüğünde)\n", issues);
+                }
+                printf("Veri bloklarının sağlama toplamları da taransın mı (scrub)? (e/h): ");
+                if (!fgets(input, sizeof(input), stdin) || (input[0] != 'e' && input[0] != 'E')) break;
+                struct FsScrubStats st;
+                int bad = fs_scrub(0, &st);
+                if (!report(bad)) break;
+                printf("%lld blok (%.1f MB) %d iş parçacığıyla %.3f sn'de tarandı: %.0f MB/sn.\n",
+                       (long long)st.blocks, st.bytes / 1e6, st.threads, st.seconds,
+                       st.seconds > 0 ? st.bytes / st.seconds / 1e6 : 0.0);
+                if (bad == 0) {
+                    printf("Tüm bloklar sağlam.\n");
+                } else {
+                    printf("Bozuk blok sayısı: %d (ilki %lld. blok)\n", bad, (long long)st.first_bad);
+                }
                 break;
+            }
             case 16: {
                 printf("Yedek dosya adı: ");
                 if (!fgets(filename, sizeof(filename), stdin)) break;
                 filename[strcspn(filename, "\n")] = '\0';
                 if (strlen(filename) == 0) break;
-                fs_backup(filename);
+                printf("Artımlı yedek mi (son yedekten beri değişen bloklar)? (e/h): ");
+                if (!fgets(input, sizeof(input), stdin)) break;
+                bool incremental = input[0] == 'e' || input[0] == 'E';
+                if (report(incremental ? fs_backup_incremental(filename) : fs_backup(filename))) {
+                    printf("Disk %syedeği '%s' dosyasına alındı.\n", incremental ? "artımlı " : "", filename);
+                }
                 break;
             }
             case 17: {
-                printf("Yedekten yüklenecek dosya adı: ");
-                if (!fgets(filename, sizeof(filename), stdin)) break;
-                filename[strcspn(filename, "\n")] = '\0';
-                if (strlen(filename) == 0) break;
-                fs_restore(filename);
+                printf("Yedek dosya adları (önce tam yedek, sonra artımlılar sırayla, boşlukla ayrılmış): ");
+                if (!fgets(input, sizeof(input), stdin)) break;
+                const char *chain[64];
+                int count = 0;
+                for (char *tok = strtok(input, " \t\n"); tok && count < 64; tok = strtok(NULL, " \t\n")) {
+                    chain[count++] = tok;
+                }
+                if (count == 0) break;
+                if (report(fs_restore_chain(chain, count))) {
+                    printf("Disk %d yedek dosyasından geri yüklendi.\n", count);
+                }
                 break;
             }
             case 18: {
@@ -226,7 +937,10 @@ int main() {
                 if (!fgets(filename, sizeof(filename), stdin)) break;
                 filename[strcspn(filename, "\n")] = '\0';
                 if (strlen(filename) == 0) break;
-                fs_cat(filename);
+                fflush(stdout);
+                int64_t size = fs_cat(filename, STDOUT_FILENO);
+                if (size == 0) printf("(boş dosya)");
+                if (report(size)) printf("\n");
                 break;
             }
             case 19: {
@@ -238,13 +952,68 @@ int main() {
                 if (!fgets(filename2, sizeof(filename2), stdin)) break;
                 filename2[strcspn(filename2, "\n")] = '\0';
                 if (strlen(filename2) == 0) break;
-                fs_diff(filename, filename2);
+                int64_t first_diff;
+                int rc = fs_diff(filename, filename2, &first_diff);
+                if (!report(rc)) break;
+                if (rc == 0) {
+                    printf("Dosyalar aynıdır (içerikleri aynı).\n");
+                } else if (first_diff >= 0) {
+                    printf("Dosyalar farklı: ilk fark %lld. baytta\n", (long long)first_diff);
+                } else {
+                    printf("Dosyalar farklı: boyutları farklı (%lld vs %lld bayt)\n",
+                           (long long)fs_size(filename), (long long)fs_size(filename2));
+                }
+                // Where they differ: the second file in terms of the first
+                int count;
+                struct FsDeltaStats st;
+                struct FsDeltaRange *ranges = delta_ranges(filename, filename2, 0, &count, &st);
+                if (!ranges) {
+                    report(count < 0 ? count : FS_ERR_NO_MEMORY);
+                    break;
+                }
+                printf("Fark özeti (%lld baytlık bloklarla): %lld bayt ortak, %lld bayt farklı, %d aralık\n",
+                       (long long)st.block_size, (long long)st.copied, (long long)st.literal, count);
+                for (int i = 0; i < count && i < 20; ++i) {
+                    long long from = ranges[i].new_off, to = ranges[i].new_off + ranges[i].len - 1;
+                    if (ranges[i].type == FS_DELTA_COPY) {
+                        printf("  %lld-%lld: birinci dosyanın %lld. baytından itibaren aynı\n", from, to,
+                               (long long)ranges[i].old_off);
+                    } else {
+                        printf("  %lld-%lld: yeni içerik\n", from, to);
+                    }
+                }
+                if (count > 20) printf("  ... %d aralık daha\n", count - 20);
+                free(ranges);
                 break;
             }
             case 20:
-                fs_log();
+                printf("\nİşlem Günlüğü:\n");
+                fflush(stdout);
+                if (fs_log(STDOUT_FILENO) < 0) printf("Log okunamadı.\n");
                 break;
             case 21:
+            case 22: {
+                printf(choice == 21 ? "Ana makinedeki dosya yolu: " : "Dosya adı: ");
+                if (!fgets(filename, sizeof(filename), stdin)) break;
+                filename[strcspn(filename, "\n")] = '\0';
+                if (strlen(filename) == 0) break;
+                printf(choice == 21 ? "Dosya adı: " : "Ana makinedeki dosya yolu: ");
+                if (!fgets(filename2, sizeof(filename2), stdin)) break;
+                filename2[strcspn(filename2, "\n")] = '\0';
+                if (strlen(filename2) == 0) break;
+                if (choice == 21) {
+                    if (report(fs_import(filename, filename2))) {
+                        printf("'%s' içe aktarıldı (%lld bayt).\n", filename2, (long long)fs_size(filename2));
+                    }
+                } else {
+                    int64_t size = fs_export(filename, filename2);
+                    if (report(size)) {
+                        printf("'%s' dosyası '%s' yoluna yazıldı (%lld bayt).\n", filename, filename2, (long long)size);
+                    }
+                }
+                break;
+            }
+            case 23:
                 printf("Çıkış yapılıyor...\n");
                 fs_close();
                 return 0;
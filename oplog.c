@@ -0,0 +1,271 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "oplog.h"
+
+#define RING_SIZE 8192                // records; a power of two
+#define RING_MASK (RING_SIZE - 1)
+#define DRAIN_THRESHOLD (RING_SIZE / 2)
+#define DRAIN_INTERVAL_NS 10000000L   // background thread wakes every 10 ms
+#define OUT_BUFFER 65536
+
+struct LogRecord {
+    int64_t time;       // seconds since the epoch
+    int32_t result;
+    char operation[28];
+    char detail[48];
+};
+
+// Ring slot: seq == position when free for that position, position + 1 when
+// filled (bounded queue with per-slot sequence numbers)
+struct Slot {
+    uint64_t seq;
+    struct LogRecord rec;
+};
+
+// Binary record header; the operation and detail bytes follow it
+struct LogBinaryRecord {
+    uint32_t time;
+    int8_t result;
+    uint8_t op_len;
+    uint8_t detail_len;
+    uint8_t reserved;
+};
+
+static struct Slot ring[RING_SIZE];
+static uint64_t tail = 0;        // next position producers claim
+static uint64_t head = 0;        // next position the consumer drains
+static int draining = 0;         // consumer lock, taken with a test-and-set
+static uint64_t dropped = 0;     // records lost to a full ring
+static int64_t clock_sec = 0;    // cached time, refreshed by the drain thread
+static int64_t last_drain = 0;
+
+static int log_fd = -1;
+static enum LogFormat log_format = LOG_TEXT;
+static char log_path[256];
+static pthread_t drain_thread;
+static bool thread_running = false;
+static int stop_thread = 0;
+
+// Formatted text of the last second a text line was written for
+struct StampCache {
+    int64_t sec;
+    char text[20];
+};
+static struct StampCache drain_stamp = { -1, "" };
+
+static int64_t now_sec() {
+    if (thread_running) return __atomic_load_n(&clock_sec, __ATOMIC_RELAXED);
+    return time(NULL);
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+// Append one record to out in the given format; returns bytes used
+static size_t format_record(char *out, const struct LogRecord *r, enum LogFormat format,
+                            struct StampCache *stamp) {
+    if (format == LOG_BINARY) {
+        struct LogBinaryRecord b;
+        b.time = (uint32_t)r->time;
+        b.result = r->result == 0 ? 0 : -1;
+        b.op_len = strlen(r->operation);
+        b.detail_len = strlen(r->detail);
+        b.reserved = 0;
+        memcpy(out, &b, sizeof(b));
+        memcpy(out + sizeof(b), r->operation, b.op_len);
+        memcpy(out + sizeof(b) + b.op_len, r->detail, b.detail_len);
+        return sizeof(b) + b.op_len + b.detail_len;
+    }
+    if (r->time != stamp->sec) {
+        time_t t = r->time;
+        struct tm tm_info;
+        localtime_r(&t, &tm_info);
+        strftime(stamp->text, sizeof(stamp->text), "%Y-%m-%d %H:%M:%S", &tm_info);
+        stamp->sec = r->time;
+    }
+    const char *status = r->result == 0 ? "SUCCESS" : "FAIL";
+    if (r->detail[0])
+        return sprintf(out, "%s - %s: %s %s\n", stamp->text, r->operation, r->detail, status);
+    return sprintf(out, "%s - %s %s\n", stamp->text, r->operation, status);
+}
+
+// Write out every filled slot. Only one caller drains at a time; others
+// return 0 at once and leave the records to it.
+static int drain() {
+    if (__atomic_exchange_n(&draining, 1, __ATOMIC_ACQUIRE)) return 0;
+    static char out[OUT_BUFFER];
+    size_t used = 0;
+    uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        struct LogRecord r;
+        memset(&r, 0, sizeof(r));
+        r.time = now_sec();
+        r.result = -1;
+        strcpy(r.operation, "oplog_dropped");
+        snprintf(r.detail, sizeof(r.detail), "%llu", (unsigned long long)lost);
+        used += format_record(out + used, &r, log_format, &drain_stamp);
+    }
+    for (;;) {
+        struct Slot *s = &ring[head & RING_MASK];
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != head + 1) break;
+        if (used > OUT_BUFFER - 256) {
+            write_all(out, used);
+            used = 0;
+        }
+        used += format_record(out + used, &s->rec, log_format, &drain_stamp);
+        __atomic_store_n(&s->seq, head + RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&head, head + 1, __ATOMIC_RELAXED);
+    }
+    if (used > 0) write_all(out, used);
+    __atomic_store_n(&last_drain, now_sec(), __ATOMIC_RELAXED);
+    __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void *drain_main(void *arg) {
+    (void)arg;
+    struct timespec interval = { 0, DRAIN_INTERVAL_NS };
+    while (!__atomic_load_n(&stop_thread, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&clock_sec, (int64_t)time(NULL), __ATOMIC_RELAXED);
+        drain();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+int oplog_open(const char *path, enum LogFormat format, bool background) {
+    oplog_close();
+    log_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (log_fd < 0) return -1;
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    log_format = format;
+    for (uint64_t i = 0; i < RING_SIZE; ++i) {
+        ring[i].seq = i;
+    }
+    tail = head = 0;
+    dropped = 0;
+    clock_sec = last_drain = time(NULL);
+    if (background) {
+        stop_thread = 0;
+        thread_running = pthread_create(&drain_thread, NULL, drain_main, NULL) == 0;
+    }
+    return 0;
+}
+
+void oplog_record(const char *operation, const char *detail, int result) {
+    if (log_fd < 0) return;
+    int64_t sec = now_sec();
+    bool retried = false;
+    uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    struct Slot *s;
+    for (;;) {
+        s = &ring[pos & RING_MASK];
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)(seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (dif < 0) {
+            // Full: drain once ourselves, then give up on this record
+            if (retried) {
+                __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            drain();
+            retried = true;
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+    s->rec.time = sec;
+    s->rec.result = result;
+    strncpy(s->rec.operation, operation, sizeof(s->rec.operation) - 1);
+    s->rec.operation[sizeof(s->rec.operation) - 1] = '\0';
+    if (detail) {
+        strncpy(s->rec.detail, detail, sizeof(s->rec.detail) - 1);
+        s->rec.detail[sizeof(s->rec.detail) - 1] = '\0';
+    } else {
+        s->rec.detail[0] = '\0';
+    }
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    // Without a drain thread, the caller writes the batch out on a size or time threshold
+    if (!thread_running && (pos + 1 - __atomic_load_n(&head, __ATOMIC_RELAXED) >= DRAIN_THRESHOLD ||
+                            sec != __atomic_load_n(&last_drain, __ATOMIC_RELAXED))) {
+        drain();
+    }
+}
+
+void oplog_flush() {
+    if (log_fd < 0) return;
+    // Wait out a drain in progress on another thread so nothing is left behind
+    while (!drain()) {
+        sched_yield();
+    }
+}
+
+int oplog_dump(int out_fd) {
+    if (log_fd < 0) return -1;
+    oplog_flush();
+    int fd = open(log_path, O_RDONLY);
+    if (fd < 0) return -1;
+    char buffer[4096];
+    ssize_t bytes;
+    if (log_format == LOG_TEXT) {
+        while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+            write(out_fd, buffer, bytes);
+        }
+        close(fd);
+        return 0;
+    }
+    // Binary: decode each record back into a text line
+    FILE *in = fdopen(fd, "rb");
+    if (!in) {
+        close(fd);
+        return -1;
+    }
+    struct StampCache stamp = { -1, "" };
+    struct LogBinaryRecord b;
+    while (fread(&b, sizeof(b), 1, in) == 1) {
+        struct LogRecord r;
+        memset(&r, 0, sizeof(r));
+        r.time = b.time;
+        r.result = b.result;
+        size_t op_len = b.op_len < sizeof(r.operation) ? b.op_len : sizeof(r.operation) - 1;
+        size_t detail_len = b.detail_len < sizeof(r.detail) ? b.detail_len : sizeof(r.detail) - 1;
+        if (fread(r.operation, 1, op_len, in) != op_len ||
+            fseek(in, b.op_len - op_len, SEEK_CUR) < 0 ||
+            fread(r.detail, 1, detail_len, in) != detail_len ||
+            fseek(in, b.detail_len - detail_len, SEEK_CUR) < 0) break;
+        size_t len = format_record(buffer, &r, LOG_TEXT, &stamp);
+        write(out_fd, buffer, len);
+    }
+    fclose(in);
+    return 0;
+}
+
+void oplog_close() {
+    if (thread_running) {
+        __atomic_store_n(&stop_thread, 1, __ATOMIC_RELEASE);
+        pthread_join(drain_thread, NULL);
+        thread_running = false;
+    }
+    if (log_fd >= 0) {
+        drain();
+        close(log_fd);
+        log_fd = -1;
+    }
+}
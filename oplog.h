@@ -0,0 +1,22 @@
+#ifndef SIMPLEFS_OPLOG_H
+#define SIMPLEFS_OPLOG_H
+
+#include <stdbool.h>
+
+// On-disk formats of the operation log
+enum LogFormat {
+    LOG_TEXT = 0,  // one "YYYY-MM-DD HH:MM:SS - op: detail SUCCESS" line per record
+    LOG_BINARY     // packed records: time, result, operation and detail lengths, names
+};
+
+// Buffered operation logger. Records are claimed in a lock-free ring buffer
+// and formatted and written in batches, either by a background thread or by
+// the caller once enough records are pending or a second has passed.
+// Timestamps are kept at one-second resolution.
+int oplog_open(const char *path, enum LogFormat format, bool background);
+void oplog_record(const char *operation, const char *detail, int result);
+void oplog_flush();           // write every pending record now
+int oplog_dump(int out_fd);   // flush, then print the log as text to out_fd
+void oplog_close();           // flush, stop the drain thread, close the file
+
+#endif // SIMPLEFS_OPLOG_H
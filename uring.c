@@ -0,0 +1,277 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE  // syscall
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+#define MAX_REQUEST_LEN (1u << 30)  // longer transfers come back short
+
+// One queued or in-flight request; its submission entry's user_data points here
+struct Request {
+    uring_done_fn done;
+    void *ctx;
+    struct Request *next;  // free list
+};
+
+static int ring_fd = -1;
+static void *sq_ring = NULL, *cq_ring = NULL;
+static size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned sq_entries = 0;
+static struct io_uring_sqe *sqes = NULL;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned queued = 0;     // entries filled in but not yet submitted
+static unsigned in_flight = 0;  // submitted, completion not yet reaped
+
+// As many requests as completion slots, so the completion ring cannot overflow
+static struct Request *requests = NULL;
+static struct Request *free_requests = NULL;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void unmap_rings() {
+    if (sqes) munmap(sqes, sqes_size);
+    if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring) munmap(sq_ring, sq_ring_size);
+    sqes = NULL;
+    sq_ring = cq_ring = NULL;
+}
+
+int uring_open(unsigned entries) {
+    uring_close();
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return -1;
+    ring_fd = fd;
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) sq_ring = NULL;
+    if (sq_ring && (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ring = sq_ring;
+    } else if (sq_ring) {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) cq_ring = NULL;
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (cq_ring) {
+        sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) sqes = NULL;
+    }
+    requests = calloc(p.cq_entries, sizeof(struct Request));
+    if (!sqes || !requests) {
+        unmap_rings();
+        free(requests);
+        requests = NULL;
+        close(fd);
+        ring_fd = -1;
+        return -1;
+    }
+    char *sq = sq_ring, *cq = cq_ring;
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    sq_entries = p.sq_entries;
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    free_requests = NULL;
+    for (unsigned i = 0; i < p.cq_entries; ++i) {
+        requests[i].next = free_requests;
+        free_requests = &requests[i];
+    }
+    queued = in_flight = 0;
+    return 0;
+}
+
+int uring_enabled() {
+    return ring_fd >= 0;
+}
+
+// Run the callbacks of every finished request; returns how many there were
+static int reap_locked() {
+    int count = 0;
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        struct Request *r = (struct Request *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+        in_flight--;
+        uring_done_fn done = r->done;
+        void *ctx = r->ctx;
+        r->next = free_requests;
+        free_requests = r;
+        if (done) done(ctx, res);
+        count++;
+    }
+    return count;
+}
+
+// Submit the queued entries and, if wait is set, block until a completion
+// is ready; then reap
+static int enter_locked(int wait) {
+    if (queued > 0 || wait) {
+        int n;
+        do {
+            n = syscall(__NR_io_uring_enter, ring_fd, queued, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) return -1;
+        queued -= n;
+        in_flight += n;
+    }
+    return reap_locked();
+}
+
+// Fill in the next submission entry
+static int queue_locked(uint8_t opcode, int fd, const void *addr, unsigned len, int64_t off,
+                        uring_done_fn done, void *ctx) {
+    if (ring_fd < 0) return -1;
+    // Every request slot is taken: make room by finishing one
+    while (!free_requests) {
+        if (enter_locked(1) < 0) return -1;
+    }
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        if (enter_locked(0) < 0) return -1;
+    }
+    struct Request *r = free_requests;
+    free_requests = r->next;
+    r->done = done;
+    r->ctx = ctx;
+    unsigned idx = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = (uint64_t)off;
+    sqe->user_data = (uint64_t)(uintptr_t)r;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+    return 0;
+}
+
+static int queue(uint8_t opcode, int fd, const void *addr, size_t len, int64_t off,
+                 uring_done_fn done, void *ctx) {
+    if (len > MAX_REQUEST_LEN) len = MAX_REQUEST_LEN;
+    pthread_mutex_lock(&ring_lock);
+    int rc = queue_locked(opcode, fd, addr, (unsigned)len, off, done, ctx);
+    pthread_mutex_unlock(&ring_lock);
+    return rc;
+}
+
+int uring_queue_read(int fd, void *buf, size_t len, int64_t off, uring_done_fn done, void *ctx) {
+    return queue(IORING_OP_READ, fd, buf, len, off, done, ctx);
+}
+
+int uring_queue_write(int fd, const void *buf, size_t len, int64_t off, uring_done_fn done, void *ctx) {
+    return queue(IORING_OP_WRITE, fd, buf, len, off, done, ctx);
+}
+
+int uring_queue_readv(int fd, const struct iovec *iov, int count, int64_t off, uring_done_fn done, void *ctx) {
+    return queue(IORING_OP_READV, fd, iov, count, off, done, ctx);
+}
+
+int uring_queue_writev(int fd, const struct iovec *iov, int count, int64_t off, uring_done_fn done, void *ctx) {
+    return queue(IORING_OP_WRITEV, fd, iov, count, off, done, ctx);
+}
+
+int uring_queue_fsync(int fd, uring_done_fn done, void *ctx) {
+    return queue(IORING_OP_FSYNC, fd, NULL, 0, 0, done, ctx);
+}
+
+int uring_submit() {
+    pthread_mutex_lock(&ring_lock);
+    int rc = ring_fd < 0 ? -1 : enter_locked(0) < 0 ? -1 : 0;
+    pthread_mutex_unlock(&ring_lock);
+    return rc;
+}
+
+int uring_poll() {
+    pthread_mutex_lock(&ring_lock);
+    int rc = ring_fd < 0 ? -1 : enter_locked(0);
+    pthread_mutex_unlock(&ring_lock);
+    return rc;
+}
+
+int uring_drain() {
+    int rc = 0;
+    pthread_mutex_lock(&ring_lock);
+    while (ring_fd >= 0 && rc == 0 && (queued > 0 || in_flight > 0)) {
+        if (enter_locked(1) < 0) rc = -1;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return rc;
+}
+
+// ---- synchronous forms ----
+
+struct SyncWait {
+    int finished;
+    int result;
+};
+
+static void sync_done(void *ctx, int result) {
+    struct SyncWait *w = ctx;
+    w->result = result;
+    w->finished = 1;
+}
+
+// Queue one request and wait for its own completion (others that finish
+// meanwhile run their callbacks too)
+static int run_sync(uint8_t opcode, int fd, const void *addr, size_t len, int64_t off) {
+    struct SyncWait w = { 0, 0 };
+    if (len > MAX_REQUEST_LEN) len = MAX_REQUEST_LEN;
+    pthread_mutex_lock(&ring_lock);
+    int rc = queue_locked(opcode, fd, addr, (unsigned)len, off, sync_done, &w);
+    while (rc == 0 && !w.finished) {
+        if (enter_locked(1) < 0) rc = -1;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    if (rc < 0) return -1;
+    if (w.result < 0) {
+        errno = -w.result;
+        return -1;
+    }
+    return w.result;
+}
+
+ssize_t uring_pread(int fd, void *buf, size_t len, int64_t off) {
+    return run_sync(IORING_OP_READ, fd, buf, len, off);
+}
+
+ssize_t uring_pwrite(int fd, const void *buf, size_t len, int64_t off) {
+    return run_sync(IORING_OP_WRITE, fd, buf, len, off);
+}
+
+int uring_fsync(int fd) {
+    return run_sync(IORING_OP_FSYNC, fd, NULL, 0, 0) < 0 ? -1 : 0;
+}
+
+void uring_close() {
+    if (ring_fd < 0) return;
+    uring_drain();
+    unmap_rings();
+    free(requests);
+    requests = free_requests = NULL;
+    close(ring_fd);
+    ring_fd = -1;
+}
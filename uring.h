@@ -0,0 +1,35 @@
+#ifndef SIMPLEFS_URING_H
+#define SIMPLEFS_URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Completion callback: result is what the matching system call would have
+// returned (bytes transferred, 0 for fsync), or -errno
+typedef void (*uring_done_fn)(void *ctx, int result);
+
+// Asynchronous disk I/O on one io_uring instance shared by all threads.
+// Requests are queued with uring_queue_*, handed to the kernel by
+// uring_submit (or automatically when the queue is full), and finish by
+// running their callback inside uring_poll, uring_drain or any other
+// engine call of any thread; callbacks must not call back into the engine.
+// Buffers and iovec arrays must stay valid until the request completes.
+int uring_open(unsigned entries);  // 0, or -1 when io_uring is unavailable
+void uring_close();                // waits for requests in flight
+int uring_enabled();
+int uring_queue_read(int fd, void *buf, size_t len, int64_t off, uring_done_fn done, void *ctx);
+int uring_queue_write(int fd, const void *buf, size_t len, int64_t off, uring_done_fn done, void *ctx);
+int uring_queue_readv(int fd, const struct iovec *iov, int count, int64_t off, uring_done_fn done, void *ctx);
+int uring_queue_writev(int fd, const struct iovec *iov, int count, int64_t off, uring_done_fn done, void *ctx);
+int uring_queue_fsync(int fd, uring_done_fn done, void *ctx);
+int uring_submit();  // pass queued requests to the kernel
+int uring_poll();    // submit, then run the callbacks of finished requests without blocking
+int uring_drain();   // submit and wait until nothing is in flight
+
+// Synchronous forms: queue one request and wait for it
+ssize_t uring_pread(int fd, void *buf, size_t len, int64_t off);
+ssize_t uring_pwrite(int fd, const void *buf, size_t len, int64_t off);
+int uring_fsync(int fd);
+
+#endif // SIMPLEFS_URING_H